@@ -0,0 +1,59 @@
+const fs = require('fs');
+const { encodePNG, decodePNG, encodePNGSync, decodePNGSync } = require('./index');
+
+// usage: node benchmark.js [file.png] [iterations]
+const args = process.argv.slice(2);
+const pngFilePath = args[0] || './test/interlace.png'; // Default PNG file path
+
+const iterations = parseInt(args[1] || 20, 10);
+
+async function measure(name, bytes, fn) {
+  await fn(); // warm up
+
+  let best = Infinity;
+  for (let i = 0; i < iterations; i++) {
+    const start = process.hrtime.bigint();
+    await fn();
+    best = Math.min(best, Number(process.hrtime.bigint() - start) / 1e6);
+  }
+
+  const throughput = bytes / (1024 * 1024) / (best / 1000);
+  console.log(name.padEnd(32), `${best.toFixed(2)} ms`.padStart(12), `${throughput.toFixed(1)} MB/s`.padStart(12));
+}
+
+async function run() {
+  const image = await decodePNG(fs.readFileSync(pngFilePath));
+  const bytes = image.width * image.height * 4;
+  console.log(`${pngFilePath}: ${image.width}x${image.height}, best of ${iterations}`);
+
+  for (const compressionLevel of [1, 2, 3, 6, 9]) {
+    await measure(`encode level ${compressionLevel}`, bytes,
+      () => encodePNG(image.width, image.height, image.data, { compressionLevel }));
+  }
+
+  // fpng output is decoded by fpng's own inflater, everything else by wuffs
+  for (const compressionLevel of [-1, 6]) {
+    const png = await encodePNG(image.width, image.height, image.data, { compressionLevel });
+    await measure(`decode level ${compressionLevel}`, bytes, () => decodePNG(png));
+  }
+
+  // per-call overhead of the async (threadpool + Promise) and sync paths on a thumbnail
+  const thumbData = Buffer.alloc(32 * 32 * 4, 0x80);
+  const thumb = encodePNGSync(32, 32, thumbData, { compressionLevel: -1 });
+  const calls = 1000;
+  const thumbBytes = thumbData.length * calls;
+  await measure(`encodePNG 32x32 x${calls}`, thumbBytes, async () => {
+    for (let i = 0; i < calls; i++) await encodePNG(32, 32, thumbData, { compressionLevel: -1 });
+  });
+  await measure(`encodePNGSync 32x32 x${calls}`, thumbBytes, async () => {
+    for (let i = 0; i < calls; i++) encodePNGSync(32, 32, thumbData, { compressionLevel: -1 });
+  });
+  await measure(`decodePNG 32x32 x${calls}`, thumbBytes, async () => {
+    for (let i = 0; i < calls; i++) await decodePNG(thumb);
+  });
+  await measure(`decodePNGSync 32x32 x${calls}`, thumbBytes, async () => {
+    for (let i = 0; i < calls; i++) decodePNGSync(thumb);
+  });
+}
+
+run();
@@ -28,12 +28,24 @@
                 "libpng/pngrtran.c",
                 "libpng/pngrutil.c",
                 "libpng/pngset.c",
-                "libpng/pngtest.c",
                 "libpng/pngtrans.c",
                 "libpng/pngwio.c",
                 "libpng/pngwrite.c",
                 "libpng/pngwtran.c",
                 "libpng/pngwutil.c"
+            ],
+            "conditions": [
+                # SSE2 is part of the x86-64 baseline, libpng selects the
+                # implementation from the compiler's target flags.
+                ['target_arch in "ia32 x64"', {
+                    "defines": [
+                        "PNG_INTEL_SSE"
+                    ],
+                    "sources": [
+                        "libpng/intel/intel_init.c",
+                        "libpng/intel/filter_sse2_intrinsics.c"
+                    ]
+                }]
             ]
         }
     ]
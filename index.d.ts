@@ -1,3 +1,5 @@
+import { Transform } from 'stream';
+
 /** Constant used in PNG encoding methods. */
 export const PNG_NO_FILTERS: number;
 /** Constant used in PNG encoding methods. */
@@ -13,6 +15,13 @@ export const PNG_FILTER_AVG: number;
 /** Constant used in PNG encoding methods. */
 export const PNG_FILTER_PAETH: number;
 
+/**
+ * Scheduling class of an async job on the codec threads. `interactive` jobs
+ * are picked first, `background` jobs never occupy the last free thread.
+ * Defaults to `interactive`.
+ */
+export type CodecPriority = 'interactive' | 'background';
+
 export interface PngConfig {
 	/** Specifies the ZLIB compression level. Defaults to 6. */
 	compressionLevel?: 0 | 1 | 2 | 3 | 4 | 5 | 6 | 7 | 8 | 9;
@@ -27,7 +36,10 @@ export interface PngConfig {
 	filters?: number;
 	/**
 	 * _For creating indexed PNGs._ The palette of colors. Entries should be in
-	 * RGBA order.
+	 * RGBA order, up to 256 of them. Every pixel of `data` must exactly match
+	 * one of the entries. The bit depth (1, 2, 4 or 8) is picked from the
+	 * palette size. Indexed PNGs are always written by libpng, a
+	 * `compressionLevel` of 0 or -1 uses its fastest level.
 	 */
 	palette?: Uint8ClampedArray;
 	/**
@@ -35,22 +47,362 @@ export interface PngConfig {
 	 * to 0.
 	 */
 	backgroundIndex?: number;
+	/**
+	 * Scan the pixels and write the smallest color type that stores them
+	 * losslessly: gray, gray + alpha, RGB or indexed (up to 256 colors) with
+	 * libpng, RGB instead of RGBA for opaque images with the fast encoder.
+	 * Defaults to false.
+	 */
+	optimizeColorType?: boolean;
 	/** pixels per inch */
 	resolution?: number;
+	/**
+	 * Number of threads used by the fast encoder (`compressionLevel` 0 or -1).
+	 * Large images are split into horizontal strips which are compressed in
+	 * parallel. 0 uses one thread per CPU core, larger values are capped at
+	 * the number of cores. Must be between 0 and 256. Defaults to 1.
+	 */
+	threads?: number;
+	/**
+	 * Layout of `data`: RGBA (default) or BGRA, with straight or
+	 * premultiplied alpha. The pixels are converted to straight RGBA row by
+	 * row while encoding, `data` itself is not modified. `palette` entries
+	 * stay straight RGBA.
+	 *
+	 * `rgba16`, `rgb16` and `gray16` write a 16 bit PNG of that color type
+	 * from 16 bit samples in host byte order, e.g. the buffer of a
+	 * `Uint16Array`. They always use libpng and can't be combined with
+	 * `palette`; `optimizeColorType` drops alpha from opaque `rgba16` input.
+	 */
+	inputFormat?: 'rgba' | 'bgra' | 'rgba-premul' | 'bgra-premul' | 'rgba16' | 'rgb16' | 'gray16';
+	/**
+	 * Encode a sub-view of `data` without copying it out: rows start at byte
+	 * `offset` (default 0) and are `stride` bytes apart (default one row of
+	 * pixels, `width * 4` for RGBA, at least that). `data` then only has to reach the end of the last row.
+	 * Ignored by `createPNGEncoder`, which takes whole rows.
+	 */
+	stride?: number;
+	offset?: number;
+	priority?: CodecPriority;
+	/**
+	 * Cancels the job: a queued job is dropped, a running one stops at the
+	 * next row band or block. The Promise rejects with an `AbortError`.
+	 */
+	signal?: AbortSignal;
+}
+
+export interface WebPLosslessConfig {
+	/**
+	 * 0 (fastest) to 9 (smallest), default 4. Effort 0 only uses the row
+	 * above for prediction and runs for matching, in the speed range of
+	 * `compressionLevel: -1` PNGs.
+	 */
+	effort?: number;
+	priority?: CodecPriority;
+	/** Cancels the job, like `PngConfig.signal`. */
+	signal?: AbortSignal;
 }
 
 export interface DecodedImageData {
 	width: number;
 	height: number;
 	data: Buffer;
+	/**
+	 * Detected file format, named like `ImageInfo.format`. Set by `decode`,
+	 * `decodeSync` and `decodeBatch`.
+	 */
+	format?: string;
+}
+
+/** Result of a `pixelFormat: 'rgba16'` decode. */
+export interface DecodedImageData16 extends Omit<DecodedImageData, 'data'> {
+	/** 4 samples per pixel, 0 to 65535. */
+	data: Uint16Array;
 }
 
 export interface DecodeOptions {
 	premultiplied: boolean;
+	/**
+	 * `rgba` (default) gives 8 bit RGBA. `bgra`, `rgb` (3 bytes per pixel),
+	 * `gray` (1) and `graya` (2) are converted while decoding, which saves a
+	 * pass over the pixels afterwards. `bgra-premul` is `bgra` with
+	 * `premultiplied: true`. Without alpha, `rgb` and `gray` are composited
+	 * over black; gray is the JFIF luma (0.299 R + 0.587 G + 0.114 B).
+	 *
+	 * `rgba16` gives 16 bit RGBA as a `Uint16Array`, `rgba16be` the same
+	 * samples as big endian bytes in a Buffer. 16 bit PNGs keep their full
+	 * precision, everything else is widened (`x * 257`). The 16 bit formats
+	 * can't be combined with `scale`, `maxWidth` or `maxHeight`.
+	 */
+	pixelFormat?: 'rgba' | 'bgra' | 'bgra-premul' | 'rgb' | 'gray' | 'graya' | 'rgba16' | 'rgba16be';
+	/**
+	 * Shrink-on-load: averages blocks of 2x2, 4x4 or 8x8 pixels while
+	 * decoding, for thumbnails. Non-interlaced PNGs are shrunk row by row
+	 * and never allocate the full size image; interlaced PNGs and WebP are
+	 * decoded in full first. Defaults to 1.
+	 */
+	scale?: 1 | 0.5 | 0.25 | 0.125;
+	/**
+	 * Shrinks by the smallest whole factor (like `scale`, but any factor)
+	 * that makes the image fit. Images that already fit are not scaled.
+	 */
+	maxWidth?: number;
+	maxHeight?: number;
+	/**
+	 * Decodes only this rectangle of the image, in source pixels. Non-interlaced
+	 * PNGs stop inflating after its last row and only allocate the region;
+	 * interlaced PNGs and WebP are cropped after a full decode. Rejects if
+	 * the region is not inside the image. `scale`, `maxWidth` and `maxHeight`
+	 * apply to the region.
+	 */
+	region?: { x: number; y: number; w: number; h: number };
+	priority?: CodecPriority;
+	/** Cancels the decode, the Promise rejects with an `AbortError`. */
+	signal?: AbortSignal;
+}
+
+export interface DecodeIntoOptions {
+	premultiplied?: boolean;
+	/** Byte offset of the first pixel in `dest`. Defaults to 0. */
+	offset?: number;
+	/** Bytes per row in `dest`, at least `width * 4`. Defaults to `width * 4`. */
+	stride?: number;
+	priority?: CodecPriority;
+	/**
+	 * Cancels the decode, the Promise rejects with an `AbortError`. `dest`
+	 * may already hold some of the rows.
+	 */
+	signal?: AbortSignal;
+}
+
+export interface PNGDecoderOptions {
+	premultiplied?: boolean;
+	/** Rows per pushed band. Defaults to 64. */
+	bandHeight?: number;
+	priority?: CodecPriority;
+	/** Destroys the stream with an `AbortError`. */
+	signal?: AbortSignal;
+}
+
+export interface RowBand {
+	/** First row of the band. */
+	y: number;
+	width: number;
+	/** Number of rows in the band. */
+	height: number;
+	/** RGBA pixels of the band, `width * height * 4` bytes. */
+	data: Buffer;
+}
+
+/**
+ * Streaming PNG decoder. Write the file in chunks (or pipe a stream into it),
+ * each chunk is decoded on the threadpool as it arrives, so only the not yet
+ * consumed bytes are buffered. Emits `'header'` with `{ width, height }` once
+ * the header is read, and pushes a `RowBand` as soon as its rows are decoded,
+ * so the full image is never held by the decoder. Interlaced PNGs only finish
+ * their rows in the last pass and push all bands at the end. Ending the stream
+ * before the image is complete is an error.
+ */
+export interface PNGDecoder extends Transform {
+	readonly width: number;
+	readonly height: number;
+	readonly premultiplied: boolean;
+	on(event: 'header', listener: (header: { width: number; height: number }) => void): this;
+	on(event: 'data', listener: (band: RowBand) => void): this;
+	on(event: string | symbol, listener: (...args: any[]) => void): this;
+}
+
+export interface PNGEncoderOptions extends PngConfig {
+	width: number;
+	height: number;
+}
+
+/**
+ * Streaming PNG encoder. Write whole rows (laid out as `inputFormat` says) in bands with `writeRows`
+ * (or pipe Buffers of rows into it), the PNG bytes are readable as soon as
+ * they are compressed. Memory stays bounded by one band plus zlib's window.
+ * Always encodes with libpng: `compressionLevel` 0 and -1 use its fastest
+ * level, `optimizeColorType` and `threads` don't apply. Ending the stream
+ * before all rows are written is an error.
+ */
+export interface PNGEncoder extends Transform {
+	readonly width: number;
+	readonly height: number;
+	readonly rowsWritten: number;
+	/** Queues `rows` (a multiple of `width * 4` bytes), resolves once they are compressed. */
+	writeRows(rows: Buffer): Promise<void>;
+}
+
+export interface EncodeBatchItem {
+	width: number;
+	height: number;
+	data: Buffer;
+	options?: PngConfig;
+}
+
+export interface CodecPoolStats {
+	/** Jobs waiting for a thread. */
+	queued: number;
+	/** Jobs running. */
+	active: number;
+	completed: number;
+	/** Total time completed jobs spent queued, in ms. */
+	waitTime: number;
+	/** Total time completed jobs spent running, in ms. */
+	runTime: number;
+	/** Longest time a job spent queued, in ms. */
+	maxWaitTime: number;
+}
+
+export interface ImageInfo {
+	/** File format, e.g. `'png'`, `'webp'`, `'jpeg'` or `'gif'`. */
+	format: string;
+	width: number;
+	height: number;
+	/** Whether the image has an alpha channel or a transparent color. */
+	hasAlpha: boolean;
+	/** Bits per channel (bits per palette index for indexed PNGs). */
+	bitDepth: number;
+	/** Adam7-interlaced PNG. */
+	interlaced: boolean;
+	/** Number of frames (APNG and animated GIF), 1 for still images. */
+	frames: number;
+	/** Whether the PNG was written by the fast encoder (`compressionLevel` 0 or -1). */
+	fpng: boolean;
 }
 
 export function encodePNG(width: number, height: number, data: Buffer, options?: PngConfig): Promise<Buffer>;
+/**
+ * Encodes RGBA pixels as a lossless WebP (VP8L). Usually smaller than the
+ * PNG of the same image, by a lot for UI and other flat color images.
+ */
+export function encodeWebPLossless(width: number, height: number, data: Buffer, options?: WebPLosslessConfig): Promise<Buffer>;
+export function decodePNG(data: Buffer, options: DecodeOptions & { pixelFormat: 'rgba16' }): Promise<DecodedImageData16>;
 export function decodePNG(data: Buffer, options?: DecodeOptions): Promise<DecodedImageData>;
 export function decodeWebP(data: Buffer, options?: DecodeOptions): Promise<DecodedImageData>;
-/** Auto-detects format (PNG or WebP) from magic bytes and decodes. */
+/**
+ * Encodes RGBA pixels as QOI: a single pass with no entropy coding or
+ * checksums, much faster than any PNG encode but larger. Meant for
+ * intermediate images, e.g. frames spilled to disk between pipeline stages.
+ */
+export function encodeQOI(width: number, height: number, data: Buffer, options?: { priority?: CodecPriority; signal?: AbortSignal }): Promise<Buffer>;
+export function decodeQOI(data: Buffer, options?: DecodeOptions): Promise<DecodedImageData>;
+/**
+ * Auto-detects the format from magic bytes and decodes it: PNG, WebP, JPEG,
+ * GIF (first frame), BMP, TGA, NetPBM, WBMP and QOI. Rejects with "Unsupported
+ * image format" for anything else.
+ */
+export function decode(data: Buffer, options: DecodeOptions & { pixelFormat: 'rgba16' }): Promise<DecodedImageData16>;
 export function decode(data: Buffer, options?: DecodeOptions): Promise<DecodedImageData>;
+
+/**
+ * Decodes any image `decode` takes into caller provided memory instead of a new Buffer,
+ * e.g. a slot of a `SharedArrayBuffer` shared with worker threads. Pixels
+ * are RGBA, row `y` starts at `offset + y * stride`. The size is checked
+ * against the image header first, a destination that is too small rejects
+ * with "Destination buffer too small." and nothing is written.
+ */
+export function decodeInto(data: Buffer, dest: ArrayBufferView | ArrayBuffer | SharedArrayBuffer, options?: DecodeIntoOptions): Promise<{ width: number; height: number; premultiplied: boolean }>;
+
+/**
+ * Decodes many images of any format `decode` takes in one call. The images are spread over
+ * the addon's own codec threads (one per CPU core) rather than libuv's
+ * threadpool. Results come back in input order, shaped like the results of
+ * `Promise.allSettled`, so one bad image does not fail the batch. Aborting
+ * `options.signal` does: the whole batch rejects with an `AbortError`.
+ */
+export function decodeBatch(data: Buffer[], options: DecodeOptions & { pixelFormat: 'rgba16' }): Promise<PromiseSettledResult<DecodedImageData16>[]>;
+export function decodeBatch(data: Buffer[], options?: DecodeOptions): Promise<PromiseSettledResult<DecodedImageData>[]>;
+/** Same as `decodeBatch`, for `encodePNG`. */
+export function encodeBatch(items: EncodeBatchItem[], options?: { priority?: CodecPriority; signal?: AbortSignal }): Promise<PromiseSettledResult<Buffer>[]>;
+
+/** Creates a streaming PNG decoder, see `PNGDecoder`. */
+export function createPNGDecoder(options?: PNGDecoderOptions): PNGDecoder;
+
+export interface AnimationFrame {
+	index: number;
+	/** The whole canvas as shown during this frame, RGBA. */
+	data: Buffer;
+	width: number;
+	height: number;
+	premultiplied: boolean;
+	/** Display time in milliseconds. */
+	duration: number;
+	/** Canvas rectangle that changed since the previous frame (all of it for the first one). */
+	dirty: { x: number; y: number; w: number; h: number };
+	/** Times to play the animation, 0 = forever. */
+	loopCount: number;
+}
+
+/**
+ * Decodes an animated GIF (or APNG) frame by frame. Disposal and blending
+ * are applied natively onto a single canvas, every frame is a copy of it,
+ * so memory stays at one canvas plus the frames the caller holds on to.
+ * Each frame is decoded on the codec threads when the iterator asks for it.
+ * Still images yield one frame. Throws "Unsupported image format" for data
+ * that is not an image. Aborting `options.signal` makes the pending `next()`
+ * reject with an `AbortError`.
+ */
+export function decodeAnimation(data: Buffer, options?: { premultiplied?: boolean; priority?: CodecPriority; signal?: AbortSignal }): AsyncGenerator<AnimationFrame, void>;
+
+/** Creates a streaming PNG encoder, see `PNGEncoder`. */
+export function createPNGEncoder(options: PNGEncoderOptions): PNGEncoder;
+
+/**
+ * Reads the image header without decoding any pixels. Throws for unsupported
+ * formats and truncated headers.
+ */
+export function probe(data: Buffer): ImageInfo;
+
+/**
+ * Counts PNG decodes per decoder since the module was loaded. Files written
+ * by the fast encoder (`compressionLevel` 0 or -1) are decoded by `fpng`,
+ * everything else by `wuffs`.
+ */
+export function getDecodeStats(): { fpng: number; wuffs: number };
+
+/**
+ * Encoder memory counters since the module was loaded. `allocated` counts
+ * bytes of new allocations (outputs and scratch growth), `reused` counts
+ * scratch bytes served from the per-thread buffers kept between encodes.
+ */
+export function getBufferStats(): { allocated: number; reused: number };
+
+/**
+ * Sets the number of codec threads. All async work runs on these threads
+ * rather than on libuv's threadpool. Defaults to one per CPU core.
+ */
+export function setConcurrency(threads: number): void;
+
+/** Live queue and timing counters of the codec threads, per priority. */
+export function getPoolStats(): { concurrency: number; interactive: CodecPoolStats; background: CodecPoolStats };
+
+/**
+ * Multiplies the color channels of each 4 byte pixel by its alpha, in place.
+ * Rounds like `premultiplied: true` decodes do. Works for RGBA and BGRA.
+ */
+export function premultiply<T extends ArrayBufferView | ArrayBufferLike>(data: T): T;
+/** Inverse of `premultiply`, in place. Fully transparent pixels become 0. */
+export function unpremultiply<T extends ArrayBufferView | ArrayBufferLike>(data: T): T;
+/**
+ * Reorders the channels of each 4 byte pixel in place, e.g.
+ * `swizzle(data, 'bgra', 'rgba')`.
+ */
+export function swizzle<T extends ArrayBufferView | ArrayBufferLike>(data: T, from: string, to: string): T;
+
+/** Same as `encodePNG`, but runs on the calling thread. */
+export function encodePNGSync(width: number, height: number, data: Buffer, options?: PngConfig): Buffer;
+/** Same as `encodeWebPLossless`, but runs on the calling thread. */
+export function encodeWebPLosslessSync(width: number, height: number, data: Buffer, options?: WebPLosslessConfig): Buffer;
+/** Same as `decodePNG`, but runs on the calling thread. */
+export function decodePNGSync(data: Buffer, options: DecodeOptions & { pixelFormat: 'rgba16' }): DecodedImageData16;
+export function decodePNGSync(data: Buffer, options?: DecodeOptions): DecodedImageData;
+/** Same as `decodeWebP`, but runs on the calling thread. */
+export function decodeWebPSync(data: Buffer, options?: DecodeOptions): DecodedImageData;
+/** Same as `encodeQOI`, but runs on the calling thread. */
+export function encodeQOISync(width: number, height: number, data: Buffer): Buffer;
+/** Same as `decodeQOI`, but runs on the calling thread. */
+export function decodeQOISync(data: Buffer, options?: DecodeOptions): DecodedImageData;
+/** Same as `decode`, but runs on the calling thread. */
+export function decodeSync(data: Buffer, options: DecodeOptions & { pixelFormat: 'rgba16' }): DecodedImageData16;
+export function decodeSync(data: Buffer, options?: DecodeOptions): DecodedImageData;
@@ -1,3 +1,4 @@
+const { Transform } = require('stream');
 const bindings = require('./build/Release/ag_images.node');
 
 exports.PNG_NO_FILTERS = bindings.PNG_NO_FILTERS;
@@ -8,9 +9,48 @@ exports.PNG_FILTER_AVG = bindings.PNG_FILTER_AVG;
 exports.PNG_FILTER_PAETH = bindings.PNG_FILTER_PAETH;
 exports.PNG_ALL_FILTERS = bindings.PNG_ALL_FILTERS;
 
-exports.encodePNG = function (width, height, data, options) {
+// Same shape as the errors Node's own APIs reject with when their signal fires
+function abortError(signal) {
+  const error = new Error('The operation was aborted');
+  error.name = 'AbortError';
+  error.code = 'ABORT_ERR';
+  error.cause = signal.reason;
+  return error;
+}
+
+// Runs a codec job that can be cancelled through options.signal. The job gets an abort token (undefined without a
+// signal): queued jobs are dropped and running ones stop at the next row band or input slice once it's aborted.
+function abortable(signal, run) {
+  if (!signal) {
+    return new Promise((resolve, reject) => run(undefined, resolve, reject));
+  }
+  if (signal.aborted) {
+    return Promise.reject(abortError(signal));
+  }
+  const token = new bindings.AbortToken();
+  const onAbort = () => token.abort();
+  signal.addEventListener('abort', onAbort, { once: true });
   return new Promise((resolve, reject) => {
-    bindings.encodePNG(width, height, data, options, (error, result) => {
+    run(token, value => signal.aborted ? reject(abortError(signal)) : resolve(value),
+      error => reject(signal.aborted ? abortError(signal) : error));
+  }).finally(() => signal.removeEventListener('abort', onAbort));
+}
+
+exports.encodePNG = function (width, height, data, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    bindings.encodePNG(width, height, data, options, abort, (error, result) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve(result);
+      }
+    })
+  });
+};
+
+exports.encodeWebPLossless = function (width, height, data, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    bindings.encodeWebPLossless(width, height, data, options, abort, (error, result) => {
       if (error) {
         reject(error);
       } else {
@@ -20,10 +60,41 @@ exports.encodePNG = function (width, height, data, options) {
   });
 };
 
+// QOI: one pass, no entropy coding, for scratch images between pipeline stages
+exports.encodeQOI = function (width, height, data, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    bindings.encodeQOI(width, height, data, options, abort, (error, result) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve(result);
+      }
+    })
+  });
+};
+
+// pixelFormat 'bgra-premul' is BGRA with premultiplied: true
+function premultipliedOf(options) {
+  return options?.premultiplied || options?.pixelFormat === 'bgra-premul';
+}
+
+exports.decodeQOI = function (buffer, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = premultipliedOf(options);
+    bindings.decodeQOI(buffer, premultiplied, options?.priority, abort, options, (error, data, width, height) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve({ data, width, height, premultiplied });
+      }
+    })
+  });
+};
+
 exports.decodePNG = function (buffer, options) {
-  return new Promise((resolve, reject) => {
-    const premultiplied = options?.premultiplied || false;
-    bindings.decodePNG(buffer, premultiplied, (error, data, width, height) => {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = premultipliedOf(options);
+    bindings.decodePNG(buffer, premultiplied, options?.priority, abort, options, (error, data, width, height) => {
       if (error) {
         reject(error);
       } else {
@@ -33,26 +104,44 @@ exports.decodePNG = function (buffer, options) {
   });
 };
 
+function isWebP(buffer) {
+  return buffer.length >= 12 && buffer[0] === 0x52 && buffer[1] === 0x49 && buffer[2] === 0x46 && buffer[3] === 0x46 &&
+    buffer[8] === 0x57 && buffer[9] === 0x45 && buffer[10] === 0x42 && buffer[11] === 0x50;
+}
+
+// VP8X (extended WebP: lossy + alpha) is not supported by the Wuffs decoder
+function isVP8X(buffer) {
+  return buffer && buffer.length >= 16 &&
+    buffer[12] === 0x56 && buffer[13] === 0x50 && buffer[14] === 0x38 && buffer[15] === 0x58;
+}
+
+const VP8X_ERROR = 'VP8X (extended WebP) is not supported. Use lossless WebP (VP8L) for alpha, or lossy WebP (VP8) without alpha.';
+
+// PNG, WebP, JPEG, GIF, BMP, TGA, NetPBM, WBMP and QOI, sniffed from the magic bytes.
+// GIFs decode their first frame.
 exports.decode = function (buffer, options) {
-  if (buffer.length >= 8 && buffer[0] === 0x89 && buffer[1] === 0x50 && buffer[2] === 0x4e && buffer[3] === 0x47) {
-    return exports.decodePNG(buffer, options);
-  }
-  if (buffer.length >= 12 && buffer[0] === 0x52 && buffer[1] === 0x49 && buffer[2] === 0x46 && buffer[3] === 0x46 &&
-      buffer[8] === 0x57 && buffer[9] === 0x45 && buffer[10] === 0x42 && buffer[11] === 0x50) {
-    return exports.decodeWebP(buffer, options);
+  if (isWebP(buffer) && isVP8X(buffer)) {
+    return Promise.reject(new Error(VP8X_ERROR));
   }
-  return Promise.reject(new Error('Unsupported image format'));
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = premultipliedOf(options);
+    bindings.decodeImage(buffer, premultiplied, options?.priority, abort, options, (error, data, width, height, format) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve({ data, width, height, premultiplied, format });
+      }
+    })
+  });
 };
 
 exports.decodeWebP = function (buffer, options) {
-  // VP8X (extended WebP: lossy + alpha) is not supported by the Wuffs decoder
-  if (buffer && buffer.length >= 16 &&
-      buffer[12] === 0x56 && buffer[13] === 0x50 && buffer[14] === 0x38 && buffer[15] === 0x58) {
-    return Promise.reject(new Error('VP8X (extended WebP) is not supported. Use lossless WebP (VP8L) for alpha, or lossy WebP (VP8) without alpha.'));
+  if (isVP8X(buffer)) {
+    return Promise.reject(new Error(VP8X_ERROR));
   }
-  return new Promise((resolve, reject) => {
-    const premultiplied = options?.premultiplied || false;
-    bindings.decodeWebP(buffer, premultiplied, (error, data, width, height) => {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = premultipliedOf(options);
+    bindings.decodeWebP(buffer, premultiplied, options?.priority, abort, options, (error, data, width, height) => {
       if (error) {
         reject(error);
       } else {
@@ -61,3 +150,267 @@ exports.decodeWebP = function (buffer, options) {
     })
   });
 };
+
+// Decodes any image decode() takes into caller owned memory (Buffer, typed array, ArrayBuffer or SharedArrayBuffer),
+// row y starts at offset + y * stride. Rejects without writing anything if dest is too small.
+exports.decodeInto = function (buffer, dest, options) {
+  if (isWebP(buffer) && isVP8X(buffer)) {
+    return Promise.reject(new Error(VP8X_ERROR));
+  }
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = options?.premultiplied || false;
+    const offset = options?.offset || 0;
+    const stride = options?.stride || 0;
+    bindings.decodeInto(buffer, dest, offset, stride, premultiplied, options?.priority, abort, (error, _, width, height) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve({ width, height, premultiplied });
+      }
+    })
+  });
+};
+
+// Batches spread their items over the codec threads, one job per item.
+// Like Promise.allSettled, each result is { status: 'fulfilled', value } or { status: 'rejected', reason }.
+function settle(results, value) {
+  return results.map(result => result instanceof Error ?
+    { status: 'rejected', reason: result } :
+    { status: 'fulfilled', value: value(result) });
+}
+
+exports.decodeBatch = function (buffers, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    const premultiplied = premultipliedOf(options);
+    bindings.decodeBatch(buffers, premultiplied, options?.priority, abort, options, (error, results) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve(settle(results, ({ data, width, height, format }) => ({ data, width, height, premultiplied, format })));
+      }
+    })
+  });
+};
+
+exports.encodeBatch = function (items, options) {
+  return abortable(options?.signal, (abort, resolve, reject) => {
+    bindings.encodeBatch(items, options?.priority, abort, (error, results) => {
+      if (error) {
+        reject(error);
+      } else {
+        resolve(settle(results, buffer => buffer));
+      }
+    })
+  });
+};
+
+// Streaming PNG decoder: write the file in chunks as they arrive (or pipe a stream into it), each chunk is
+// inflated on the threadpool right away. Emits 'header' with { width, height } once the IHDR is read and
+// pushes { y, width, height, data } row bands of RGBA pixels as they are decoded (interlaced PNGs: once the
+// image is complete).
+class PNGDecoder extends Transform {
+  constructor(options) {
+    super({ readableObjectMode: true, signal: options?.signal });
+    this.premultiplied = options?.premultiplied || false;
+    this.bandHeight = options?.bandHeight || 64;
+    this.width = 0;
+    this.height = 0;
+    this._y = 0;
+    this._decoder = new bindings.PngDecoderStream(this.premultiplied, options?.priority, this.bandHeight);
+  }
+
+  _transform(chunk, encoding, callback) {
+    this._feed(Buffer.isBuffer(chunk) ? chunk : Buffer.from(chunk, encoding), false, callback);
+  }
+
+  _flush(callback) {
+    this._feed(Buffer.alloc(0), true, callback);
+  }
+
+  // Each write hands back the rows it finished. Non-interlaced images come in bands of bandHeight rows as they are
+  // decoded, interlaced ones as a single buffer at the end, which is split up here.
+  _feed(chunk, closed, callback) {
+    this._decoder.write(chunk, closed, (error, buffers, width, height) => {
+      if (error) {
+        callback(error);
+        return;
+      }
+      if (width && !this.width) {
+        this.width = width;
+        this.height = height;
+        this.emit('header', { width, height });
+      }
+      const rowBytes = width * 4;
+      for (const data of buffers) {
+        for (let offset = 0; offset < data.length; offset += this.bandHeight * rowBytes) {
+          const band = data.subarray(offset, offset + this.bandHeight * rowBytes);
+          this.push({ y: this._y, width, height: band.length / rowBytes, data: band });
+          this._y += band.length / rowBytes;
+        }
+      }
+      callback();
+    });
+  }
+}
+
+exports.createPNGDecoder = function (options) {
+  return new PNGDecoder(options);
+};
+
+// Frames of an animated GIF (or APNG; still images have one frame) as an async iterator. Disposal and blending are
+// applied natively onto one canvas, each frame is a copy of it plus the rectangle that changed, so memory stays at
+// one canvas and the frames the caller keeps. Frames are decoded one at a time on the codec threads, as they are asked for.
+exports.decodeAnimation = async function* (buffer, options) {
+  const premultiplied = options?.premultiplied || false;
+  const animation = new bindings.ImageAnimation(buffer, premultiplied, options?.priority);
+  for (;;) {
+    const frame = await abortable(options?.signal, (abort, resolve, reject) => {
+      animation.next(abort, (error, frame) => error ? reject(error) : resolve(frame));
+    });
+    if (!frame) return;
+    yield { ...frame, premultiplied };
+  }
+};
+
+// Streaming PNG encoder: write whole rows (as inputFormat says, RGBA by default) in bands (writeRows or pipe), each band is compressed on the
+// threadpool and the PNG bytes written so far are pushed right away. Takes the encodePNG options, but always
+// encodes with libpng: compressionLevel 0 and -1 use its fastest level, optimizeColorType and threads don't apply.
+class PNGEncoder extends Transform {
+  constructor(options) {
+    super({ writableObjectMode: true, signal: options?.signal });
+    this.width = options?.width;
+    this.height = options?.height;
+    this.rowsWritten = 0;
+    this._encoder = new bindings.PngEncoderStream(this.width, this.height, options);
+  }
+
+  writeRows(rows) {
+    return new Promise((resolve, reject) => {
+      this.write(rows, error => error ? reject(error) : resolve());
+    });
+  }
+
+  _transform(rows, encoding, callback) {
+    try {
+      this._encoder.write(rows, (error, data, rowsWritten) => {
+        if (error) {
+          callback(error);
+          return;
+        }
+        this.rowsWritten = rowsWritten;
+        if (data) {
+          this.push(data);
+        }
+        callback();
+      });
+    } catch (error) {
+      callback(error);
+    }
+  }
+
+  _flush(callback) {
+    if (this.rowsWritten !== this.height) {
+      callback(new Error(`PNG encoding failed: ${this.rowsWritten} of ${this.height} rows written.`));
+    } else {
+      callback();
+    }
+  }
+}
+
+exports.createPNGEncoder = function (options) {
+  return new PNGEncoder(options);
+};
+
+// Reads width, height, format etc. from the image header, without decoding any pixels
+exports.probe = function (buffer) {
+  return bindings.probe(buffer);
+};
+
+// Number of PNG decodes served by the fpng fast path and by the general purpose (wuffs) decoder
+exports.getDecodeStats = function () {
+  return bindings.getDecodeStats();
+};
+
+// Bytes allocated by the encoder vs. scratch bytes reused from the per-thread arenas
+exports.getBufferStats = function () {
+  return bindings.getBufferStats();
+};
+
+// All async work runs on the addon's codec threads (one per CPU core by default), not on libuv's threadpool.
+// Jobs take a priority option, 'interactive' (default) or 'background': interactive jobs are picked first and
+// background jobs never occupy the last free thread.
+exports.setConcurrency = function (threads) {
+  bindings.setConcurrency(threads);
+};
+
+// { concurrency, interactive, background }, per priority: queued and active jobs, completed jobs and their total
+// wait and run time in ms, and the longest wait
+exports.getPoolStats = function () {
+  return bindings.getPoolStats();
+};
+
+// Pixel conversions, in place on the calling thread. data is a Buffer, typed array or (Shared)ArrayBuffer of 4 byte pixels.
+
+exports.premultiply = function (data) {
+  bindings.premultiply(data);
+  return data;
+};
+
+exports.unpremultiply = function (data) {
+  bindings.unpremultiply(data);
+  return data;
+};
+
+// swizzle(data, 'bgra', 'rgba') reorders the channels of each pixel from one layout to another
+exports.swizzle = function (data, from, to) {
+  const isLayout = layout => typeof layout === 'string' && layout.length === 4 && [...'rgba'].every(c => layout.includes(c));
+  if (!isLayout(from) || !isLayout(to)) {
+    throw new TypeError('from and to must be orders of the letters r, g, b and a');
+  }
+  bindings.swizzle(data, [...to].map(c => from.indexOf(c)));
+  return data;
+};
+
+// Synchronous variants, these run the codec on the calling thread.
+
+exports.encodePNGSync = function (width, height, data, options) {
+  return bindings.encodePNGSync(width, height, data, options);
+};
+
+exports.encodeWebPLosslessSync = function (width, height, data, options) {
+  return bindings.encodeWebPLosslessSync(width, height, data, options);
+};
+
+exports.encodeQOISync = function (width, height, data) {
+  return bindings.encodeQOISync(width, height, data);
+};
+
+exports.decodeQOISync = function (buffer, options) {
+  const premultiplied = premultipliedOf(options);
+  const { data, width, height } = bindings.decodeQOISync(buffer, premultiplied, options);
+  return { data, width, height, premultiplied };
+};
+
+exports.decodePNGSync = function (buffer, options) {
+  const premultiplied = premultipliedOf(options);
+  const { data, width, height } = bindings.decodePNGSync(buffer, premultiplied, options);
+  return { data, width, height, premultiplied };
+};
+
+exports.decodeWebPSync = function (buffer, options) {
+  if (isVP8X(buffer)) {
+    throw new Error(VP8X_ERROR);
+  }
+  const premultiplied = premultipliedOf(options);
+  const { data, width, height } = bindings.decodeWebPSync(buffer, premultiplied, options);
+  return { data, width, height, premultiplied };
+};
+
+exports.decodeSync = function (buffer, options) {
+  if (isWebP(buffer) && isVP8X(buffer)) {
+    throw new Error(VP8X_ERROR);
+  }
+  const premultiplied = premultipliedOf(options);
+  const { data, width, height, format } = bindings.decodeImageSync(buffer, premultiplied, options);
+  return { data, width, height, premultiplied, format };
+};
@@ -16,6 +16,12 @@
 #include "fpng.h"
 #include <assert.h>
 #include <string.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
 #ifdef _MSC_VER
 	#pragma warning (disable:4127) // conditional expression is constant
@@ -486,6 +492,187 @@ namespace fpng
 		return fpng_adler32_scalar((const uint8_t*)pData, size, adler);
 	}
 
+	// Same rounding as Wuffs' RGBA_NONPREMUL -> RGBA_PREMUL swizzler: ((c * 0x101) * (a * 0x101) / 0xFFFF) >> 8, which is (c * a * 257) / 65280
+	static inline uint8_t premultiply_channel(uint32_t c, uint32_t a)
+	{
+		return (uint8_t)((c * a * 257) / 65280);
+	}
+
+	// Wuffs' RGBA_PREMUL -> RGBA_NONPREMUL: ((c * 0x101 * 0xFFFF) / (a * 0x101)) >> 8, which is (c * 65535) / (a * 256). Clamped for c > a.
+	static inline uint8_t unpremultiply_channel(uint32_t c, uint32_t a)
+	{
+		return (uint8_t)minimum<uint32_t>(255, (c * 65535) / (a * 256));
+	}
+
+	static void premultiply_scalar(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		for (size_t i = 0; i < num_pixels; i++, pSrc += 4, pDst += 4)
+		{
+			const uint32_t a = pSrc[3];
+			pDst[0] = premultiply_channel(pSrc[0], a);
+			pDst[1] = premultiply_channel(pSrc[1], a);
+			pDst[2] = premultiply_channel(pSrc[2], a);
+			pDst[3] = (uint8_t)a;
+		}
+	}
+
+	static void unpremultiply_scalar(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		for (size_t i = 0; i < num_pixels; i++, pSrc += 4, pDst += 4)
+		{
+			const uint32_t a = pSrc[3];
+			if (a == 255)
+			{
+				memmove(pDst, pSrc, 4);
+				continue;
+			}
+			pDst[0] = a ? unpremultiply_channel(pSrc[0], a) : 0;
+			pDst[1] = a ? unpremultiply_channel(pSrc[1], a) : 0;
+			pDst[2] = a ? unpremultiply_channel(pSrc[2], a) : 0;
+			pDst[3] = (uint8_t)a;
+		}
+	}
+
+	static void swizzle_scalar(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels, const uint8_t order[4])
+	{
+		for (size_t i = 0; i < num_pixels; i++, pSrc += 4, pDst += 4)
+		{
+			const uint8_t p[4] = { pSrc[0], pSrc[1], pSrc[2], pSrc[3] };
+			pDst[0] = p[order[0]];
+			pDst[1] = p[order[1]];
+			pDst[2] = p[order[2]];
+			pDst[3] = p[order[3]];
+		}
+	}
+
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+	// 16 bit lanes: n = c * a + ((c * a) >> 8) is (c * a * 257) >> 8, and (n + 1 + (n >> 8)) >> 8 is n / 255 for n < 65536.
+	// 4 pixels per iteration, alpha is passed through.
+	static size_t premultiply_sse41(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		const __m128i one = _mm_set1_epi16(1);
+		size_t i = 0;
+		for (; i + 4 <= num_pixels; i += 4)
+		{
+			const __m128i px = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+			__m128i halves[2] = { _mm_cvtepu8_epi16(px), _mm_unpackhi_epi8(px, _mm_setzero_si128()) };
+			for (__m128i& c : halves)
+			{
+				const __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(c, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+				const __m128i ca = _mm_mullo_epi16(c, a);
+				const __m128i n = _mm_add_epi16(ca, _mm_srli_epi16(ca, 8));
+				const __m128i q = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(n, one), _mm_srli_epi16(n, 8)), 8);
+				c = _mm_blend_epi16(q, c, 0x88);
+			}
+			_mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_packus_epi16(halves[0], halves[1]));
+		}
+		return i;
+	}
+
+	// One pixel per float vector, the division is exact enough to match the integer formula. Pixels with alpha 0 divide
+	// to NaN or infinity, which convert to INT_MIN and saturate to 0. Fully opaque groups of 4 are copied as is.
+	static size_t unpremultiply_sse41(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		const __m128i opaque = _mm_set1_epi32((int)0xFF000000);
+		const __m128 color_scale = _mm_set1_ps(65535.0f);
+		const __m128 alpha_scale = _mm_set1_ps(256.0f);
+		const __m128i max_color = _mm_set1_epi32(255);
+		size_t i = 0;
+		for (; i + 4 <= num_pixels; i += 4)
+		{
+			__m128i px = _mm_loadu_si128((const __m128i*)(pSrc + i * 4));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(px, opaque), opaque)) != 0xFFFF)
+			{
+				auto unpremultiply_pixel = [&](__m128i c)
+				{
+					const __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_shuffle_epi32(c, _MM_SHUFFLE(3, 3, 3, 3))), alpha_scale);
+					const __m128i q = _mm_min_epi32(_mm_cvttps_epi32(_mm_div_ps(_mm_mul_ps(_mm_cvtepi32_ps(c), color_scale), a)), max_color);
+					return _mm_blend_epi16(q, c, 0xC0);
+				};
+				const __m128i p0 = unpremultiply_pixel(_mm_cvtepu8_epi32(px));
+				const __m128i p1 = unpremultiply_pixel(_mm_cvtepu8_epi32(_mm_srli_si128(px, 4)));
+				const __m128i p2 = unpremultiply_pixel(_mm_cvtepu8_epi32(_mm_srli_si128(px, 8)));
+				const __m128i p3 = unpremultiply_pixel(_mm_cvtepu8_epi32(_mm_srli_si128(px, 12)));
+				px = _mm_packus_epi16(_mm_packus_epi32(p0, p1), _mm_packus_epi32(p2, p3));
+			}
+			_mm_storeu_si128((__m128i*)(pDst + i * 4), px);
+		}
+		return i;
+	}
+
+	static size_t swizzle_sse41(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels, const uint8_t order[4])
+	{
+		const __m128i mask = _mm_setr_epi8(order[0], order[1], order[2], order[3], 4 + order[0], 4 + order[1], 4 + order[2], 4 + order[3],
+			8 + order[0], 8 + order[1], 8 + order[2], 8 + order[3], 12 + order[0], 12 + order[1], 12 + order[2], 12 + order[3]);
+		size_t i = 0;
+		for (; i + 4 <= num_pixels; i += 4)
+			_mm_storeu_si128((__m128i*)(pDst + i * 4), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pSrc + i * 4)), mask));
+		return i;
+	}
+#endif
+
+	void fpng_premultiply(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		size_t done = 0;
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+		if (g_cpu_info.can_use_sse41())
+			done = premultiply_sse41(pSrc, pDst, num_pixels);
+#endif
+		premultiply_scalar(pSrc + done * 4, pDst + done * 4, num_pixels - done);
+	}
+
+	void fpng_unpremultiply(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels)
+	{
+		size_t done = 0;
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+		if (g_cpu_info.can_use_sse41())
+			done = unpremultiply_sse41(pSrc, pDst, num_pixels);
+#endif
+		unpremultiply_scalar(pSrc + done * 4, pDst + done * 4, num_pixels - done);
+	}
+
+	void fpng_swizzle(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels, const uint8_t order[4])
+	{
+		size_t done = 0;
+#if FPNG_X86_OR_X64_CPU && !FPNG_NO_SSE
+		if (g_cpu_info.can_use_sse41())
+			done = swizzle_sse41(pSrc, pDst, num_pixels, order);
+#endif
+		swizzle_scalar(pSrc + done * 4, pDst + done * 4, num_pixels - done, order);
+	}
+
+	// Converts a row laid out as the FPNG_INPUT_* flags say to RGB(A)
+	static void convert_row(const uint8_t* pSrc, uint8_t* pDst, uint32_t w, uint32_t num_chans, uint32_t flags)
+	{
+		static const uint8_t s_bgra_order[4] = { 2, 1, 0, 3 };
+
+		if (num_chans == 3)
+		{
+			// 24bpp has no alpha, so there's nothing to unpremultiply
+			if (!(flags & FPNG_INPUT_BGR))
+			{
+				memcpy(pDst, pSrc, (size_t)w * 3);
+				return;
+			}
+			for (uint32_t x = 0; x < w; x++, pSrc += 3, pDst += 3)
+			{
+				const uint8_t b = pSrc[0];
+				pDst[1] = pSrc[1];
+				pDst[0] = pSrc[2];
+				pDst[2] = b;
+			}
+			return;
+		}
+
+		if (flags & FPNG_INPUT_BGR)
+		{
+			fpng_swizzle(pSrc, pDst, w, s_bgra_order);
+			pSrc = pDst;
+		}
+		if (flags & FPNG_INPUT_PREMULTIPLIED)
+			fpng_unpremultiply(pSrc, pDst, w);
+	}
+
 	// Ensure we've been configured for endianness correctly.
 	static inline bool endian_check()
 	{
@@ -587,6 +774,16 @@ namespace fpng
 	} \
 } while(0)
 
+// Appends an empty stored block and aligns to a byte boundary (like zlib's Z_SYNC_FLUSH), so another block can follow.
+#define PUT_BITS_SYNC_FLUSH do { \
+	PUT_BITS(0, 3); \
+	PUT_BITS_FORCE_FLUSH; \
+	if ((dst_ofs + 4) > dst_buf_size) \
+		return 0; \
+	WRITE_LE32(pDst + dst_ofs, 0xFFFF0000); \
+	dst_ofs += 4; \
+} while(0)
+
 	enum
 	{
 		DEFL_MAX_HUFF_TABLES = 3,
@@ -989,7 +1186,7 @@ do { \
 
 	static uint32_t pixel_deflate_dyn_3_rle(
 		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+		uint8_t* pDst, uint32_t dst_buf_size, bool final_block = true)
 	{
 		const uint32_t bpl = 1 + w * 3;
 
@@ -1003,7 +1200,7 @@ do { \
 		PUT_BITS(0x01, 8);
 
 		// write BFINAL bit
-		PUT_BITS(1, 1);
+		PUT_BITS(final_block ? 1 : 0, 1);
 
 		std::vector<uint32_t> codes((w + 1) * h);
 		uint32_t* pDst_codes = codes.data();
@@ -1144,7 +1341,14 @@ do { \
 
 		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (final_block)
+		{
+			PUT_BITS_FORCE_FLUSH;
+		}
+		else
+		{
+			PUT_BITS_SYNC_FLUSH;
+		}
 
 		// Write zlib adler32
 		for (uint32_t i = 0; i < 4; i++)
@@ -1162,13 +1366,15 @@ do { \
 
 	static uint32_t pixel_deflate_dyn_3_rle_one_pass(
 		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+		uint8_t* pDst, uint32_t dst_buf_size, bool final_block = true)
 	{
 		const uint32_t bpl = 1 + w * 3;
 
 		if (dst_buf_size < sizeof(g_dyn_huff_3))
 			return false;
 		memcpy(pDst, g_dyn_huff_3, sizeof(g_dyn_huff_3));
+		if (!final_block)
+			pDst[2] &= ~1; // clear BFINAL
 		uint32_t dst_ofs = sizeof(g_dyn_huff_3);
 
 		uint64_t bit_buf = DYN_HUFF_3_BITBUF;
@@ -1248,7 +1454,14 @@ do { \
 
 		PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (final_block)
+		{
+			PUT_BITS_FORCE_FLUSH;
+		}
+		else
+		{
+			PUT_BITS_SYNC_FLUSH;
+		}
 
 		// Write zlib adler32
 		for (uint32_t i = 0; i < 4; i++)
@@ -1266,7 +1479,7 @@ do { \
 
 	static uint32_t pixel_deflate_dyn_4_rle(
 		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+		uint8_t* pDst, uint32_t dst_buf_size, bool final_block = true)
 	{
 		const uint32_t bpl = 1 + w * 4;
 
@@ -1280,7 +1493,7 @@ do { \
 		PUT_BITS(0x01, 8);
 
 		// write BFINAL bit
-		PUT_BITS(1, 1);
+		PUT_BITS(final_block ? 1 : 0, 1);
 
 		std::vector<uint64_t> codes;
 		codes.resize((w + 1) * h);
@@ -1430,7 +1643,14 @@ do { \
 
 		PUT_BITS_CZ(dh.m_huff_codes[0][256], dh.m_huff_code_sizes[0][256]);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (final_block)
+		{
+			PUT_BITS_FORCE_FLUSH;
+		}
+		else
+		{
+			PUT_BITS_SYNC_FLUSH;
+		}
 
 		// Write zlib adler32
 		for (uint32_t i = 0; i < 4; i++)
@@ -1448,13 +1668,15 @@ do { \
 
 	static uint32_t pixel_deflate_dyn_4_rle_one_pass(
 		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+		uint8_t* pDst, uint32_t dst_buf_size, bool final_block = true)
 	{
 		const uint32_t bpl = 1 + w * 4;
 
 		if (dst_buf_size < sizeof(g_dyn_huff_4))
 			return false;
 		memcpy(pDst, g_dyn_huff_4, sizeof(g_dyn_huff_4));
+		if (!final_block)
+			pDst[2] &= ~1; // clear BFINAL
 		uint32_t dst_ofs = sizeof(g_dyn_huff_4);
 
 		uint64_t bit_buf = DYN_HUFF_4_BITBUF;
@@ -1563,7 +1785,14 @@ do_literals:
 
 		PUT_BITS_CZ(g_dyn_huff_4_codes[256].m_code, g_dyn_huff_4_codes[256].m_code_size);
 
-		PUT_BITS_FORCE_FLUSH;
+		if (final_block)
+		{
+			PUT_BITS_FORCE_FLUSH;
+		}
+		else
+		{
+			PUT_BITS_SYNC_FLUSH;
+		}
 
 		// Write zlib adler32
 		for (uint32_t i = 0; i < 4; i++)
@@ -1659,7 +1888,95 @@ do_literals:
 		}
 	}
 
-	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags)
+	// Filters rows [first_row, first_row + num_rows) into pDst, each one preceded by its filter type byte. Filter 2 (Up) becomes 0 on the image's
+	// first row. With FPNG_INPUT_* flags each row is converted just before it's filtered, only the current and previous converted rows are kept.
+	// src_pitch: bytes between the source rows, never 0.
+	static void filter_rows(const void* pImage, uint32_t w, size_t src_pitch, uint32_t first_row, uint32_t num_rows, uint32_t num_chans, uint32_t flags, uint32_t filter, uint8_t* pDst)
+	{
+		const uint32_t bpl = w * num_chans;
+		const bool convert = (flags & (FPNG_INPUT_BGR | FPNG_INPUT_PREMULTIPLIED)) != 0;
+		std::vector<uint8_t> rows(convert ? bpl * 2 : 0);
+
+		for (uint32_t y = 0; y < num_rows; ++y)
+		{
+			const uint32_t src_y = first_row + y;
+			const uint8_t* pSrc = (const uint8_t*)pImage + src_y * src_pitch;
+			const uint8_t* pPrev_src = src_y ? pSrc - src_pitch : nullptr;
+
+			if (convert)
+			{
+				uint8_t* pCur = &rows[(src_y & 1) * bpl];
+				uint8_t* pPrev = &rows[((src_y & 1) ^ 1) * bpl];
+				if ((y == 0) && src_y && (filter == 2))
+					convert_row(pPrev_src, pPrev, w, num_chans, flags);
+				convert_row(pSrc, pCur, w, num_chans, flags);
+				pSrc = pCur;
+				pPrev_src = src_y ? pPrev : nullptr;
+			}
+
+			apply_filter(src_y ? filter : 0, w, num_rows, num_chans, bpl, pSrc, pPrev_src, pDst + (size_t)y * (bpl + 1));
+		}
+	}
+
+	// Fills in the PNG header (IHDR, optional fdEC chunk and the IDAT chunk header) in front of the zlib data already placed
+	// at the start of IDAT in out_buf, then appends the IDAT CRC-32 and the IEND chunk.
+	static void write_png_chunks(std::vector<uint8_t>& out_buf, uint32_t w, uint32_t h, uint32_t num_chans, bool fdec_chunk)
+	{
+		int i;
+		const uint32_t PNG_HEADER_SIZE = fdec_chunk ? 58 : 41;
+
+		const uint32_t idat_len = (uint32_t)out_buf.size() - PNG_HEADER_SIZE;
+
+		// Write real PNG header, fdEC chunk, and the beginning of the IDAT chunk
+		{
+			static const uint8_t s_color_type[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
+
+			uint8_t pnghdr[58] = { 
+				0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,   // PNG sig
+				0x00,0x00,0x00,0x0d, 'I','H','D','R',  // IHDR chunk len, type
+			    (uint8_t)(w >> 24),(uint8_t)(w >> 16),(uint8_t)(w >> 8),(uint8_t)w, // width
+				(uint8_t)(h >> 24),(uint8_t)(h >> 16),(uint8_t)(h >> 8),(uint8_t)h, // height
+				8,   //bit_depth
+				s_color_type[num_chans], // color_type
+				0, // compression
+				0, // filter
+				0, // interlace
+				0, 0, 0, 0, // IHDR crc32
+				0, 0, 0, 5, 'f', 'd', 'E', 'C', 82, 36, 147, 227, FPNG_FDEC_VERSION,   0xE5, 0xAB, 0x62, 0x99, // our custom private, ancillary, do not copy, fdEC chunk
+			  (uint8_t)(idat_len >> 24),(uint8_t)(idat_len >> 16),(uint8_t)(idat_len >> 8),(uint8_t)idat_len, 'I','D','A','T' // IDATA chunk len, type
+			}; 
+
+			// Compute IHDR CRC32
+			uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
+			for (i = 0; i < 4; ++i, c <<= 8)
+				((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
+
+			if (fdec_chunk)
+				memcpy(out_buf.data(), pnghdr, PNG_HEADER_SIZE);
+			else
+			{
+				// Skip the 17 byte fdEC chunk
+				memcpy(out_buf.data(), pnghdr, 33);
+				memcpy(out_buf.data() + 33, pnghdr + 50, 8);
+			}
+		}
+
+		// Write IDAT chunk's CRC32 and a 0 length IEND chunk
+		vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16); // IDAT CRC32, followed by the IEND chunk
+
+		// Compute IDAT crc32
+		uint32_t c = (uint32_t)fpng_crc32(out_buf.data() + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
+		
+		for (i = 0; i < 4; ++i, c <<= 8)
+			(out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
+	}
+
+	static inline bool is_aborted(const std::atomic<bool>* pAbort)
+	{
+		return pAbort && pAbort->load(std::memory_order_relaxed);
+	}
+
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags, std::vector<uint8_t>* pTemp_buf, const std::atomic<bool>* pAbort, size_t src_pitch)
 	{
 		if (!endian_check())
 		{
@@ -1679,24 +1996,19 @@ do_literals:
 			return false;
 		}
 
-		int i, bpl = w * num_chans;
-		uint32_t y;
+		int bpl = w * num_chans;
+		if (!src_pitch)
+			src_pitch = bpl;
 
-		std::vector<uint8_t> temp_buf;
+		std::vector<uint8_t> local_temp_buf;
+		std::vector<uint8_t>& temp_buf = pTemp_buf ? *pTemp_buf : local_temp_buf;
 		temp_buf.resize((bpl + 1) * h + 7);
-		uint32_t temp_buf_ofs = 0;
-
-		for (y = 0; y < h; ++y)
-		{
-			const uint8_t* pSrc = (uint8_t*)pImage + y * bpl;
-			const uint8_t* pPrev_src = y ? ((uint8_t*)pImage + (y - 1) * bpl) : nullptr;
+		uint32_t temp_buf_ofs = (bpl + 1) * h;
 
-			uint8_t* pDst = &temp_buf[temp_buf_ofs];
+		filter_rows(pImage, w, src_pitch, 0, h, num_chans, flags, 2, temp_buf.data());
 
-			apply_filter(y ? 2 : 0, w, h, num_chans, bpl, pSrc, pPrev_src, pDst);
-
-			temp_buf_ofs += 1 + bpl;
-		}
+		if (is_aborted(pAbort))
+			return false;
 
 		const uint32_t PNG_HEADER_SIZE = 58;
 				
@@ -1729,18 +2041,7 @@ do_literals:
 		{
 			// Dynamic block failed to compress - fall back to uncompressed blocks, filter 0.
 
-			temp_buf_ofs = 0;
-
-			for (y = 0; y < h; ++y)
-			{
-				const uint8_t* pSrc = (uint8_t*)pImage + y * bpl;
-
-				uint8_t* pDst = &temp_buf[temp_buf_ofs];
-
-				apply_filter(0, w, h, num_chans, bpl, pSrc, nullptr, pDst);
-
-				temp_buf_ofs += 1 + bpl;
-			}
+			filter_rows(pImage, w, src_pitch, 0, h, num_chans, flags, 0, temp_buf.data());
 
 			assert(temp_buf_ofs <= temp_buf.size());
 						
@@ -1761,44 +2062,245 @@ do_literals:
 
 		out_buf.resize(out_ofs + zlib_size);
 
-		const uint32_t idat_len = (uint32_t)out_buf.size() - PNG_HEADER_SIZE;
+		write_png_chunks(out_buf, w, h, num_chans, true);
 
-		// Write real PNG header, fdEC chunk, and the beginning of the IDAT chunk
+		return true;
+	}
+
+	// Combines the Adler-32 of two adjacent byte ranges, len2 being the length of the second one (same math as zlib's adler32_combine()).
+	static uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, uint64_t len2)
+	{
+		const uint32_t BASE = 65521;
+
+		const uint32_t rem = (uint32_t)(len2 % BASE);
+		uint32_t sum1 = adler1 & 0xFFFF;
+		uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % BASE);
+		sum1 += (adler2 & 0xFFFF) + BASE - 1;
+		sum2 += (adler1 >> 16) + (adler2 >> 16) + BASE - rem;
+		if (sum1 >= BASE) sum1 -= BASE;
+		if (sum1 >= BASE) sum1 -= BASE;
+		if (sum2 >= (BASE << 1)) sum2 -= (BASE << 1);
+		if (sum2 >= BASE) sum2 -= BASE;
+		return sum1 | (sum2 << 16);
+	}
+
+	struct encode_strip
+	{
+		uint32_t m_first_row, m_num_rows;
+
+		// Complete zlib stream for the strip's filtered scanlines: zlib header, one non-final dynamic block ending on a sync flush, Adler-32.
+		std::vector<uint8_t> m_buf;
+		uint32_t m_size;
+	};
+
+	// pTemp_buf: room for the strip's filtered scanlines plus 8 bytes, the Deflate code reads slightly past the end.
+	// An aborted strip is left with m_size 0.
+	static void encode_strip_rows(const void* pImage, uint32_t w, size_t src_pitch, uint32_t num_chans, uint32_t flags, bool last_strip, encode_strip& strip, uint8_t* pTemp_buf, const std::atomic<bool>* pAbort)
+	{
+		const uint32_t bpl = w * num_chans;
+
+		if (is_aborted(pAbort))
+			return;
+
+		// Filtering against the previous row is fine across strip boundaries, only the Deflate streams have to be independent.
+		filter_rows(pImage, w, src_pitch, strip.m_first_row, strip.m_num_rows, num_chans, flags, 2, pTemp_buf);
+
+		if (is_aborted(pAbort))
+			return;
+
+		// Leave room for the sync flush marker
+		strip.m_buf.resize((((bpl + 1) * strip.m_num_rows + 7) & ~7) + 16);
+
+		const uint32_t dst_buf_size = (uint32_t)strip.m_buf.size();
+		if (num_chans == 3)
 		{
-			static const uint8_t s_color_type[] = { 0x00, 0x00, 0x04, 0x02, 0x06 };
+			if (flags & FPNG_ENCODE_SLOWER)
+				strip.m_size = pixel_deflate_dyn_3_rle(pTemp_buf, w, strip.m_num_rows, strip.m_buf.data(), dst_buf_size, last_strip);
+			else
+				strip.m_size = pixel_deflate_dyn_3_rle_one_pass(pTemp_buf, w, strip.m_num_rows, strip.m_buf.data(), dst_buf_size, last_strip);
+		}
+		else
+		{
+			if (flags & FPNG_ENCODE_SLOWER)
+				strip.m_size = pixel_deflate_dyn_4_rle(pTemp_buf, w, strip.m_num_rows, strip.m_buf.data(), dst_buf_size, last_strip);
+			else
+				strip.m_size = pixel_deflate_dyn_4_rle_one_pass(pTemp_buf, w, strip.m_num_rows, strip.m_buf.data(), dst_buf_size, last_strip);
+		}
+	}
 
-			uint8_t pnghdr[58] = { 
-				0x89,0x50,0x4e,0x47,0x0d,0x0a,0x1a,0x0a,   // PNG sig
-				0x00,0x00,0x00,0x0d, 'I','H','D','R',  // IHDR chunk len, type
-			    0,0,(uint8_t)(w >> 8),(uint8_t)w, // width
-				0,0,(uint8_t)(h >> 8),(uint8_t)h, // height
-				8,   //bit_depth
-				s_color_type[num_chans], // color_type
-				0, // compression
-				0, // filter
-				0, // interlace
-				0, 0, 0, 0, // IHDR crc32
-				0, 0, 0, 5, 'f', 'd', 'E', 'C', 82, 36, 147, 227, FPNG_FDEC_VERSION,   0xE5, 0xAB, 0x62, 0x99, // our custom private, ancillary, do not copy, fdEC chunk
-			  (uint8_t)(idat_len >> 24),(uint8_t)(idat_len >> 16),(uint8_t)(idat_len >> 8),(uint8_t)idat_len, 'I','D','A','T' // IDATA chunk len, type
-			}; 
+	// Helper threads for fpng_encode_image_to_memory_mt, shared by all encodes: at most one per hardware thread besides the caller's.
+	// They are started on first use and then kept, so an encode doesn't create threads and concurrent encodes don't multiply them.
+	class strip_helper_pool
+	{
+	public:
+		explicit strip_helper_pool(uint32_t max_threads) : m_max_threads(max_threads), m_num_threads(0) { }
 
-			// Compute IHDR CRC32
-			uint32_t c = (uint32_t)fpng_crc32(pnghdr + 12, 17, FPNG_CRC32_INIT);
-			for (i = 0; i < 4; ++i, c <<= 8)
-				((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
+		// Queues task for up to num_tasks helpers, fewer if the pool is smaller
+		void submit(const std::function<void()>& task, uint32_t num_tasks)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
 
-			memcpy(out_buf.data(), pnghdr, PNG_HEADER_SIZE);
+			num_tasks = minimum(num_tasks, m_max_threads);
+			while (m_num_threads < num_tasks)
+			{
+				m_num_threads++;
+				std::thread([this] { run(); }).detach();
+			}
+
+			for (uint32_t i = 0; i < num_tasks; i++)
+				m_tasks.push_back(task);
+			m_wakeup.notify_all();
 		}
 
-		// Write IDAT chunk's CRC32 and a 0 length IEND chunk
-		vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16); // IDAT CRC32, followed by the IEND chunk
+	private:
+		std::mutex m_mutex;
+		std::condition_variable m_wakeup;
+		std::deque<std::function<void()>> m_tasks;
+		uint32_t m_max_threads, m_num_threads;
+
+		void run()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			for (;;)
+			{
+				m_wakeup.wait(lock, [this] { return !m_tasks.empty(); });
+				std::function<void()> task = std::move(m_tasks.front());
+				m_tasks.pop_front();
+
+				lock.unlock();
+				task();
+				lock.lock();
+			}
+		}
+	};
+
+	// Never destroyed, the helpers may still be waiting for work at exit
+	static strip_helper_pool& strip_helpers()
+	{
+		static strip_helper_pool* pool = new strip_helper_pool(maximum<uint32_t>(1, std::thread::hardware_concurrency()) - 1);
+		return *pool;
+	}
+
+	// Strips are claimed one at a time by the calling thread and whichever helpers get to the job, so every strip gets encoded even when
+	// all helpers are busy with other encodes. A helper that arrives after the last strip was claimed returns without touching the image.
+	struct encode_strip_job
+	{
+		std::function<void(uint32_t)> m_encode;
+		uint32_t m_num_strips;
+		std::atomic<uint32_t> m_next_strip;
+
+		std::mutex m_mutex;
+		std::condition_variable m_done;
+		uint32_t m_strips_left;
+
+		void work()
+		{
+			for (uint32_t i; (i = m_next_strip.fetch_add(1)) < m_num_strips; )
+			{
+				m_encode(i);
+
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (--m_strips_left == 0)
+					m_done.notify_all();
+			}
+		}
+
+		void wait()
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_strips_left == 0; });
+		}
+	};
+
+	bool fpng_encode_image_to_memory_mt(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags, uint32_t num_threads, std::vector<uint8_t>* pTemp_buf, const std::atomic<bool>* pAbort, size_t src_pitch)
+	{
+		// Smallest amount of filtered scanline data worth handing to a separate thread
+		const uint64_t MIN_STRIP_SIZE = 256 * 1024;
+
+		if (!num_threads)
+			num_threads = maximum<uint32_t>(1, std::thread::hardware_concurrency());
+
+		if (!src_pitch)
+			src_pitch = w * num_chans;
+
+		const uint64_t total_size = (uint64_t)(w * num_chans + 1) * h;
+		const uint32_t num_strips = (uint32_t)minimum<uint64_t>(minimum<uint64_t>(num_threads, h), total_size / MIN_STRIP_SIZE);
+
+		if ((num_strips <= 1) || (flags & FPNG_FORCE_UNCOMPRESSED) || (!endian_check()) || ((num_chans != 3) && (num_chans != 4)) ||
+			(w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM) || (w * (uint64_t)h > UINT32_MAX))
+		{
+			return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags, pTemp_buf, pAbort, src_pitch);
+		}
+
+		std::vector<encode_strip> strips(num_strips);
+		for (uint32_t i = 0; i < num_strips; i++)
+		{
+			strips[i].m_first_row = (uint32_t)(((uint64_t)h * i) / num_strips);
+			strips[i].m_num_rows = (uint32_t)(((uint64_t)h * (i + 1)) / num_strips) - strips[i].m_first_row;
+			strips[i].m_size = 0;
+		}
+
+		// One scratch buffer for all the strips' filtered scanlines, each strip gets 8 bytes of padding so no two threads touch the same bytes.
+		std::vector<uint8_t> local_temp_buf;
+		std::vector<uint8_t>& temp_buf = pTemp_buf ? *pTemp_buf : local_temp_buf;
+		temp_buf.resize(total_size + 8 * num_strips);
+		auto strip_temp_buf = [&](uint32_t i) { return temp_buf.data() + (size_t)strips[i].m_first_row * (w * num_chans + 1) + 8 * i; };
+
+		// The job outlives this call if a helper only picks it up after the last strip is done, m_encode is never called by then.
+		std::shared_ptr<encode_strip_job> job = std::make_shared<encode_strip_job>();
+		job->m_encode = [&](uint32_t i) { encode_strip_rows(pImage, w, src_pitch, num_chans, flags, i == num_strips - 1, strips[i], strip_temp_buf(i), pAbort); };
+		job->m_num_strips = num_strips;
+		job->m_next_strip = 0;
+		job->m_strips_left = num_strips;
+
+		strip_helpers().submit([job] { job->work(); }, num_strips - 1);
+
+		job->work();
+		job->wait();
+
+		if (is_aborted(pAbort))
+			return false;
+
+		const uint32_t PNG_HEADER_SIZE = 41;
+
+		uint64_t zlib_size = 2 + 4;
+		for (const auto& strip : strips)
+		{
+			// A strip whose Deflate data didn't fit in the raw size: let the single threaded encoder fall back to uncompressed blocks.
+			if (strip.m_size < 2 + 4)
+				return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags, pTemp_buf, pAbort, src_pitch);
+
+			zlib_size += strip.m_size - (2 + 4);
+		}
+
+		if ((PNG_HEADER_SIZE + zlib_size + 16) > UINT32_MAX)
+			return fpng_encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags, pTemp_buf, pAbort, src_pitch);
+
+		out_buf.resize(PNG_HEADER_SIZE + zlib_size);
+
+		// Stitch the strips into a single zlib stream: keep the first zlib header, drop the per-strip Adler-32s and append the combined one.
+		uint8_t* pDst = out_buf.data() + PNG_HEADER_SIZE;
+		memcpy(pDst, strips[0].m_buf.data(), 2);
+		pDst += 2;
+
+		uint32_t adler = FPNG_ADLER32_INIT;
+		for (const auto& strip : strips)
+		{
+			memcpy(pDst, strip.m_buf.data() + 2, strip.m_size - (2 + 4));
+			pDst += strip.m_size - (2 + 4);
+
+			const uint32_t strip_adler = READ_BE32(strip.m_buf.data() + strip.m_size - 4);
+			adler = adler32_combine(adler, strip_adler, (uint64_t)(w * num_chans + 1) * strip.m_num_rows);
+		}
+
+		for (uint32_t i = 0; i < 4; ++i, adler <<= 8)
+			*pDst++ = (uint8_t)(adler >> 24);
+
+		assert(pDst == out_buf.data() + out_buf.size());
+
+		// fpng_decode_memory() only handles a single Deflate block, so don't mark the file with the fdEC chunk.
+		write_png_chunks(out_buf, w, h, num_chans, false);
 
-		// Compute IDAT crc32
-		uint32_t c = (uint32_t)fpng_crc32(out_buf.data() + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
-		
-		for (i = 0; i < 4; ++i, c <<= 8)
-			(out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
-				
 		return true;
 	}
 
@@ -3082,6 +3584,36 @@ do_literals:
 		return fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, idat_ofs, idat_len);
 	}
 
+	static int fpng_decode_idat(const void* pImage, uint32_t image_size, uint32_t idat_ofs, uint32_t idat_len, uint8_t* pOut, uint32_t width, uint32_t height, uint32_t channels_in_file, uint32_t desired_channels)
+	{
+		const uint8_t* pIDAT_data = static_cast<const uint8_t*>(pImage) + idat_ofs + sizeof(uint32_t) * 2;
+		const uint32_t src_len = image_size - (idat_ofs + sizeof(uint32_t) * 2);
+
+		bool decomp_status;
+		if (desired_channels == 3)
+		{
+			if (channels_in_file == 3)
+				decomp_status = fpng_pixel_zlib_decompress_3<3>(pIDAT_data, src_len, idat_len, pOut, width, height);
+			else
+				decomp_status = fpng_pixel_zlib_decompress_4<3>(pIDAT_data, src_len, idat_len, pOut, width, height);
+		}
+		else
+		{
+			if (channels_in_file == 3)
+				decomp_status = fpng_pixel_zlib_decompress_3<4>(pIDAT_data, src_len, idat_len, pOut, width, height);
+			else
+				decomp_status = fpng_pixel_zlib_decompress_4<4>(pIDAT_data, src_len, idat_len, pOut, width, height);
+		}
+		if (!decomp_status)
+		{
+			// Something went wrong. Either the file data was corrupted, or it doesn't conform to one of our zlib/Deflate constraints.
+			// The conservative thing to do is indicate it wasn't written by us, and let the general purpose PNG decoder handle it.
+			return FPNG_DECODE_NOT_FPNG;
+		}
+
+		return FPNG_DECODE_SUCCESS;
+	}
+
 	int fpng_decode_memory(const void *pImage, uint32_t image_size, std::vector<uint8_t> &out, uint32_t& width, uint32_t& height, uint32_t &channels_in_file, uint32_t desired_channels)
 	{
 		out.resize(0);
@@ -3110,32 +3642,27 @@ do_literals:
 
 		out.resize(mem_needed);
 		
-		const uint8_t* pIDAT_data = static_cast<const uint8_t*>(pImage) + idat_ofs + sizeof(uint32_t) * 2;
-		const uint32_t src_len = image_size - (idat_ofs + sizeof(uint32_t) * 2);
+		return fpng_decode_idat(pImage, image_size, idat_ofs, idat_len, out.data(), width, height, channels_in_file, desired_channels);
+	}
 
-		bool decomp_status;
-		if (desired_channels == 3)
-		{
-			if (channels_in_file == 3)
-				decomp_status = fpng_pixel_zlib_decompress_3<3>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-			else
-				decomp_status = fpng_pixel_zlib_decompress_4<3>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-		}
-		else
-		{
-			if (channels_in_file == 3)
-				decomp_status = fpng_pixel_zlib_decompress_3<4>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-			else
-				decomp_status = fpng_pixel_zlib_decompress_4<4>(pIDAT_data, src_len, idat_len, out.data(), width, height);
-		}
-		if (!decomp_status)
-		{
-			// Something went wrong. Either the file data was corrupted, or it doesn't conform to one of our zlib/Deflate constraints.
-			// The conservative thing to do is indicate it wasn't written by us, and let the general purpose PNG decoder handle it.
-			return FPNG_DECODE_NOT_FPNG;
-		}
+	int fpng_decode_memory(const void* pImage, uint32_t image_size, uint8_t* pOut, size_t out_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels)
+	{
+		width = 0;
+		height = 0;
+		channels_in_file = 0;
 
-		return FPNG_DECODE_SUCCESS;
+		if ((!pImage) || (!image_size) || (!pOut) || ((desired_channels != 3) && (desired_channels != 4)))
+			return FPNG_DECODE_INVALID_ARG;
+
+		uint32_t idat_ofs = 0, idat_len = 0;
+		int status = fpng_get_info_internal(pImage, image_size, width, height, channels_in_file, idat_ofs, idat_len);
+		if (status)
+			return status;
+
+		if ((uint64_t)width * height * desired_channels > out_size)
+			return FPNG_DECODE_INVALID_ARG;
+
+		return fpng_decode_idat(pImage, image_size, idat_ofs, idat_len, pOut, width, height, channels_in_file, desired_channels);
 	}
 
 #ifndef FPNG_NO_STDIO
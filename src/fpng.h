@@ -3,6 +3,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <atomic>
 #include <vector>
 
 #ifndef FPNG_TRAIN_HUFFMAN_TABLES
@@ -39,13 +40,41 @@ namespace fpng
 		
 		// Only use raw Deflate blocks (no compression at all). Intended for testing.
 		FPNG_FORCE_UNCOMPRESSED = 2,
+
+		// Input layout: B first in memory (BGR/BGRA) and/or colors premultiplied by alpha (4 channels only). Each row is converted to
+		// straight RGB(A) right before it's filtered, the source image is left as is.
+		FPNG_INPUT_BGR = 4,
+		FPNG_INPUT_PREMULTIPLIED = 8,
 	};
 
 	// Fast PNG encoding. The resulting file can be decoded either using a standard PNG decoder or by the fpng_decode_memory() function below.
-	// pImage: pointer to RGB or RGBA image pixels, R first in memory, B/A last.
-	// w/h - image dimensions. Image's row pitch in bytes must is w*num_chans.
+	// pImage: pointer to RGB or RGBA image pixels, R first in memory, B/A last (unless the FPNG_INPUT_* flags say otherwise).
+	// w/h - image dimensions.
 	// num_chans must be 3 or 4. 
-	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0);
+	// pTemp_buf: optional scratch buffer for the filtered scanlines. Passing the same vector to consecutive calls avoids allocating (bpl+1)*h bytes each time.
+	// pAbort: optional flag set by another thread to stop the encode early, it's checked between the filtering and Deflate passes. Returns false when aborted.
+	// src_pitch: bytes from one row of pImage to the next, at least w*num_chans. 0 means the rows are packed (w*num_chans).
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0, std::vector<uint8_t>* pTemp_buf = nullptr, const std::atomic<bool>* pAbort = nullptr, size_t src_pitch = 0);
+
+	// Multi-threaded variant of fpng_encode_image_to_memory(). The image is split into horizontal strips which are filtered and deflated
+	// by the calling thread together with a process wide set of helper threads (at most one per hardware thread besides the caller).
+	// num_threads is the number of strips to aim for, 0 = one per hardware thread. Each strip ends on a sync flush boundary, and the strips are stitched into a
+	// single IDAT stream with a combined Adler-32.
+	// The result is a standard PNG, but it doesn't carry the fdEC chunk, so fpng_decode_memory() will return FPNG_DECODE_NOT_FPNG for it.
+	// Images too small to be worth splitting are encoded exactly like fpng_encode_image_to_memory() would.
+	// pAbort is checked by each strip before filtering and before Deflate.
+	bool fpng_encode_image_to_memory_mt(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0, uint32_t num_threads = 0, std::vector<uint8_t>* pTemp_buf = nullptr, const std::atomic<bool>* pAbort = nullptr, size_t src_pitch = 0);
+
+	// ---- Pixel conversion for 32bpp pixels, SSE 4.1 with scalar fallbacks. pSrc and pDst may be the same buffer.
+
+	// Multiplies R, G and B by alpha, rounding like Wuffs' RGBA_NONPREMUL -> RGBA_PREMUL swizzler so the results match premultiplied decodes.
+	void fpng_premultiply(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels);
+
+	// Inverse of fpng_premultiply(), rounding like Wuffs' RGBA_PREMUL -> RGBA_NONPREMUL. Fully transparent pixels become 0.
+	void fpng_unpremultiply(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels);
+
+	// Reorders the channels of each pixel: pDst[c] = pSrc[order[c]], order being a permutation of 0-3.
+	void fpng_swizzle(const uint8_t* pSrc, uint8_t* pDst, size_t num_pixels, const uint8_t order[4]);
 
 #ifndef FPNG_NO_STDIO
 	// Fast PNG encoding to the specified file.
@@ -107,6 +136,10 @@ namespace fpng
 	// If another error occurs, the file is likely corrupted or invalid, but you can still try to decompress the file with another decoder (which will likely fail).
 	int fpng_decode_memory(const void* pImage, uint32_t image_size, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
 
+	// Same as above, but decompresses into a caller provided buffer. Size it with fpng_get_info(), out_size must be at least width*height*desired_channels
+	// or FPNG_DECODE_INVALID_ARG is returned.
+	int fpng_decode_memory(const void* pImage, uint32_t image_size, uint8_t* pOut, size_t out_size, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
+
 #ifndef FPNG_NO_STDIO
 	int fpng_decode_file(const char* pFilename, std::vector<uint8_t>& out, uint32_t& width, uint32_t& height, uint32_t& channels_in_file, uint32_t desired_channels);
 #endif
@@ -1,6 +1,9 @@
 #include <nan.h>
 #include <v8.h>
 #include "./png.h"
+#include "./webp.h"
+#include "./qoi.h"
+#include "./pool.h"
 #include "fpng.cpp"
 
 using namespace v8;
@@ -16,6 +19,199 @@ inline MaybeLocal<v8::Object> NewBuffer(
         v8::Isolate::GetCurrent(), data, length, callback, hint);
   }
 
+// Hands the decoded pixels over to a Buffer, which frees them when collected
+static Local<Object> NewPixelBuffer(uint8_t *pixels, uint32_t width, uint32_t height) {
+  return NewBuffer((char*)pixels, (size_t)width * height * 4, [] (char *data, void* hint) {
+    free(data);
+  }, nullptr).ToLocalChecked();
+}
+
+// Hands a decoder's output over, as a Buffer or, for pixelFormat 'rgba16', as a Uint16Array over the same memory
+static Local<Object> NewPixelData(PngReadClosure *closure) {
+  size_t length = (size_t)closure->width * closure->height * pixel_size(closure->pixelFormat);
+  Local<Object> buf = NewBuffer((char*)closure->buffer, length, [] (char *data, void* hint) {
+    free(data);
+  }, nullptr).ToLocalChecked();
+  if (closure->pixelFormat != PIXEL_RGBA16) return buf;
+  Local<Uint8Array> bytes = buf.As<Uint8Array>();
+  return Uint16Array::New(bytes->Buffer(), bytes->ByteOffset(), length / 2);
+}
+
+// Hands an encoder's output vector over to a Buffer, which deletes it when collected
+static Local<Object> NewVectorBuffer(std::unique_ptr<std::vector<uint8_t>> &output) {
+  auto vectorPtr = output.release();
+  return NewBuffer((char*)vectorPtr->data(), vectorPtr->size(), [] (char *data, void* hint) {
+    auto output = static_cast<std::vector<uint8_t>*>(hint);
+    delete output;
+  }, vectorPtr).ToLocalChecked();
+}
+
+// Hands the encoder output (fpng vector or libpng malloc) over to a Buffer
+static Local<Object> NewEncodedBuffer(PngWriteClosure *closure) {
+  if (closure->outputVector) {
+    return NewVectorBuffer(closure->outputVector);
+  }
+
+  auto buf = NewBuffer((char*)closure->output, closure->outputLength, [] (char *data, void* hint) {
+    free(data);
+  }, nullptr).ToLocalChecked();
+  closure->output = nullptr;
+  return buf;
+}
+
+// codec pool
+
+// Per environment state: the main thread and every worker_threads Worker that loads the addon get their own.
+// Jobs that run on the codec pool report back to their environment's JS thread through poolDone, which only keeps
+// the event loop alive while jobs are pending. Jobs hold a reference, so a Worker that exits while they still run
+// doesn't leave them signalling a freed handle: they find closed set and are dropped instead.
+struct AddonData {
+  uv_async_t poolDone;
+  std::mutex mutex;
+  std::vector<Nan::AsyncWorker*> done; // guarded by mutex
+  bool closed = false; // guarded by mutex, set once the environment is being torn down
+  uint32_t pending = 0; // JS thread only
+  Nan::Persistent<FunctionTemplate> abortToken;
+};
+
+// Node runs each environment on a thread of its own, so the JS thread finds its environment's data here
+static thread_local std::shared_ptr<AddonData> current_addon;
+
+static void pool_done_cb(uv_async_t *handle) {
+  AddonData *addon = static_cast<AddonData*>(handle->data);
+  std::vector<Nan::AsyncWorker*> workers;
+  {
+    std::lock_guard<std::mutex> lock(addon->mutex);
+    workers.swap(addon->done);
+  }
+  for (auto worker : workers) {
+    worker->WorkComplete();
+    worker->Destroy();
+    if (--addon->pending == 0) {
+      uv_unref((uv_handle_t*)&addon->poolDone);
+    }
+  }
+}
+
+// Environment cleanup hook. Jobs still running are abandoned with their callbacks, the environment can't call
+// them anymore. The data goes once the handle is closed and the last job let go of it.
+static void addon_cleanup(void *arg) {
+  auto addon = static_cast<std::shared_ptr<AddonData>*>(arg);
+  {
+    std::lock_guard<std::mutex> lock((*addon)->mutex);
+    (*addon)->closed = true;
+  }
+  (*addon)->abortToken.Reset();
+  (*addon)->poolDone.data = addon;
+  uv_close((uv_handle_t*)&(*addon)->poolDone, [] (uv_handle_t *handle) {
+    delete static_cast<std::shared_ptr<AddonData>*>(handle->data);
+  });
+  current_addon.reset();
+}
+
+static void addon_init(v8::Isolate *isolate) {
+  current_addon = std::make_shared<AddonData>();
+  uv_async_init(Nan::GetCurrentEventLoop(), &current_addon->poolDone, pool_done_cb);
+  current_addon->poolDone.data = current_addon.get();
+  uv_unref((uv_handle_t*)&current_addon->poolDone);
+  node::AddEnvironmentCleanupHook(isolate, addon_cleanup, new std::shared_ptr<AddonData>(current_addon));
+}
+
+// Called on the JS thread for every job submitted to the pool, returns the environment to report back to
+static std::shared_ptr<AddonData> pool_job_queued() {
+  std::shared_ptr<AddonData> addon = current_addon;
+  if (addon->pending++ == 0) {
+    uv_ref((uv_handle_t*)&addon->poolDone);
+  }
+  return addon;
+}
+
+// Called on a pool thread once a job's work is done, its callbacks then run on the JS thread of its environment
+static void pool_job_done(const std::shared_ptr<AddonData> &addon, Nan::AsyncWorker *worker) {
+  std::lock_guard<std::mutex> lock(addon->mutex);
+  if (addon->closed) return;
+  addon->done.push_back(worker);
+  uv_async_send(&addon->poolDone);
+}
+
+// Same as Nan::AsyncQueueWorker, but Execute() runs on the codec pool instead of libuv's threadpool
+static void QueueCodecWorker(Nan::AsyncWorker *worker, CodecPriority priority) {
+  std::shared_ptr<AddonData> addon = pool_job_queued();
+  codec_pool().submit(priority, [worker, addon] {
+    worker->Execute();
+    pool_job_done(addon, worker);
+  });
+}
+
+// 'interactive' (default) or 'background'
+static CodecPriority parsePriority(Local<Value> value) {
+  return value->StrictEquals(Nan::New("background").ToLocalChecked()) ? PRIORITY_BACKGROUND : PRIORITY_INTERACTIVE;
+}
+
+static CodecPriority optionsPriority(Local<Value> options) {
+  if (!options->IsObject()) return PRIORITY_INTERACTIVE;
+  return parsePriority(Nan::Get(options.As<Object>(), Nan::New("priority").ToLocalChecked()).ToLocalChecked());
+}
+
+// new AbortToken(), index.js calls abort() when the caller's AbortSignal fires. Its flag is shared with the closures
+// of the jobs it was passed to, so it stays valid however long they take to notice.
+class AbortToken : public Nan::ObjectWrap {
+ public:
+  static void Init(Local<Object> target) {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    tpl->SetClassName(Nan::New("AbortToken").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(tpl, "abort", Abort);
+    current_addon->abortToken.Reset(tpl);
+
+    Nan::Set(target, Nan::New("AbortToken").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+  }
+
+  // null when no token was passed (the caller gave no signal)
+  static AbortFlag flagOf(Local<Value> value) {
+    if (!value->IsObject() || !Nan::New(current_addon->abortToken)->HasInstance(value)) return nullptr;
+    return Nan::ObjectWrap::Unwrap<AbortToken>(value.As<Object>())->flag;
+  }
+
+ private:
+  AbortFlag flag = std::make_shared<std::atomic<bool>>(false);
+
+  static NAN_METHOD(New) {
+    if (!info.IsConstructCall()) {
+      return Nan::ThrowTypeError("Invalid arguments");
+    }
+    auto obj = new AbortToken();
+    obj->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  static NAN_METHOD(Abort) {
+    Nan::ObjectWrap::Unwrap<AbortToken>(info.This())->flag->store(true);
+  }
+};
+
+// Decode errors are reported as the generic message, except for the ones the caller can act on
+static const char *decodeErrorMessage(error_status status, const char *message) {
+  if (status == ES_INVALID_REGION) return "Region is outside the image.";
+  return message;
+}
+
+// decode(), decodeInto() and decodeBatch() take any format, so they can tell "not an image" apart
+static const char *imageErrorMessage(error_status status) {
+  if (status == ES_INVALID_SIGNATURE) return "Unsupported image format";
+  return decodeErrorMessage(status, "Image decoding failed.");
+}
+
+// "PNG " -> "png", "JPEG" -> "jpeg"
+static std::string fourcc_to_format(uint32_t fourcc) {
+  std::string format;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    char c = (char)((fourcc >> shift) & 0xFF);
+    if (c != ' ') format += (char)tolower(c);
+  }
+  return format;
+}
+
 class PngDecodeWorker : public Nan::AsyncWorker {
  public:
   PngDecodeWorker(Nan::Callback *callback, PngReadClosure* closure)
@@ -32,17 +228,15 @@ class PngDecodeWorker : public Nan::AsyncWorker {
   void Execute() override {
     closure->status = read_png(closure);
     if (closure->status != 0) {
-      SetErrorMessage("PNG decoding failed.");
+      SetErrorMessage(decodeErrorMessage(closure->status, "PNG decoding failed."));
     }
   }
 
   // Executed when the async work is complete
   void HandleOKCallback() override {
     Nan::HandleScope scope;
-  
-    Local<Object> buf = NewBuffer((char*)closure->buffer, closure->width * closure->height * 4, [] (char *data, void* hint) {
-      free(data);
-    }, nullptr).ToLocalChecked();
+
+    Local<Object> buf = NewPixelData(closure);
     Local<Value> argv[4] = { Nan::Null(), buf, Nan::New<v8::Int32>(closure->width), Nan::New<v8::Int32>(closure->height) };
     callback->Call(4, argv, async_resource);
   }
@@ -73,7 +267,7 @@ class WebpDecodeWorker : public Nan::AsyncWorker {
   void Execute() override {
     closure->status = read_webp(closure);
     if (closure->status != 0) {
-      SetErrorMessage("WebP decoding failed.");
+      SetErrorMessage(decodeErrorMessage(closure->status, "WebP decoding failed."));
     }
   }
 
@@ -81,9 +275,7 @@ class WebpDecodeWorker : public Nan::AsyncWorker {
   void HandleOKCallback() override {
     Nan::HandleScope scope;
 
-    Local<Object> buf = NewBuffer((char*)closure->buffer, closure->width * closure->height * 4, [] (char *data, void* hint) {
-      free(data);
-    }, nullptr).ToLocalChecked();
+    Local<Object> buf = NewPixelData(closure);
     Local<Value> argv[4] = { Nan::Null(), buf, Nan::New<v8::Int32>(closure->width), Nan::New<v8::Int32>(closure->height) };
     callback->Call(4, argv, async_resource);
   }
@@ -98,6 +290,345 @@ class WebpDecodeWorker : public Nan::AsyncWorker {
   WebpReadClosure* closure;
 };
 
+// Decodes any format read_image knows, the callback also gets the format name
+class ImageDecodeWorker : public Nan::AsyncWorker {
+ public:
+  ImageDecodeWorker(Nan::Callback *callback, PngReadClosure* closure)
+    : Nan::AsyncWorker(callback), closure(closure) {}
+
+  ~ImageDecodeWorker() {
+    closure->cb.Reset();
+    closure->dataRef.Reset();
+    delete closure;
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    closure->status = read_image(closure);
+    if (closure->status != 0) {
+      SetErrorMessage(imageErrorMessage(closure->status));
+    }
+  }
+
+  // Executed when the async work is complete
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Object> buf = NewPixelData(closure);
+    Local<Value> argv[5] = { Nan::Null(), buf, Nan::New<v8::Int32>(closure->width), Nan::New<v8::Int32>(closure->height),
+                             Nan::New(fourcc_to_format(closure->fourcc)).ToLocalChecked() };
+    callback->Call(5, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  PngReadClosure* closure;
+};
+
+// Decodes any image straight into caller owned memory, no pixel Buffer is created
+class DecodeIntoWorker : public Nan::AsyncWorker {
+ public:
+  DecodeIntoWorker(Nan::Callback *callback, PngReadClosure* closure)
+    : Nan::AsyncWorker(callback), closure(closure) {}
+
+  ~DecodeIntoWorker() {
+    closure->cb.Reset();
+    closure->dataRef.Reset();
+    closure->destRef.Reset();
+    delete closure;
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    closure->status = read_image(closure);
+    if (closure->status == ES_DEST_TOO_SMALL) {
+      SetErrorMessage("Destination buffer too small.");
+    } else if (closure->status != 0) {
+      SetErrorMessage(imageErrorMessage(closure->status));
+    }
+  }
+
+  // Executed when the async work is complete
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Value> argv[4] = { Nan::Null(), Nan::Null(), Nan::New<v8::Int32>(closure->width), Nan::New<v8::Int32>(closure->height) };
+    callback->Call(4, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  PngReadClosure* closure;
+};
+
+// PngStreamDecoder exposed to JS, index.js wraps it in a Transform stream
+class PngDecoderStream : public Nan::ObjectWrap {
+ public:
+  static void Init(Local<Object> target) {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    tpl->SetClassName(Nan::New("PngDecoderStream").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(tpl, "write", Write);
+
+    Nan::Set(target, Nan::New("PngDecoderStream").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+  }
+
+  PngStreamDecoder decoder;
+  CodecPriority priority;
+  bool busy = false;
+
+ private:
+  PngDecoderStream(bool premultiplied, CodecPriority priority, uint32_t bandHeight)
+    : decoder(premultiplied, bandHeight), priority(priority) {}
+
+  // new PngDecoderStream(premultiplied, priority, bandHeight)
+  static NAN_METHOD(New) {
+    if (!info.IsConstructCall() || !info[0]->IsBoolean() || !info[2]->IsUint32() || Nan::To<uint32_t>(info[2]).FromJust() == 0) {
+      return Nan::ThrowTypeError("Invalid arguments");
+    }
+    auto obj = new PngDecoderStream(info[0]->BooleanValue(info.GetIsolate()), parsePriority(info[1]), Nan::To<uint32_t>(info[2]).FromJust());
+    obj->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  // write(chunk, closed, cb), one call at a time
+  static NAN_METHOD(Write);
+};
+
+class PngStreamWriteWorker : public Nan::AsyncWorker {
+ public:
+  PngStreamWriteWorker(Nan::Callback *callback, PngDecoderStream *stream, Local<Object> self, Local<Value> chunk, bool closed)
+    : Nan::AsyncWorker(callback), stream(stream), closed(closed) {
+    // keeps the decoder and the chunk alive while the worker runs
+    SaveToPersistent("self", self);
+    SaveToPersistent("chunk", chunk);
+    data = (uint8_t*)node::Buffer::Data(chunk);
+    length = node::Buffer::Length(chunk);
+  }
+
+  ~PngStreamWriteWorker() {
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    error_status status = stream->decoder.write(data, length, closed);
+    if (status == ES_READING_PAST_END) {
+      SetErrorMessage("PNG decoding failed: unexpected end of stream.");
+    } else if (status != 0) {
+      SetErrorMessage("PNG decoding failed.");
+    }
+  }
+
+  // Executed when the async work is complete
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    stream->busy = false;
+
+    // the rows finished during this write, in bands
+    PngStreamDecoder &decoder = stream->decoder;
+    std::vector<PngStreamBand> bands = decoder.takeBands();
+    Local<Array> buffers = Nan::New<Array>(bands.size());
+    for (size_t i = 0; i < bands.size(); i++) {
+      Nan::Set(buffers, i, NewPixelBuffer(bands[i].pixels, decoder.width(), bands[i].height));
+    }
+    Local<Value> argv[4] = {
+      Nan::Null(),
+      buffers,
+      Nan::New<v8::Int32>(decoder.hasHeader() ? decoder.width() : 0),
+      Nan::New<v8::Int32>(decoder.hasHeader() ? decoder.height() : 0)
+    };
+    callback->Call(4, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    stream->busy = false;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  PngDecoderStream *stream;
+  uint8_t *data;
+  size_t length;
+  bool closed;
+};
+
+NAN_METHOD(PngDecoderStream::Write) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean() || !info[2]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto stream = Nan::ObjectWrap::Unwrap<PngDecoderStream>(info.This());
+  if (stream->busy) {
+    return Nan::ThrowError("PNG decoder is busy");
+  }
+  stream->busy = true;
+
+  Nan::Callback *callback = new Nan::Callback(info[2].As<Function>());
+  QueueCodecWorker(new PngStreamWriteWorker(callback, stream, info.This(), info[0], info[1]->BooleanValue(info.GetIsolate())), stream->priority);
+}
+
+// AnimationDecoder exposed to JS, index.js wraps it in an async generator
+class ImageAnimation : public Nan::ObjectWrap {
+ public:
+  static void Init(Local<Object> target) {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    tpl->SetClassName(Nan::New("ImageAnimation").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(tpl, "next", Next);
+
+    Nan::Set(target, Nan::New("ImageAnimation").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+  }
+
+  AnimationDecoder decoder;
+  CodecPriority priority;
+  bool busy = false;
+
+ private:
+  ImageAnimation(bool premultiplied, CodecPriority priority) : decoder(premultiplied), priority(priority) {}
+
+  ~ImageAnimation() {
+    dataRef.Reset();
+  }
+
+  Nan::Persistent<Value> dataRef; // the decoder reads straight from the input Buffer
+
+  // new ImageAnimation(buffer, premultiplied, priority), reads the header on the calling thread
+  static NAN_METHOD(New) {
+    if (!info.IsConstructCall() || !node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean()) {
+      return Nan::ThrowTypeError("Invalid arguments");
+    }
+    auto obj = new ImageAnimation(info[1]->BooleanValue(info.GetIsolate()), parsePriority(info[2]));
+    error_status status = obj->decoder.open((uint8_t*)node::Buffer::Data(info[0]), node::Buffer::Length(info[0]));
+    if (status != ES_SUCCESS) {
+      delete obj;
+      return Nan::ThrowError(status == ES_INVALID_SIGNATURE ? "Unsupported image format" : "Invalid image header.");
+    }
+    obj->dataRef.Reset(info[0]);
+    obj->Wrap(info.This());
+    Nan::Set(info.This(), Nan::New("width").ToLocalChecked(), Nan::New<v8::Uint32>(obj->decoder.width()));
+    Nan::Set(info.This(), Nan::New("height").ToLocalChecked(), Nan::New<v8::Uint32>(obj->decoder.height()));
+    Nan::Set(info.This(), Nan::New("format").ToLocalChecked(), Nan::New(fourcc_to_format(obj->decoder.format())).ToLocalChecked());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  // next(abort, cb), cb(error, frame) with a null frame after the last one, one call at a time
+  static NAN_METHOD(Next);
+};
+
+class AnimationFrameWorker : public Nan::AsyncWorker {
+ public:
+  AnimationFrameWorker(Nan::Callback *callback, ImageAnimation *animation, Local<Object> self, AbortFlag abort)
+    : Nan::AsyncWorker(callback), animation(animation), abort(abort) {
+    // keeps the decoder (and with it the input) alive while the worker runs
+    SaveToPersistent("self", self);
+  }
+
+  ~AnimationFrameWorker() {
+    free(pixels);
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    AnimationDecoder &decoder = animation->decoder;
+    error_status status = aborted(abort) ? ES_ABORTED : decoder.next(&frame, &done);
+    if (status != ES_SUCCESS) {
+      SetErrorMessage("Image decoding failed.");
+      return;
+    }
+    if (done) return;
+
+    // the canvas is drawn over by the next frame, each frame gets its own copy
+    size_t length = (size_t)decoder.width() * decoder.height() * 4;
+    pixels = (uint8_t*)malloc(std::max(length, (size_t)1));
+    if (!pixels) {
+      SetErrorMessage("Image decoding failed.");
+      return;
+    }
+    memcpy(pixels, decoder.canvas(), length);
+  }
+
+  // Executed when the async work is complete
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    animation->busy = false;
+
+    if (done) {
+      Local<Value> argv[2] = { Nan::Null(), Nan::Null() };
+      callback->Call(2, argv, async_resource);
+      return;
+    }
+
+    AnimationDecoder &decoder = animation->decoder;
+    Local<Object> dirty = Nan::New<Object>();
+    Nan::Set(dirty, Nan::New("x").ToLocalChecked(), Nan::New<v8::Uint32>(frame.dirty.min_incl_x));
+    Nan::Set(dirty, Nan::New("y").ToLocalChecked(), Nan::New<v8::Uint32>(frame.dirty.min_incl_y));
+    Nan::Set(dirty, Nan::New("w").ToLocalChecked(), Nan::New<v8::Uint32>(frame.dirty.width()));
+    Nan::Set(dirty, Nan::New("h").ToLocalChecked(), Nan::New<v8::Uint32>(frame.dirty.height()));
+
+    Local<Object> result = Nan::New<Object>();
+    Nan::Set(result, Nan::New("index").ToLocalChecked(), Nan::New<v8::Uint32>(frame.index));
+    Nan::Set(result, Nan::New("data").ToLocalChecked(), NewPixelBuffer(pixels, decoder.width(), decoder.height()));
+    pixels = nullptr;
+    Nan::Set(result, Nan::New("width").ToLocalChecked(), Nan::New<v8::Uint32>(decoder.width()));
+    Nan::Set(result, Nan::New("height").ToLocalChecked(), Nan::New<v8::Uint32>(decoder.height()));
+    Nan::Set(result, Nan::New("duration").ToLocalChecked(), Nan::New<v8::Number>(frame.duration));
+    Nan::Set(result, Nan::New("dirty").ToLocalChecked(), dirty);
+    Nan::Set(result, Nan::New("loopCount").ToLocalChecked(), Nan::New<v8::Uint32>(decoder.loopCount()));
+    Local<Value> argv[2] = { Nan::Null(), result };
+    callback->Call(2, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    animation->busy = false;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  ImageAnimation *animation;
+  AbortFlag abort;
+  AnimationFrame frame;
+  bool done = false;
+  uint8_t *pixels = nullptr;
+};
+
+NAN_METHOD(ImageAnimation::Next) {
+  if (!info[1]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto animation = Nan::ObjectWrap::Unwrap<ImageAnimation>(info.This());
+  if (animation->busy) {
+    return Nan::ThrowError("Animation decoder is busy");
+  }
+  animation->busy = true;
+
+  Nan::Callback *callback = new Nan::Callback(info[1].As<Function>());
+  QueueCodecWorker(new AnimationFrameWorker(callback, animation, info.This(), AbortToken::flagOf(info[0])), animation->priority);
+}
+
+static const char *encodeErrorMessage(error_status status) {
+  if (status == ES_COLOR_NOT_IN_PALETTE) return "PNG encoding failed: pixel color not in palette.";
+  return "PNG encoding failed.";
+}
+
 class PngEncodeWorker : public Nan::AsyncWorker {
  public:
   PngEncodeWorker(Nan::Callback *callback, PngWriteClosure* closure)
@@ -114,29 +645,15 @@ class PngEncodeWorker : public Nan::AsyncWorker {
   void Execute() override {
     closure->status = write_png(closure);
     if (closure->status != 0) {
-      SetErrorMessage("PNG encoding failed.");
+      SetErrorMessage(encodeErrorMessage(closure->status));
     }
   }
 
   // Executed when the async work is complete
   void HandleOKCallback() override {
     Nan::HandleScope scope;
-    if (closure->outputVector) {
-      auto vectorPtr = closure->outputVector.release();
-      Local<Object> buf = NewBuffer((char*)vectorPtr->data(), vectorPtr->size(), [] (char *data, void* hint) {
-        auto output = static_cast<std::vector<uint8_t*>*>(hint);
-        delete output;
-      }, vectorPtr).ToLocalChecked();
-    Local<Value> argv[2] = { Nan::Null(), buf };
-    callback->Call(2, argv, async_resource);
-    return;
-      
-  }
-
-    Local<Object> buf = NewBuffer((char*)closure->output, closure->outputLength, [] (char *data, void* hint) {
-      free(data);
-    }, nullptr).ToLocalChecked();
 
+    Local<Object> buf = NewEncodedBuffer(closure);
     Local<Value> argv[2] = { Nan::Null(), buf };
     callback->Call(2, argv, async_resource);
   }
@@ -168,6 +685,34 @@ static const char *parsePNGArgs(Local<Value> arg, PngWriteClosure *pngargs) {
       if (val > 0) pngargs->resolution = val;
     }
 
+    Local<Value> threads = Nan::Get(obj, Nan::New("threads").ToLocalChecked()).ToLocalChecked();
+    if (!threads->IsUndefined()) {
+      uint32_t val = threads->IsUint32() ? Nan::To<uint32_t>(threads).FromMaybe(1) : UINT32_MAX;
+      if (val > 256) return "threads must be an integer between 0 and 256.";
+      // more strips than cores only adds stitching overhead, 0 = one per core
+      uint32_t cores = std::max(1u, std::thread::hardware_concurrency());
+      pngargs->threads = val == 0 ? cores : std::min(val, cores);
+    }
+
+    Local<Value> optimizeColorType = Nan::Get(obj, Nan::New("optimizeColorType").ToLocalChecked()).ToLocalChecked();
+    if (optimizeColorType->IsBoolean()) pngargs->optimizeColorType = Nan::To<bool>(optimizeColorType).FromMaybe(false);
+
+    Local<Value> inputFormat = Nan::Get(obj, Nan::New("inputFormat").ToLocalChecked()).ToLocalChecked();
+    if (!inputFormat->IsUndefined()) {
+      // only strings are converted, Utf8String would call toString() on anything else
+      std::string name;
+      if (inputFormat->IsString()) name = *Nan::Utf8String(inputFormat);
+      if (name == "rgba16" || name == "rgb16" || name == "gray16") {
+        pngargs->input16 = true;
+        pngargs->inputChannels = name[0] == 'g' ? 1 : name.size() - 2;
+      } else if (name == "rgba" || name == "bgra" || name == "rgba-premul" || name == "bgra-premul") {
+        pngargs->inputBGRA = name.compare(0, 4, "bgra") == 0;
+        pngargs->inputPremultiplied = name.size() > 4;
+      } else {
+        return "inputFormat must be 'rgba', 'bgra', 'rgba-premul', 'bgra-premul', 'rgba16', 'rgb16' or 'gray16'.";
+      }
+    }
+
     Local<Value> filters = Nan::Get(obj, Nan::New("filters").ToLocalChecked()).ToLocalChecked();
     if (filters->IsUint32()) pngargs->filters = Nan::To<uint32_t>(filters).FromMaybe(0);
 
@@ -179,82 +724,1130 @@ static const char *parsePNGArgs(Local<Value> arg, PngWriteClosure *pngargs) {
         return "Palette length must be a multiple of 4.";
       }
       pngargs->nPaletteColors /= 4;
+      if (pngargs->nPaletteColors == 0 || pngargs->nPaletteColors > 256) {
+        return "Palette must have between 1 and 256 colors.";
+      }
       Nan::TypedArrayContents<uint8_t> _paletteColors(palette_ta);
-      pngargs->palette = *_paletteColors;
+      pngargs->palette.assign(*_paletteColors, *_paletteColors + pngargs->nPaletteColors * 4);
       // Optional background color index:
       Local<Value> backgroundIndexVal = Nan::Get(obj, Nan::New("backgroundIndex").ToLocalChecked()).ToLocalChecked();
       if (backgroundIndexVal->IsUint32()) {
         pngargs->backgroundIndex = static_cast<uint8_t>(Nan::To<uint32_t>(backgroundIndexVal).FromMaybe(0));
       }
+      if (pngargs->input16) {
+        return "Indexed PNGs take 8 bit RGBA input.";
+      }
     }
   }
   
   return nullptr;
 }
 
-NAN_METHOD(encodePNG) {
-  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !node::Buffer::HasInstance(info[2]) || !info[4]->IsFunction()) {
-    return Nan::ThrowTypeError("Invalid arguments");
+// Decoder options: region { x, y, w, h }, shrink-on-load with scale (1, 1/2, 1/4 or 1/8), maxWidth and maxHeight,
+// and pixelFormat
+static const char *parseDecodeOptions(Local<Value> options, DecodeShrink *shrink, DecodeRegion *region, DecodePixelFormat *pixelFormat) {
+  if (!options->IsObject()) return nullptr;
+  Local<Object> obj = options.As<Object>();
+
+  Local<Value> scale = Nan::Get(obj, Nan::New("scale").ToLocalChecked()).ToLocalChecked();
+  if (!scale->IsUndefined()) {
+    double value = scale->IsNumber() ? Nan::To<double>(scale).FromJust() : 0;
+    if (value != 1 && value != 0.5 && value != 0.25 && value != 0.125) {
+      return "scale must be 1, 1/2, 1/4 or 1/8.";
+    }
+    shrink->factor = (uint32_t)(1 / value);
   }
 
-  auto closure = new PngWriteClosure();
-  closure->width = Nan::To<uint32_t>(info[0]).FromMaybe(0);
-  closure->height = Nan::To<uint32_t>(info[1]).FromMaybe(0);
-  auto length = node::Buffer::Length(info[2]);
+  Local<Value> maxWidth = Nan::Get(obj, Nan::New("maxWidth").ToLocalChecked()).ToLocalChecked();
+  Local<Value> maxHeight = Nan::Get(obj, Nan::New("maxHeight").ToLocalChecked()).ToLocalChecked();
+  if ((!maxWidth->IsUndefined() && (!maxWidth->IsUint32() || Nan::To<uint32_t>(maxWidth).FromJust() == 0)) ||
+      (!maxHeight->IsUndefined() && (!maxHeight->IsUint32() || Nan::To<uint32_t>(maxHeight).FromJust() == 0))) {
+    return "maxWidth and maxHeight must be positive integers.";
+  }
+  if (maxWidth->IsUint32()) shrink->maxWidth = Nan::To<uint32_t>(maxWidth).FromJust();
+  if (maxHeight->IsUint32()) shrink->maxHeight = Nan::To<uint32_t>(maxHeight).FromJust();
 
-  if (length != (closure->width * closure->height * 4)) {
-    delete closure;
+  Local<Value> regionVal = Nan::Get(obj, Nan::New("region").ToLocalChecked()).ToLocalChecked();
+  if (!regionVal->IsUndefined()) {
+    if (!regionVal->IsObject()) return "region must be an object with x, y, w and h.";
+    Local<Object> rect = regionVal.As<Object>();
+    Local<Value> x = Nan::Get(rect, Nan::New("x").ToLocalChecked()).ToLocalChecked();
+    Local<Value> y = Nan::Get(rect, Nan::New("y").ToLocalChecked()).ToLocalChecked();
+    Local<Value> w = Nan::Get(rect, Nan::New("w").ToLocalChecked()).ToLocalChecked();
+    Local<Value> h = Nan::Get(rect, Nan::New("h").ToLocalChecked()).ToLocalChecked();
+    if (!x->IsUint32() || !y->IsUint32() || !w->IsUint32() || !h->IsUint32() ||
+        Nan::To<uint32_t>(w).FromJust() == 0 || Nan::To<uint32_t>(h).FromJust() == 0) {
+      return "region x and y must be non-negative integers, w and h positive integers.";
+    }
+    region->x = Nan::To<uint32_t>(x).FromJust();
+    region->y = Nan::To<uint32_t>(y).FromJust();
+    region->width = Nan::To<uint32_t>(w).FromJust();
+    region->height = Nan::To<uint32_t>(h).FromJust();
+  }
+
+  Local<Value> formatVal = Nan::Get(obj, Nan::New("pixelFormat").ToLocalChecked()).ToLocalChecked();
+  if (!formatVal->IsUndefined()) {
+    std::string name;
+    if (formatVal->IsString()) name = *Nan::Utf8String(formatVal);
+    if (name == "rgba") {
+      *pixelFormat = PIXEL_RGBA;
+    } else if (name == "bgra" || name == "bgra-premul") {
+      // bgra-premul sets premultiplied, which comes in separately
+      *pixelFormat = PIXEL_BGRA;
+    } else if (name == "rgb") {
+      *pixelFormat = PIXEL_RGB;
+    } else if (name == "gray") {
+      *pixelFormat = PIXEL_GRAY;
+    } else if (name == "graya") {
+      *pixelFormat = PIXEL_GRAYA;
+    } else if (name == "rgba16") {
+      *pixelFormat = PIXEL_RGBA16;
+    } else if (name == "rgba16be") {
+      *pixelFormat = PIXEL_RGBA16BE;
+    } else {
+      return "pixelFormat must be 'rgba', 'bgra', 'bgra-premul', 'rgb', 'gray', 'graya', 'rgba16' or 'rgba16be'.";
+    }
+    if (is_16bit(*pixelFormat) && shrink->enabled()) {
+      return "scale, maxWidth and maxHeight only work with 8 bit pixel formats.";
+    }
+  }
+  return nullptr;
+}
+
+// Non-negative integer byte count, Buffers may be larger than 4 GiB so IsUint32() won't do
+static bool toSize(Local<Value> value, size_t *out) {
+  if (!value->IsNumber()) return false;
+  double val = Nan::To<double>(value).FromMaybe(-1);
+  if (!(val >= 0) || val != std::floor(val) || val > 9007199254740991.0) return false;
+  *out = (size_t)val;
+  return true;
+}
+
+// Fills in the closure from (width, height, data, options), returns an error message on invalid input
+static const char *parseEncodeValues(Local<Value> width, Local<Value> height, Local<Value> data, Local<Value> options, PngWriteClosure *closure) {
+  if (!width->IsNumber() || !height->IsNumber() || !node::Buffer::HasInstance(data)) {
+    return "Invalid arguments";
+  }
+
+  closure->width = Nan::To<uint32_t>(width).FromMaybe(0);
+  closure->height = Nan::To<uint32_t>(height).FromMaybe(0);
+  auto length = node::Buffer::Length(data);
+
+  // inputFormat decides the bytes per pixel
+  auto error = parsePNGArgs(options, closure);
+  if (error) {
+    return error;
+  }
+
+  // Optional { stride, offset } to encode a sub-view of data without copying it out first
+  Local<Value> strideVal = Nan::Undefined(), offsetVal = Nan::Undefined();
+  if (options->IsObject()) {
+    Local<Object> obj = Nan::To<Object>(options).ToLocalChecked();
+    strideVal = Nan::Get(obj, Nan::New("stride").ToLocalChecked()).ToLocalChecked();
+    offsetVal = Nan::Get(obj, Nan::New("offset").ToLocalChecked()).ToLocalChecked();
+  }
+
+  size_t rowBytes = (size_t)closure->width * input_pixel_size(closure);
+  size_t offset = 0;
+  if (strideVal->IsUndefined() && offsetVal->IsUndefined()) {
+    if (length != rowBytes * closure->height) {
+      return "Invalid buffer size";
+    }
+  } else {
+    if (closure->width == 0 || closure->height == 0) {
+      return "Invalid arguments";
+    }
+    closure->stride = rowBytes;
+    if ((!strideVal->IsUndefined() && !toSize(strideVal, &closure->stride)) ||
+        (!offsetVal->IsUndefined() && !toSize(offsetVal, &offset)) || closure->stride < rowBytes) {
+      return "stride must be an integer of at least one row of pixels (width * 4 for RGBA) and offset a non-negative integer.";
+    }
+    // the last row only needs rowBytes, not a whole stride
+    if (offset > length || length - offset < rowBytes || (length - offset - rowBytes) / closure->stride < closure->height - 1) {
+      return "Invalid buffer size";
+    }
+  }
+
+  closure->data = (uint8_t*)node::Buffer::Data(data) + offset;
+  return nullptr;
+}
+
+static const char *parseEncodeArgs(Nan::NAN_METHOD_ARGS_TYPE info, PngWriteClosure *closure) {
+  return parseEncodeValues(info[0], info[1], info[2], info[3], closure);
+}
+
+// PngStreamEncoder exposed to JS, index.js wraps it in a Transform stream
+class PngEncoderStream : public Nan::ObjectWrap {
+ public:
+  static void Init(Local<Object> target) {
+    Local<FunctionTemplate> tpl = Nan::New<FunctionTemplate>(New);
+    tpl->SetClassName(Nan::New("PngEncoderStream").ToLocalChecked());
+    tpl->InstanceTemplate()->SetInternalFieldCount(1);
+    Nan::SetPrototypeMethod(tpl, "write", Write);
+
+    Nan::Set(target, Nan::New("PngEncoderStream").ToLocalChecked(), Nan::GetFunction(tpl).ToLocalChecked());
+  }
+
+  PngStreamEncoder encoder;
+  CodecPriority priority = PRIORITY_INTERACTIVE;
+  bool busy = false;
+
+ private:
+  // new PngEncoderStream(width, height, options)
+  static NAN_METHOD(New) {
+    if (!info.IsConstructCall() || !info[0]->IsNumber() || !info[1]->IsNumber()) {
+      return Nan::ThrowTypeError("Invalid arguments");
+    }
+    auto obj = new PngEncoderStream();
+    PngWriteClosure &options = obj->encoder.options;
+    options.width = Nan::To<uint32_t>(info[0]).FromMaybe(0);
+    options.height = Nan::To<uint32_t>(info[1]).FromMaybe(0);
+    auto error = parsePNGArgs(info[2], &options);
+    obj->priority = optionsPriority(info[2]);
+    if (!error && (options.width == 0 || options.height == 0)) error = "Invalid arguments";
+    if (error) {
+      delete obj;
+      return Nan::ThrowTypeError(error);
+    }
+    obj->Wrap(info.This());
+    info.GetReturnValue().Set(info.This());
+  }
+
+  // write(rows, cb), rows are whole rows laid out as inputFormat says, one call at a time
+  static NAN_METHOD(Write);
+};
+
+class PngStreamEncodeWorker : public Nan::AsyncWorker {
+ public:
+  PngStreamEncodeWorker(Nan::Callback *callback, PngEncoderStream *stream, Local<Object> self, Local<Value> rows, uint32_t nRows)
+    : Nan::AsyncWorker(callback), stream(stream), nRows(nRows) {
+    // keeps the encoder and the rows alive while the worker runs
+    SaveToPersistent("self", self);
+    SaveToPersistent("rows", rows);
+    data = (uint8_t*)node::Buffer::Data(rows);
+  }
+
+  ~PngStreamEncodeWorker() {
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    error_status status = stream->encoder.write(data, nRows);
+    if (status != 0) {
+      SetErrorMessage(encodeErrorMessage(status));
+    }
+  }
+
+  // Executed when the async work is complete
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+    stream->busy = false;
+
+    size_t length;
+    uint8_t *output = stream->encoder.takeOutput(&length);
+    Local<Value> buf = Nan::Null();
+    if (output) {
+      buf = NewBuffer((char*)output, length, [] (char *data, void* hint) {
+        free(data);
+      }, nullptr).ToLocalChecked();
+    }
+    Local<Value> argv[3] = { Nan::Null(), buf, Nan::New<v8::Uint32>(stream->encoder.rowsWritten()) };
+    callback->Call(3, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    stream->busy = false;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  PngEncoderStream *stream;
+  uint8_t *data;
+  uint32_t nRows;
+};
+
+NAN_METHOD(PngEncoderStream::Write) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto stream = Nan::ObjectWrap::Unwrap<PngEncoderStream>(info.This());
+  PngStreamEncoder &encoder = stream->encoder;
+  size_t rowBytes = (size_t)encoder.options.width * input_pixel_size(&encoder.options);
+  size_t length = node::Buffer::Length(info[0]);
+  if (length % rowBytes != 0 || length / rowBytes > encoder.options.height - encoder.rowsWritten()) {
     return Nan::ThrowTypeError("Invalid buffer size");
   }
+  if (stream->busy) {
+    return Nan::ThrowError("PNG encoder is busy");
+  }
+  stream->busy = true;
 
-  auto error = parsePNGArgs(info[3], closure);
+  Nan::Callback *callback = new Nan::Callback(info[1].As<Function>());
+  QueueCodecWorker(new PngStreamEncodeWorker(callback, stream, info.This(), info[0], (uint32_t)(length / rowBytes)), stream->priority);
+}
+
+// encodePNG(width, height, data, options, abort, cb)
+NAN_METHOD(encodePNG) {
+  if (!info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto closure = new PngWriteClosure();
+  auto error = parseEncodeArgs(info, closure);
   if (error) {
     delete closure;
     return Nan::ThrowTypeError(error);
   }
 
+  closure->dataRef.Reset(info[2]);
+  closure->abort = AbortToken::flagOf(info[4]);
+
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new PngEncodeWorker(callback, closure), optionsPriority(info[3]));
+}
+
+// Runs write_png on the calling thread, for small images and callers that run their own worker threads
+NAN_METHOD(encodePNGSync) {
+  PngWriteClosure closure;
+  auto error = parseEncodeArgs(info, &closure);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.status = write_png(&closure);
+  if (closure.status != 0) {
+    free(closure.output);
+    return Nan::ThrowError(encodeErrorMessage(closure.status));
+  }
+
+  info.GetReturnValue().Set(NewEncodedBuffer(&closure));
+}
+
+// lossless WebP
+
+static const char *webpErrorMessage(error_status status) {
+  if (status == ES_INVALID_FORMAT) return "WebP encoding failed: images are limited to 16384 x 16384 pixels.";
+  return "WebP encoding failed.";
+}
+
+class WebpEncodeWorker : public Nan::AsyncWorker {
+ public:
+  WebpEncodeWorker(Nan::Callback *callback, WebpWriteClosure* closure)
+    : Nan::AsyncWorker(callback), closure(closure) {}
+
+  ~WebpEncodeWorker() {
+    closure->dataRef.Reset();
+    delete closure;
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    closure->status = write_webp_lossless(closure);
+    if (closure->status != 0) {
+      SetErrorMessage(webpErrorMessage(closure->status));
+    }
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Value> argv[2] = { Nan::Null(), NewVectorBuffer(closure->output) };
+    callback->Call(2, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  WebpWriteClosure* closure;
+};
+
+// (width, height, data, options), returns an error message on invalid input
+static const char *parseWebPArgs(Nan::NAN_METHOD_ARGS_TYPE info, WebpWriteClosure *closure) {
+  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !node::Buffer::HasInstance(info[2])) {
+    return "Invalid arguments";
+  }
+
+  closure->width = Nan::To<uint32_t>(info[0]).FromMaybe(0);
+  closure->height = Nan::To<uint32_t>(info[1]).FromMaybe(0);
+  if (node::Buffer::Length(info[2]) != (size_t)closure->width * closure->height * 4) {
+    return "Invalid buffer size";
+  }
+  if (closure->width == 0 || closure->height == 0 || closure->width > VP8L_MAX_DIMENSION || closure->height > VP8L_MAX_DIMENSION) {
+    return "width and height must be between 1 and 16384.";
+  }
+
+  if (info[3]->IsObject()) {
+    Local<Object> obj = Nan::To<Object>(info[3]).ToLocalChecked();
+    Local<Value> effort = Nan::Get(obj, Nan::New("effort").ToLocalChecked()).ToLocalChecked();
+    if (!effort->IsUndefined()) {
+      if (!effort->IsUint32() || Nan::To<uint32_t>(effort).FromJust() > 9) return "effort must be an integer from 0 to 9.";
+      closure->effort = Nan::To<uint32_t>(effort).FromJust();
+    }
+  }
+
   closure->data = (uint8_t*)node::Buffer::Data(info[2]);
+  return nullptr;
+}
+
+// encodeWebPLossless(width, height, data, options, abort, cb)
+NAN_METHOD(encodeWebPLossless) {
+  if (!info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto closure = new WebpWriteClosure();
+  auto error = parseWebPArgs(info, closure);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
   closure->dataRef.Reset(info[2]);
+  closure->abort = AbortToken::flagOf(info[4]);
+
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new WebpEncodeWorker(callback, closure), optionsPriority(info[3]));
+}
+
+NAN_METHOD(encodeWebPLosslessSync) {
+  WebpWriteClosure closure;
+  auto error = parseWebPArgs(info, &closure);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.status = write_webp_lossless(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError(webpErrorMessage(closure.status));
+  }
+
+  info.GetReturnValue().Set(NewVectorBuffer(closure.output));
+}
+
+// batches
+
+// AsyncWorker whose items run in parallel on the codec pool, the callbacks run once all of them are done.
+// Items report their own errors, so HandleOKCallback is always the one called.
+class PoolBatchWorker : public Nan::AsyncWorker {
+ public:
+  PoolBatchWorker(Nan::Callback *callback, size_t nItems)
+    : Nan::AsyncWorker(callback), nItems(nItems), remaining(nItems) {}
+
+  ~PoolBatchWorker() {
+    delete callback;
+  }
+
+  void Execute() override {}
+
+  // Executed inside a pool thread, for each item
+  virtual void ExecuteItem(size_t i) = 0;
+
+  void Queue(CodecPriority priority) {
+    std::shared_ptr<AddonData> addon = pool_job_queued();
+    if (nItems == 0) {
+      pool_job_done(addon, this);
+      return;
+    }
+    for (size_t i = 0; i < nItems; i++) {
+      codec_pool().submit(priority, [this, i, addon] {
+        ExecuteItem(i);
+        if (--remaining == 0) pool_job_done(addon, this);
+      });
+    }
+  }
+
+ protected:
+  size_t nItems;
+
+ private:
+  std::atomic<size_t> remaining;
+};
+
+class DecodeBatchWorker : public PoolBatchWorker {
+ public:
+  DecodeBatchWorker(Nan::Callback *callback, Local<Array> buffers, bool premultiplied, AbortFlag abort, const DecodeShrink &shrink, const DecodeRegion &region, DecodePixelFormat pixelFormat)
+    : PoolBatchWorker(callback, buffers->Length()), items(new PngReadClosure[buffers->Length()]) {
+    // one handle keeps all inputs alive, even if the caller modifies its array
+    Local<Array> inputs = Nan::New<Array>(nItems);
+    for (uint32_t i = 0; i < nItems; i++) {
+      Local<Value> buffer = Nan::Get(buffers, i).ToLocalChecked();
+      Nan::Set(inputs, i, buffer);
+      items[i].premultiplied = premultiplied;
+      items[i].abort = abort;
+      items[i].shrink = shrink;
+      items[i].region = region;
+      items[i].pixelFormat = pixelFormat;
+      if (node::Buffer::HasInstance(buffer)) {
+        items[i].data = (uint8_t*)node::Buffer::Data(buffer);
+        items[i].length = node::Buffer::Length(buffer);
+      } else {
+        items[i].data = nullptr;
+        items[i].status = ES_INVALID_FORMAT;
+      }
+    }
+    SaveToPersistent("inputs", inputs);
+  }
+
+  void ExecuteItem(size_t i) override {
+    PngReadClosure &item = items[i];
+    if (!item.data) return;
+    item.status = read_image(&item);
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Array> results = Nan::New<Array>(nItems);
+    for (uint32_t i = 0; i < nItems; i++) {
+      PngReadClosure &item = items[i];
+      if (item.status == ES_INVALID_FORMAT && !item.data) {
+        Nan::Set(results, i, Nan::TypeError("Invalid arguments"));
+      } else if (item.status != ES_SUCCESS) {
+        Nan::Set(results, i, Nan::Error(imageErrorMessage(item.status)));
+      } else {
+        Local<Object> result = Nan::New<Object>();
+        Nan::Set(result, Nan::New("data").ToLocalChecked(), NewPixelData(&item));
+        Nan::Set(result, Nan::New("width").ToLocalChecked(), Nan::New<v8::Uint32>(item.width));
+        Nan::Set(result, Nan::New("height").ToLocalChecked(), Nan::New<v8::Uint32>(item.height));
+        Nan::Set(result, Nan::New("format").ToLocalChecked(), Nan::New(fourcc_to_format(item.fourcc)).ToLocalChecked());
+        Nan::Set(results, i, result);
+      }
+    }
+    Local<Value> argv[2] = { Nan::Null(), results };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::unique_ptr<PngReadClosure[]> items;
+};
+
+class EncodeBatchWorker : public PoolBatchWorker {
+ public:
+  EncodeBatchWorker(Nan::Callback *callback, Local<Array> list, AbortFlag abort)
+    : PoolBatchWorker(callback, list->Length()), items(new PngWriteClosure[list->Length()]), errors(list->Length()) {
+    Local<Array> inputs = Nan::New<Array>(nItems);
+    auto width = Nan::New("width").ToLocalChecked();
+    auto height = Nan::New("height").ToLocalChecked();
+    auto data = Nan::New("data").ToLocalChecked();
+    auto options = Nan::New("options").ToLocalChecked();
+    for (uint32_t i = 0; i < nItems; i++) {
+      Local<Value> value = Nan::Get(list, i).ToLocalChecked();
+      if (!value->IsObject()) {
+        errors[i] = "Invalid arguments";
+        continue;
+      }
+      Local<Object> item = value.As<Object>();
+      items[i].abort = abort;
+      Local<Value> pixels = Nan::Get(item, data).ToLocalChecked();
+      Nan::Set(inputs, i, pixels);
+      errors[i] = parseEncodeValues(Nan::Get(item, width).ToLocalChecked(), Nan::Get(item, height).ToLocalChecked(),
+                                    pixels, Nan::Get(item, options).ToLocalChecked(), &items[i]);
+    }
+    SaveToPersistent("inputs", inputs);
+  }
+
+  void ExecuteItem(size_t i) override {
+    if (errors[i]) return;
+    items[i].status = write_png(&items[i]);
+    if (items[i].status != ES_SUCCESS) errors[i] = encodeErrorMessage(items[i].status);
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Array> results = Nan::New<Array>(nItems);
+    for (uint32_t i = 0; i < nItems; i++) {
+      if (errors[i]) {
+        Nan::Set(results, i, items[i].status == ES_SUCCESS ? Nan::TypeError(errors[i]) : Nan::Error(errors[i]));
+      } else {
+        Nan::Set(results, i, NewEncodedBuffer(&items[i]));
+      }
+    }
+    Local<Value> argv[2] = { Nan::Null(), results };
+    callback->Call(2, argv, async_resource);
+  }
+
+ private:
+  std::unique_ptr<PngWriteClosure[]> items;
+  std::vector<const char*> errors;
+};
 
-  Nan::Callback *callback = new Nan::Callback(info[4].As<Function>());
-  Nan::AsyncQueueWorker(new PngEncodeWorker(callback, closure));
+// decodeBatch(buffers, premultiplied, priority, abort, options, cb), any format
+NAN_METHOD(decodeBatch) {
+  if (!info[0]->IsArray() || !info[1]->IsBoolean() || !info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  DecodeShrink shrink;
+  DecodeRegion region;
+  DecodePixelFormat pixelFormat = PIXEL_RGBA;
+  auto error = parseDecodeOptions(info[4], &shrink, &region, &pixelFormat);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  auto worker = new DecodeBatchWorker(callback, info[0].As<Array>(), info[1]->BooleanValue(info.GetIsolate()), AbortToken::flagOf(info[3]), shrink, region, pixelFormat);
+  worker->Queue(parsePriority(info[2]));
 }
 
+// encodeBatch([{ width, height, data, options }], priority, abort, cb)
+NAN_METHOD(encodeBatch) {
+  if (!info[0]->IsArray() || !info[3]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  Nan::Callback *callback = new Nan::Callback(info[3].As<Function>());
+  auto worker = new EncodeBatchWorker(callback, info[0].As<Array>(), AbortToken::flagOf(info[2]));
+  worker->Queue(parsePriority(info[1]));
+}
+
+// decodePNG(buffer, premultiplied, priority, abort, options, cb)
 NAN_METHOD(decodePNG) {
-  if (!node::Buffer::HasInstance(info[0]) ||!info[1]->IsBoolean() || !info[2]->IsFunction()) {
+  if (!node::Buffer::HasInstance(info[0]) ||!info[1]->IsBoolean() || !info[5]->IsFunction()) {
     return Nan::ThrowTypeError("Invalid arguments");
   }
 
   auto closure = new PngReadClosure();
+  auto error = parseDecodeOptions(info[4], &closure->shrink, &closure->region, &closure->pixelFormat);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
   closure->data = (uint8_t*)node::Buffer::Data(info[0]);
   closure->length = (size_t)node::Buffer::Length(info[0]);
   closure->dataRef.Reset(info[0]);
   closure->premultiplied = info[1]->BooleanValue(info.GetIsolate());
-  Nan::Callback *callback = new Nan::Callback(info[2].As<Function>());
-  Nan::AsyncQueueWorker(new PngDecodeWorker(callback, closure));
+  closure->abort = AbortToken::flagOf(info[3]);
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new PngDecodeWorker(callback, closure), parsePriority(info[2]));
+}
+
+// Memory of a Buffer, typed array or (Shared)ArrayBuffer
+static void bufferContents(Local<Value> value, uint8_t **data, size_t *length) {
+  if (value->IsArrayBufferView()) {
+    *data = (uint8_t*)node::Buffer::Data(value);
+    *length = node::Buffer::Length(value);
+  } else if (value->IsArrayBuffer()) {
+    auto store = value.As<ArrayBuffer>()->GetBackingStore();
+    *data = (uint8_t*)store->Data();
+    *length = store->ByteLength();
+  } else {
+    auto store = value.As<SharedArrayBuffer>()->GetBackingStore();
+    *data = (uint8_t*)store->Data();
+    *length = store->ByteLength();
+  }
+}
+
+// decodeInto(src, dest, offset, stride, premultiplied, priority, abort, cb), dest is a Buffer, typed array or (Shared)ArrayBuffer
+NAN_METHOD(decodeInto) {
+  if (!node::Buffer::HasInstance(info[0]) || !(info[1]->IsArrayBufferView() || info[1]->IsArrayBuffer() || info[1]->IsSharedArrayBuffer()) ||
+      !info[2]->IsNumber() || !info[3]->IsNumber() || !info[4]->IsBoolean() || !info[7]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  uint8_t *destData;
+  size_t destLength;
+  bufferContents(info[1], &destData, &destLength);
+
+  double offset = Nan::To<double>(info[2]).FromJust();
+  double stride = Nan::To<double>(info[3]).FromJust();
+  if (offset < 0 || offset > destLength || stride < 0 || stride > destLength) {
+    return Nan::ThrowRangeError("Invalid offset or stride");
+  }
+
+  auto closure = new PngReadClosure();
+  closure->data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure->length = (size_t)node::Buffer::Length(info[0]);
+  closure->dataRef.Reset(info[0]);
+  closure->dest.data = destData + (size_t)offset;
+  closure->dest.length = destLength - (size_t)offset;
+  closure->dest.stride = (size_t)stride;
+  closure->destRef.Reset(info[1]);
+  closure->premultiplied = info[4]->BooleanValue(info.GetIsolate());
+  closure->abort = AbortToken::flagOf(info[6]);
+  Nan::Callback *callback = new Nan::Callback(info[7].As<Function>());
+  QueueCodecWorker(new DecodeIntoWorker(callback, closure), parsePriority(info[5]));
 }
 
+// decodeWebP(buffer, premultiplied, priority, abort, options, cb)
 NAN_METHOD(decodeWebP) {
-  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean() || !info[2]->IsFunction()) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean() || !info[5]->IsFunction()) {
     return Nan::ThrowTypeError("Invalid arguments");
   }
 
   auto closure = new WebpReadClosure();
+  auto error = parseDecodeOptions(info[4], &closure->shrink, &closure->region, &closure->pixelFormat);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
   closure->data = (uint8_t*)node::Buffer::Data(info[0]);
   closure->length = (size_t)node::Buffer::Length(info[0]);
   closure->dataRef.Reset(info[0]);
   closure->premultiplied = info[1]->BooleanValue(info.GetIsolate());
-  Nan::Callback *callback = new Nan::Callback(info[2].As<Function>());
-  Nan::AsyncQueueWorker(new WebpDecodeWorker(callback, closure));
+  closure->abort = AbortToken::flagOf(info[3]);
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new WebpDecodeWorker(callback, closure), parsePriority(info[2]));
+}
+
+// decodeImage(buffer, premultiplied, priority, abort, options, cb), the format is sniffed from the data
+NAN_METHOD(decodeImage) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean() || !info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto closure = new PngReadClosure();
+  auto error = parseDecodeOptions(info[4], &closure->shrink, &closure->region, &closure->pixelFormat);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure->data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure->length = (size_t)node::Buffer::Length(info[0]);
+  closure->dataRef.Reset(info[0]);
+  closure->premultiplied = info[1]->BooleanValue(info.GetIsolate());
+  closure->abort = AbortToken::flagOf(info[3]);
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new ImageDecodeWorker(callback, closure), parsePriority(info[2]));
+}
+
+static Local<Object> NewDecodeResult(PngReadClosure *closure) {
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("data").ToLocalChecked(), NewPixelData(closure));
+  Nan::Set(result, Nan::New("width").ToLocalChecked(), Nan::New<v8::Uint32>(closure->width));
+  Nan::Set(result, Nan::New("height").ToLocalChecked(), Nan::New<v8::Uint32>(closure->height));
+  return result;
+}
+
+// decodePNGSync(buffer, premultiplied, options)
+NAN_METHOD(decodePNGSync) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  PngReadClosure closure;
+  auto error = parseDecodeOptions(info[2], &closure.shrink, &closure.region, &closure.pixelFormat);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure.length = (size_t)node::Buffer::Length(info[0]);
+  closure.premultiplied = info[1]->BooleanValue(info.GetIsolate());
+
+  closure.status = read_png(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError(decodeErrorMessage(closure.status, "PNG decoding failed."));
+  }
+
+  info.GetReturnValue().Set(NewDecodeResult(&closure));
+}
+
+// decodeWebPSync(buffer, premultiplied, options)
+NAN_METHOD(decodeWebPSync) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  WebpReadClosure closure;
+  auto error = parseDecodeOptions(info[2], &closure.shrink, &closure.region, &closure.pixelFormat);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure.length = (size_t)node::Buffer::Length(info[0]);
+  closure.premultiplied = info[1]->BooleanValue(info.GetIsolate());
+
+  closure.status = read_webp(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError(decodeErrorMessage(closure.status, "WebP decoding failed."));
+  }
+
+  info.GetReturnValue().Set(NewDecodeResult(&closure));
+}
+
+// decodeImageSync(buffer, premultiplied, options)
+NAN_METHOD(decodeImageSync) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  PngReadClosure closure;
+  auto error = parseDecodeOptions(info[2], &closure.shrink, &closure.region, &closure.pixelFormat);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure.length = (size_t)node::Buffer::Length(info[0]);
+  closure.premultiplied = info[1]->BooleanValue(info.GetIsolate());
+
+  closure.status = read_image(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError(imageErrorMessage(closure.status));
+  }
+
+  Local<Object> result = NewDecodeResult(&closure);
+  Nan::Set(result, Nan::New("format").ToLocalChecked(), Nan::New(fourcc_to_format(closure.fourcc)).ToLocalChecked());
+  info.GetReturnValue().Set(result);
+}
+
+// QOI
+
+class QoiEncodeWorker : public Nan::AsyncWorker {
+ public:
+  QoiEncodeWorker(Nan::Callback *callback, QoiWriteClosure* closure)
+    : Nan::AsyncWorker(callback), closure(closure) {}
+
+  ~QoiEncodeWorker() {
+    closure->dataRef.Reset();
+    free(closure->output);
+    delete closure;
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    closure->status = write_qoi(closure);
+    if (closure->status != 0) {
+      SetErrorMessage("QOI encoding failed.");
+    }
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Object> buf = NewBuffer((char*)closure->output, closure->outputLength, [] (char *data, void* hint) {
+      free(data);
+    }, nullptr).ToLocalChecked();
+    closure->output = nullptr;
+    Local<Value> argv[2] = { Nan::Null(), buf };
+    callback->Call(2, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  QoiWriteClosure* closure;
+};
+
+// (width, height, data), returns an error message on invalid input
+static const char *parseQoiArgs(Nan::NAN_METHOD_ARGS_TYPE info, QoiWriteClosure *closure) {
+  if (!info[0]->IsNumber() || !info[1]->IsNumber() || !node::Buffer::HasInstance(info[2])) {
+    return "Invalid arguments";
+  }
+
+  closure->width = Nan::To<uint32_t>(info[0]).FromMaybe(0);
+  closure->height = Nan::To<uint32_t>(info[1]).FromMaybe(0);
+  if (node::Buffer::Length(info[2]) != (size_t)closure->width * closure->height * 4) {
+    return "Invalid buffer size";
+  }
+  if (closure->width == 0 || closure->height == 0 || (uint64_t)closure->width * closure->height > QOI_PIXELS_MAX) {
+    return "QOI images must have between 1 and 400 million pixels.";
+  }
+
+  closure->data = (uint8_t*)node::Buffer::Data(info[2]);
+  return nullptr;
+}
+
+// encodeQOI(width, height, data, options, abort, cb)
+NAN_METHOD(encodeQOI) {
+  if (!info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto closure = new QoiWriteClosure();
+  auto error = parseQoiArgs(info, closure);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure->dataRef.Reset(info[2]);
+  closure->abort = AbortToken::flagOf(info[4]);
+
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new QoiEncodeWorker(callback, closure), optionsPriority(info[3]));
+}
+
+NAN_METHOD(encodeQOISync) {
+  QoiWriteClosure closure;
+  auto error = parseQoiArgs(info, &closure);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.status = write_qoi(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError("QOI encoding failed.");
+  }
+
+  info.GetReturnValue().Set(NewBuffer((char*)closure.output, closure.outputLength, [] (char *data, void* hint) {
+    free(data);
+  }, nullptr).ToLocalChecked());
+}
+
+class QoiDecodeWorker : public Nan::AsyncWorker {
+ public:
+  QoiDecodeWorker(Nan::Callback *callback, PngReadClosure* closure)
+    : Nan::AsyncWorker(callback), closure(closure) {}
+
+  ~QoiDecodeWorker() {
+    closure->cb.Reset();
+    closure->dataRef.Reset();
+    delete closure;
+    delete callback;
+  }
+
+  // Executed inside the worker-thread.
+  void Execute() override {
+    closure->status = read_qoi(closure);
+    if (closure->status != 0) {
+      SetErrorMessage(decodeErrorMessage(closure->status, "QOI decoding failed."));
+    }
+  }
+
+  void HandleOKCallback() override {
+    Nan::HandleScope scope;
+
+    Local<Object> buf = NewPixelData(closure);
+    Local<Value> argv[4] = { Nan::Null(), buf, Nan::New<v8::Int32>(closure->width), Nan::New<v8::Int32>(closure->height) };
+    callback->Call(4, argv, async_resource);
+  }
+
+  void HandleErrorCallback() override {
+    Nan::HandleScope scope;
+    Local<Value> argv[1] = { Nan::Error(ErrorMessage()) };
+    callback->Call(1, argv, async_resource);
+  }
+
+ private:
+  PngReadClosure* closure;
+};
+
+// decodeQOI(buffer, premultiplied, priority, abort, options, cb)
+NAN_METHOD(decodeQOI) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean() || !info[5]->IsFunction()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  auto closure = new PngReadClosure();
+  auto error = parseDecodeOptions(info[4], &closure->shrink, &closure->region, &closure->pixelFormat);
+  if (error) {
+    delete closure;
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure->data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure->length = (size_t)node::Buffer::Length(info[0]);
+  closure->dataRef.Reset(info[0]);
+  closure->premultiplied = info[1]->BooleanValue(info.GetIsolate());
+  closure->abort = AbortToken::flagOf(info[3]);
+  Nan::Callback *callback = new Nan::Callback(info[5].As<Function>());
+  QueueCodecWorker(new QoiDecodeWorker(callback, closure), parsePriority(info[2]));
+}
+
+// decodeQOISync(buffer, premultiplied, options)
+NAN_METHOD(decodeQOISync) {
+  if (!node::Buffer::HasInstance(info[0]) || !info[1]->IsBoolean()) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  PngReadClosure closure;
+  auto error = parseDecodeOptions(info[2], &closure.shrink, &closure.region, &closure.pixelFormat);
+  if (error) {
+    return Nan::ThrowTypeError(error);
+  }
+
+  closure.data = (uint8_t*)node::Buffer::Data(info[0]);
+  closure.length = (size_t)node::Buffer::Length(info[0]);
+  closure.premultiplied = info[1]->BooleanValue(info.GetIsolate());
+
+  closure.status = read_qoi(&closure);
+  if (closure.status != 0) {
+    return Nan::ThrowError(decodeErrorMessage(closure.status, "QOI decoding failed."));
+  }
+
+  info.GetReturnValue().Set(NewDecodeResult(&closure));
+}
+
+// pixel conversions, in place on the calling thread
+
+// 32bpp pixels of a Buffer, typed array or (Shared)ArrayBuffer
+static bool pixelsArg(Local<Value> value, uint8_t **data, size_t *nPixels) {
+  if (!(value->IsArrayBufferView() || value->IsArrayBuffer() || value->IsSharedArrayBuffer())) return false;
+  size_t length;
+  bufferContents(value, data, &length);
+  *nPixels = length / 4;
+  return length % 4 == 0;
+}
+
+// premultiply(data)
+NAN_METHOD(premultiply) {
+  uint8_t *data;
+  size_t nPixels;
+  if (!pixelsArg(info[0], &data, &nPixels)) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+  fpng::fpng_premultiply(data, data, nPixels);
+}
+
+// unpremultiply(data)
+NAN_METHOD(unpremultiply) {
+  uint8_t *data;
+  size_t nPixels;
+  if (!pixelsArg(info[0], &data, &nPixels)) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+  fpng::fpng_unpremultiply(data, data, nPixels);
+}
+
+// swizzle(data, order), channel c of each pixel becomes channel order[c]
+NAN_METHOD(swizzle) {
+  uint8_t *data;
+  size_t nPixels;
+  if (!pixelsArg(info[0], &data, &nPixels) || !info[1]->IsArray() || info[1].As<Array>()->Length() != 4) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  uint8_t order[4];
+  unsigned seen = 0;
+  for (uint32_t c = 0; c < 4; c++) {
+    Local<Value> index = Nan::Get(info[1].As<Array>(), c).ToLocalChecked();
+    if (!index->IsUint32() || Nan::To<uint32_t>(index).FromJust() > 3) {
+      return Nan::ThrowTypeError("Invalid arguments");
+    }
+    order[c] = (uint8_t)Nan::To<uint32_t>(index).FromJust();
+    seen |= 1u << order[c];
+  }
+  if (seen != 0xF) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+  fpng::fpng_swizzle(data, data, nPixels, order);
+}
+
+// How many PNG decodes took the fpng fast path, and how many went through wuffs
+NAN_METHOD(getDecodeStats) {
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("fpng").ToLocalChecked(), Nan::New<v8::Number>((double)fpng_decode_count.load()));
+  Nan::Set(result, Nan::New("wuffs").ToLocalChecked(), Nan::New<v8::Number>((double)wuffs_decode_count.load()));
+  info.GetReturnValue().Set(result);
+}
+
+// Encoder memory: bytes newly allocated (scratch growth and outputs) vs. scratch bytes served by the per-thread arenas
+NAN_METHOD(getBufferStats) {
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("allocated").ToLocalChecked(), Nan::New<v8::Number>((double)bytes_allocated.load()));
+  Nan::Set(result, Nan::New("reused").ToLocalChecked(), Nan::New<v8::Number>((double)bytes_reused.load()));
+  info.GetReturnValue().Set(result);
+}
+
+NAN_METHOD(setConcurrency) {
+  if (!info[0]->IsUint32() || Nan::To<uint32_t>(info[0]).FromJust() == 0) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+  codec_pool().setConcurrency(Nan::To<uint32_t>(info[0]).FromJust());
+}
+
+static Local<Object> NewPoolStats(CodecPriority priority) {
+  CodecPoolStats stats = codec_pool().getStats(priority);
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("queued").ToLocalChecked(), Nan::New<v8::Uint32>(stats.queued));
+  Nan::Set(result, Nan::New("active").ToLocalChecked(), Nan::New<v8::Uint32>(stats.active));
+  Nan::Set(result, Nan::New("completed").ToLocalChecked(), Nan::New<v8::Number>((double)stats.completed));
+  Nan::Set(result, Nan::New("waitTime").ToLocalChecked(), Nan::New<v8::Number>(stats.waitTime));
+  Nan::Set(result, Nan::New("runTime").ToLocalChecked(), Nan::New<v8::Number>(stats.runTime));
+  Nan::Set(result, Nan::New("maxWaitTime").ToLocalChecked(), Nan::New<v8::Number>(stats.maxWaitTime));
+  return result;
+}
+
+NAN_METHOD(getPoolStats) {
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("concurrency").ToLocalChecked(), Nan::New<v8::Uint32>(codec_pool().concurrency()));
+  Nan::Set(result, Nan::New("interactive").ToLocalChecked(), NewPoolStats(PRIORITY_INTERACTIVE));
+  Nan::Set(result, Nan::New("background").ToLocalChecked(), NewPoolStats(PRIORITY_BACKGROUND));
+  info.GetReturnValue().Set(result);
+}
+
+// Reads the image header only, no pixels are decoded or allocated
+NAN_METHOD(probe) {
+  if (!node::Buffer::HasInstance(info[0])) {
+    return Nan::ThrowTypeError("Invalid arguments");
+  }
+
+  ImageInfo image;
+  auto status = probe_image((uint8_t*)node::Buffer::Data(info[0]), (size_t)node::Buffer::Length(info[0]), &image);
+  if (status == ES_INVALID_SIGNATURE) {
+    return Nan::ThrowError("Unsupported image format");
+  } else if (status != ES_SUCCESS) {
+    return Nan::ThrowError("Invalid image header.");
+  }
+
+  Local<Object> result = Nan::New<Object>();
+  Nan::Set(result, Nan::New("format").ToLocalChecked(), Nan::New(fourcc_to_format(image.fourcc)).ToLocalChecked());
+  Nan::Set(result, Nan::New("width").ToLocalChecked(), Nan::New<v8::Uint32>(image.width));
+  Nan::Set(result, Nan::New("height").ToLocalChecked(), Nan::New<v8::Uint32>(image.height));
+  Nan::Set(result, Nan::New("hasAlpha").ToLocalChecked(), Nan::New<v8::Boolean>(image.hasAlpha));
+  Nan::Set(result, Nan::New("bitDepth").ToLocalChecked(), Nan::New<v8::Uint32>(image.bitDepth));
+  Nan::Set(result, Nan::New("interlaced").ToLocalChecked(), Nan::New<v8::Boolean>(image.interlaced));
+  Nan::Set(result, Nan::New("frames").ToLocalChecked(), Nan::New<v8::Uint32>(image.frames));
+  Nan::Set(result, Nan::New("fpng").ToLocalChecked(), Nan::New<v8::Boolean>(image.fpng));
+  info.GetReturnValue().Set(result);
 }
 
 void Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
   Nan::HandleScope scope;
   auto ctx = Nan::GetCurrentContext();
+  addon_init(ctx->GetIsolate());
 
   Nan::Set(target, Nan::New("encodePNG").ToLocalChecked(), Nan::New<FunctionTemplate>(encodePNG)->GetFunction(ctx).ToLocalChecked());
   Nan::Set(target, Nan::New("decodePNG").ToLocalChecked(), Nan::New<FunctionTemplate>(decodePNG)->GetFunction(ctx).ToLocalChecked());
   Nan::Set(target, Nan::New("decodeWebP").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeWebP)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeImage").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeImage)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeInto").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeInto)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeBatch").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeBatch)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodeBatch").ToLocalChecked(), Nan::New<FunctionTemplate>(encodeBatch)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodePNGSync").ToLocalChecked(), Nan::New<FunctionTemplate>(encodePNGSync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodeWebPLossless").ToLocalChecked(), Nan::New<FunctionTemplate>(encodeWebPLossless)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodeWebPLosslessSync").ToLocalChecked(), Nan::New<FunctionTemplate>(encodeWebPLosslessSync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodeQOI").ToLocalChecked(), Nan::New<FunctionTemplate>(encodeQOI)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("encodeQOISync").ToLocalChecked(), Nan::New<FunctionTemplate>(encodeQOISync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeQOI").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeQOI)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeQOISync").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeQOISync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodePNGSync").ToLocalChecked(), Nan::New<FunctionTemplate>(decodePNGSync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeWebPSync").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeWebPSync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("decodeImageSync").ToLocalChecked(), Nan::New<FunctionTemplate>(decodeImageSync)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("probe").ToLocalChecked(), Nan::New<FunctionTemplate>(probe)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("getDecodeStats").ToLocalChecked(), Nan::New<FunctionTemplate>(getDecodeStats)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("getBufferStats").ToLocalChecked(), Nan::New<FunctionTemplate>(getBufferStats)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("setConcurrency").ToLocalChecked(), Nan::New<FunctionTemplate>(setConcurrency)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("getPoolStats").ToLocalChecked(), Nan::New<FunctionTemplate>(getPoolStats)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("premultiply").ToLocalChecked(), Nan::New<FunctionTemplate>(premultiply)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("unpremultiply").ToLocalChecked(), Nan::New<FunctionTemplate>(unpremultiply)->GetFunction(ctx).ToLocalChecked());
+  Nan::Set(target, Nan::New("swizzle").ToLocalChecked(), Nan::New<FunctionTemplate>(swizzle)->GetFunction(ctx).ToLocalChecked());
+
+  AbortToken::Init(target);
+  PngDecoderStream::Init(target);
+  ImageAnimation::Init(target);
+  PngEncoderStream::Init(target);
 
   Nan::Set(target, Nan::New("PNG_NO_FILTERS").ToLocalChecked(), Nan::New<Uint32>(PNG_NO_FILTERS));
   Nan::Set(target, Nan::New("PNG_FILTER_NONE").ToLocalChecked(), Nan::New<Uint32>(PNG_FILTER_NONE));
@@ -264,11 +1857,14 @@ void Initialize(Nan::ADDON_REGISTER_FUNCTION_ARGS_TYPE target) {
   Nan::Set(target, Nan::New("PNG_FILTER_PAETH").ToLocalChecked(), Nan::New<Uint32>(PNG_FILTER_PAETH));
   Nan::Set(target, Nan::New("PNG_ALL_FILTERS").ToLocalChecked(), Nan::New<Uint32>(PNG_ALL_FILTERS));
 
-  fpng::fpng_init();
+  // process wide, workers loading the addon later must not rewrite it under running jobs
+  static std::once_flag fpng_once;
+  std::call_once(fpng_once, fpng::fpng_init);
 }
 
 NAN_MODULE_INIT(init) {
   Initialize(target);
 }
 
-NODE_MODULE(ag_images, init);
+// Context aware, so every worker_threads Worker can load it as well
+NAN_MODULE_WORKER_ENABLED(ag_images, init)
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <cmath> // round
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <png.h>
 #include <pngconf.h>
 #include <nan.h>
@@ -34,6 +37,7 @@
 #define WUFFS_CONFIG__MODULE__NETPBM
 #define WUFFS_CONFIG__MODULE__NIE
 #define WUFFS_CONFIG__MODULE__PNG
+#define WUFFS_CONFIG__MODULE__QOI
 #define WUFFS_CONFIG__MODULE__TARGA
 #define WUFFS_CONFIG__MODULE__VP8
 #define WUFFS_CONFIG__MODULE__WBMP
@@ -49,6 +53,10 @@ enum error_status {
   ES_FAILED,
   ES_READING_PAST_END,
   ES_INVALID_FORMAT,
+  ES_COLOR_NOT_IN_PALETTE,
+  ES_DEST_TOO_SMALL,
+  ES_ABORTED,
+  ES_INVALID_REGION,
 };
 
 static const char* error_status_to_string(error_status status) {
@@ -60,19 +68,39 @@ static const char* error_status_to_string(error_status status) {
     case ES_FAILED: return "failed";
     case ES_READING_PAST_END: return "reading past end";
     case ES_INVALID_FORMAT: return "invalid format";
+    case ES_COLOR_NOT_IN_PALETTE: return "color not in palette";
+    case ES_DEST_TOO_SMALL: return "destination too small";
+    case ES_ABORTED: return "aborted";
+    case ES_INVALID_REGION: return "region outside image";
     default: return "invalid";
   }
 }
 
+// Set from the JS thread when the caller's AbortSignal fires. The codecs poll it between row bands and
+// input slices, a null flag means the job can't be aborted.
+typedef std::shared_ptr<std::atomic<bool>> AbortFlag;
+
+static inline bool aborted(const AbortFlag &abort) {
+  return abort && abort->load(std::memory_order_relaxed);
+}
+
 // writing
 
 struct PngWriteClosure {
   int32_t compressionLevel = 6;
   uint32_t filters = PNG_ALL_FILTERS;
   uint32_t resolution = 0; // 0 = unspecified
+  uint32_t threads = 1; // fpng only, 0 = one per hardware thread
+  bool optimizeColorType = false; // write RGB/gray/gray+alpha/indexed when that's lossless
+  // inputFormat: the pixels are BGRA and/or premultiplied, the encoders convert them to straight RGBA as they go
+  bool inputBGRA = false;
+  bool inputPremultiplied = false;
+  // 16 bit inputFormats (rgba16, rgb16, gray16): samples in host byte order, written as 16 bit PNGs by libpng
+  bool input16 = false;
+  uint32_t inputChannels = 4;
   // Indexed PNGs:
   uint32_t nPaletteColors = 0;
-  uint8_t* palette = nullptr;
+  std::vector<uint8_t> palette; // RGBA, copied so it outlives the JS array during async encodes
   uint8_t backgroundIndex = 0;
 
   Nan::Callback cb;
@@ -80,8 +108,10 @@ struct PngWriteClosure {
   uint32_t width;
   uint32_t height;
   uint8_t *data;
+  size_t stride = 0; // bytes from one row of data to the next, 0 = width * 4
   Nan::Persistent<v8::Value> dataRef;
   error_status status = ES_SUCCESS;
+  AbortFlag abort;
 
   // output for fpng (quality <= 0)
   std::unique_ptr<std::vector<uint8_t>> outputVector = 0;
@@ -90,11 +120,21 @@ struct PngWriteClosure {
   uint8_t *output = 0;
   size_t outputLength = 0;
   size_t outputCapacity = 0;
+  size_t outputSizeHint = 0; // first allocation of the libpng output, at least INITIAL_SIZE
 };
 
 static void flush_func(png_structp) {
 }
 
+// Called by libpng after each row, jumps to write_png's setjmp once the job is aborted
+static void write_row_func(png_structp png, png_uint_32, int) {
+  PngWriteClosure *closure = (PngWriteClosure *) png_get_io_ptr(png);
+  if (aborted(closure->abort)) {
+    closure->status = ES_ABORTED;
+    png_longjmp(png, 1); // png_error would print the abort to stderr
+  }
+}
+
 #ifdef PNG_SETJMP_SUPPORTED
 bool setjmp_wrapper(png_structp png) {
   return setjmp(png_jmpbuf(png));
@@ -103,12 +143,64 @@ bool setjmp_wrapper(png_structp png) {
 
 #define INITIAL_SIZE 4096
 
+// Bigger scratch buffers are released after the call rather than kept by the thread
+#define ARENA_MAX_RETAINED (16 * 1024 * 1024)
+
+// Layout of the decoded pixels, decode option pixelFormat
+enum DecodePixelFormat {
+  PIXEL_RGBA = 0,
+  PIXEL_BGRA,
+  PIXEL_RGB, // without alpha the colors are premultiplied, i.e. composited over black
+  PIXEL_GRAY, // luma with the JFIF weights, of the premultiplied color like RGB
+  PIXEL_GRAYA,
+  PIXEL_RGBA16, // 16 bits per channel in host byte order, what a Uint16Array over the pixels reads
+  PIXEL_RGBA16BE, // 16 bits per channel, most significant byte first like in the PNG file
+};
+
+static inline size_t pixel_size(DecodePixelFormat format) {
+  switch (format) {
+    case PIXEL_RGB: return 3;
+    case PIXEL_GRAY: return 1;
+    case PIXEL_GRAYA: return 2;
+    case PIXEL_RGBA16: case PIXEL_RGBA16BE: return 8;
+    default: return 4;
+  }
+}
+
+static inline bool is_16bit(DecodePixelFormat format) {
+  return format == PIXEL_RGBA16 || format == PIXEL_RGBA16BE;
+}
+
+// Caller owned memory to decode into (decodeInto), instead of a fresh allocation
+struct DecodeDestination {
+  uint8_t *data = nullptr;
+  size_t length = 0;
+  size_t stride = 0; // bytes per row, 0 = width * 4
+
+  size_t rowStride(uint32_t width) const {
+    return stride ? stride : (size_t)width * 4;
+  }
+
+  bool fits(uint32_t width, uint32_t height) const {
+    size_t rowBytes = (size_t)width * 4;
+    return rowStride(width) >= rowBytes && (height == 0 || (height - 1) * rowStride(width) + rowBytes <= length);
+  }
+};
+
+// Wuffs' work buffer (the inflated, still filtered rows for PNG) is about as large as the image. Keep it per thread,
+// like the encoder's arena, so runs of small decodes on the same thread don't allocate one each time.
+static thread_local std::vector<uint8_t> decode_workbuf;
+
 class MyDecodeCallbacks : public wuffs_aux::DecodeImageCallbacks {
  public:
-  MyDecodeCallbacks(bool _premultiplied) : m_fourcc(0), premultipled(_premultiplied) {}
+  // pixfmt: WUFFS_BASE__PIXEL_FORMAT__*, see wuffs_pixel_format()
+  MyDecodeCallbacks(uint32_t _pixfmt, const DecodeDestination *_dest = nullptr)
+    : m_fourcc(0), pixfmt(_pixfmt), dest(_dest) {}
 
   uint32_t m_fourcc;
-  bool premultipled;
+  uint32_t pixfmt;
+  const DecodeDestination *dest;
+  bool destTooSmall = false;
 
  private:
   wuffs_base__image_decoder::unique_ptr  //
@@ -131,31 +223,164 @@ class MyDecodeCallbacks : public wuffs_aux::DecodeImageCallbacks {
 
   wuffs_base__pixel_format  //
   SelectPixfmt(const wuffs_base__image_config& image_config) override {
-    auto format = this->premultipled ? WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL :
-      WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL;
+    return wuffs_base__make_pixel_format(pixfmt);
+  }
 
-    return wuffs_base__make_pixel_format(format);
+  AllocWorkbufResult  //
+  AllocWorkbuf(wuffs_base__range_ii_u64 len_range,
+               bool allow_uninitialized_memory) override {
+    uint64_t len = len_range.max_incl;
+    if (len > ARENA_MAX_RETAINED) {
+      return wuffs_aux::DecodeImageCallbacks::AllocWorkbuf(len_range, allow_uninitialized_memory);
+    }
+    decode_workbuf.resize((size_t)len);
+    if (!allow_uninitialized_memory) {
+      memset(decode_workbuf.data(), 0, (size_t)len);
+    }
+    return AllocWorkbufResult(wuffs_aux::MemOwner(nullptr, &free),
+                              wuffs_base__make_slice_u8(decode_workbuf.data(), (size_t)len));
   }
 
   AllocPixbufResult  //
   AllocPixbuf(const wuffs_base__image_config& image_config,
               bool allow_uninitialized_memory) override {
-    return wuffs_aux::DecodeImageCallbacks::AllocPixbuf(
-        image_config, allow_uninitialized_memory);
+    if (!dest) {
+      return wuffs_aux::DecodeImageCallbacks::AllocPixbuf(
+          image_config, allow_uninitialized_memory);
+    }
+
+    // Point wuffs at the caller's memory, checked here so nothing is decoded into a short buffer
+    uint32_t w = image_config.pixcfg.width();
+    uint32_t h = image_config.pixcfg.height();
+    if (!dest->fits(w, h)) {
+      destTooSmall = true;
+      return AllocPixbufResult("destination too small");
+    }
+    size_t stride = dest->rowStride(w);
+    if (!allow_uninitialized_memory) {
+      for (uint32_t y = 0; y < h; y++) {
+        memset(dest->data + y * stride, 0, (size_t)w * 4);
+      }
+    }
+
+    wuffs_base__pixel_buffer pixbuf;
+    wuffs_base__status status = pixbuf.set_interleaved(
+        &image_config.pixcfg,
+        wuffs_base__make_table_u8(dest->data, (size_t)w * 4, h, stride),
+        wuffs_base__empty_slice_u8());
+    if (!status.is_ok()) {
+      return AllocPixbufResult(status.message());
+    }
+    return AllocPixbufResult(wuffs_aux::MemOwner(nullptr, &free), pixbuf);
   }
 };
 
+// Scratch memory reused by consecutive encodes on the same thread, libuv runs them on a small fixed pool.
+// The encoded output is handed over to a JS Buffer, so only the per call temporaries can live here.
+struct EncodeArena {
+  std::vector<uint8_t> pixels; // converted input: RGB for fpng, gray or palette indices for libpng
+  std::vector<uint8_t> rgba; // straight RGBA from another inputFormat, when libpng has to look at all pixels first
+  std::vector<uint8_t> filtered; // fpng's filtered scanlines
+
+  // previous libpng encode on this thread, to guess the output size of the next one
+  size_t lastPixels = 0;
+  size_t lastOutputSize = 0;
+};
+
+static thread_local EncodeArena encode_arena;
+
+// Totals over all threads, see getBufferStats()
+static std::atomic<uint64_t> bytes_allocated(0);
+static std::atomic<uint64_t> bytes_reused(0);
+
+// Call after sizing an arena buffer: either it fit in the capacity it already had or it was reallocated
+static void arena_count(const std::vector<uint8_t> &buf, size_t capacityBefore) {
+  if (buf.capacity() > capacityBefore) {
+    bytes_allocated += buf.capacity();
+  } else {
+    bytes_reused += buf.size();
+  }
+}
+
+static void arena_trim(std::vector<uint8_t> &buf) {
+  if (buf.capacity() > ARENA_MAX_RETAINED) {
+    std::vector<uint8_t>().swap(buf);
+  }
+}
+
+// Starting size for the libpng output: scaled from the previous encode on this thread when the image is about as big,
+// otherwise a 4:1 compression ratio. Too much is given back by the realloc at the end, too little costs a few more reallocs.
+static size_t output_size_hint(size_t nPixels) {
+  const EncodeArena &arena = encode_arena;
+  if (arena.lastPixels > 0 && nPixels <= arena.lastPixels * 2 && nPixels * 2 >= arena.lastPixels) {
+    return (size_t)((double)arena.lastOutputSize * nPixels / arena.lastPixels * 1.125);
+  }
+  return nPixels;
+}
+
+static inline bool converts_input(const PngWriteClosure *closure) {
+  return closure->inputBGRA || closure->inputPremultiplied;
+}
+
+// Bytes per pixel of the caller's data
+static inline size_t input_pixel_size(const PngWriteClosure *closure) {
+  return closure->input16 ? closure->inputChannels * 2 : 4;
+}
+
+// PNG color type that holds the input as is
+static int input_color_type(const PngWriteClosure *closure) {
+  if (closure->nPaletteColors > 0) return PNG_COLOR_TYPE_PALETTE;
+  if (closure->inputChannels == 3) return PNG_COLOR_TYPE_RGB;
+  if (closure->inputChannels == 1) return PNG_COLOR_TYPE_GRAY;
+  return PNG_COLOR_TYPE_RGB_ALPHA;
+}
+
+static inline bool host_is_little_endian() {
+  uint16_t one = 1;
+  uint8_t first;
+  memcpy(&first, &one, 1);
+  return first == 1;
+}
+
+// inputFormat pixels to straight RGBA, src and dst may be the same
+static void input_to_rgba(const PngWriteClosure *closure, const uint8_t *src, uint8_t *dst, size_t nPixels) {
+  static const uint8_t bgra_order[4] = { 2, 1, 0, 3 };
+  if (closure->inputBGRA) {
+    fpng::fpng_swizzle(src, dst, nPixels, bgra_order);
+    src = dst;
+  }
+  if (closure->inputPremultiplied) {
+    fpng::fpng_unpremultiply(src, dst, nPixels);
+  } else if (src != dst) {
+    memcpy(dst, src, nPixels * 4);
+  }
+}
+
+// libpng user transform, converts libpng's copy of each row just before it's filtered
+static void input_transform_func(png_structp png, png_row_infop row_info, png_bytep data) {
+  input_to_rgba((PngWriteClosure *) png_get_io_ptr(png), data, data, row_info->width);
+}
+
 static void write_func(png_structp png, png_bytep data, png_size_t size) {
   PngWriteClosure *closure = (PngWriteClosure *) png_get_io_ptr(png);
 
   if (!closure->output) {
-    closure->output = (uint8_t*)malloc(INITIAL_SIZE);
-    closure->outputCapacity = INITIAL_SIZE;
+    closure->outputCapacity = std::max((size_t)INITIAL_SIZE, closure->outputSizeHint);
+    closure->output = (uint8_t*)malloc(closure->outputCapacity);
+    bytes_allocated += closure->outputCapacity;
   }
 
-  while ((closure->outputCapacity - closure->outputLength) < size) {
-    closure->output = (uint8_t*)realloc(closure->output, closure->outputCapacity * 2);
-    closure->outputCapacity = closure->outputCapacity * 2;
+  if (closure->output && (closure->outputCapacity - closure->outputLength) < size) {
+    size_t capacity = std::max(closure->outputCapacity * 2, closure->outputLength + size);
+    uint8_t *output = (uint8_t*)realloc(closure->output, capacity);
+    if (output) {
+      closure->output = output;
+      closure->outputCapacity = capacity;
+      bytes_allocated += capacity;
+    } else {
+      free(closure->output);
+      closure->output = nullptr;
+    }
   }
 
   if (closure->output) {
@@ -167,6 +392,253 @@ static void write_func(png_structp png, png_bytep data, png_size_t size) {
   }
 }
 
+// Exact-match RGBA -> palette index lookup, open addressing on the packed pixel value.
+class PaletteLookup {
+ public:
+  PaletteLookup() {
+    memset(indices, 0xFF, sizeof(indices));
+  }
+
+  PaletteLookup(const uint8_t *palette, uint32_t nColors) : PaletteLookup() {
+    for (uint32_t i = 0; i < nColors; i++) {
+      uint32_t color;
+      memcpy(&color, palette + i * 4, 4);
+      add(color, i);
+    }
+  }
+
+  // At most 256 colors, the first index wins for duplicate colors
+  void add(uint32_t color, uint32_t index) {
+    uint32_t slot = hash(color);
+    while (indices[slot] >= 0 && colors[slot] != color) slot = (slot + 1) & (SIZE - 1);
+    if (indices[slot] < 0) {
+      colors[slot] = color;
+      indices[slot] = (int16_t)index;
+    }
+  }
+
+  // Returns -1 for colors that aren't in the palette
+  int find(uint32_t color) const {
+    uint32_t slot = hash(color);
+    while (indices[slot] >= 0) {
+      if (colors[slot] == color) return indices[slot];
+      slot = (slot + 1) & (SIZE - 1);
+    }
+    return -1;
+  }
+
+ private:
+  static const uint32_t SIZE = 1024; // 4x the largest palette keeps probe sequences short
+
+  static uint32_t hash(uint32_t color) {
+    return (color * 0x9E3779B1u) >> 22;
+  }
+
+  uint32_t colors[SIZE];
+  int16_t indices[SIZE];
+};
+
+// Converts the RGBA pixels to one palette index per byte, libpng packs them down to the IHDR bit depth
+static error_status map_to_palette(const PaletteLookup &lookup, const uint8_t *src, size_t nPixels, uint8_t *out) {
+  // Indexed images are mostly runs, so only look up when the color changes
+  uint32_t prevColor;
+  memcpy(&prevColor, src, 4);
+  int prevIndex = lookup.find(prevColor);
+  for (size_t i = 0; i < nPixels; i++) {
+    uint32_t color;
+    memcpy(&color, src + i * 4, 4);
+    if (color != prevColor) {
+      prevColor = color;
+      prevIndex = lookup.find(color);
+    }
+    if (prevIndex < 0) return ES_COLOR_NOT_IN_PALETTE;
+    out[i] = (uint8_t)prevIndex;
+  }
+  return ES_SUCCESS;
+}
+
+static error_status map_to_palette(PngWriteClosure *closure, const uint8_t *src, size_t stride, uint8_t *out) {
+  PaletteLookup lookup(closure->palette.data(), closure->nPaletteColors);
+  for (uint32_t y = 0; y < closure->height; y++) {
+    error_status status = map_to_palette(lookup, src + y * stride, closure->width, out + (size_t)y * closure->width);
+    if (status != ES_SUCCESS) return status;
+  }
+  return ES_SUCCESS;
+}
+
+struct ColorAnalysis {
+  bool opaque = true;
+  bool gray = true;
+  uint32_t nColors = 0; // distinct colors, 0 when there are more than 256 (or they weren't counted)
+  uint8_t palette[256 * 4];
+};
+
+// One pass over the pixels, in cache sized blocks: the opaque/gray checks are a branch free reduction
+// the compiler vectorizes, the distinct colors are counted with a PaletteLookup until there are more than 256.
+// Rows are stride bytes apart.
+static void analyze_colors(const uint8_t *data, uint32_t width, uint32_t height, size_t stride, bool countColors, ColorAnalysis *result) {
+  const size_t BLOCK_SIZE = 4096;
+  PaletteLookup lookup;
+  bool counting = countColors;
+  uint32_t nColors = 0;
+  uint32_t prevColor = 0;
+  bool havePrev = false;
+
+  // contiguous rows are scanned as one long row
+  size_t rowPixels = width;
+  size_t nRows = height;
+  if (stride == (size_t)width * 4) {
+    rowPixels *= height;
+    nRows = 1;
+  }
+
+  bool done = false;
+  for (size_t y = 0; y < nRows && !done; y++)
+  for (size_t start = 0; start < rowPixels && !done; start += BLOCK_SIZE) {
+    const uint8_t *block = data + y * stride + start * 4;
+    size_t n = std::min(BLOCK_SIZE, rowPixels - start);
+
+    uint32_t alphaAnd = 0xFFFFFFFF;
+    uint32_t grayOr = 0;
+    for (size_t i = 0; i < n; i++) {
+      uint32_t color;
+      memcpy(&color, block + i * 4, 4);
+      alphaAnd &= color;
+      grayOr |= (color ^ (color >> 8)) & 0xFFFF; // R^G | (G^B) << 8, little-endian RGBA
+    }
+    result->opaque = result->opaque && (alphaAnd >> 24) == 0xFF;
+    result->gray = result->gray && grayOr == 0;
+
+    for (size_t i = 0; counting && i < n; i++) {
+      uint32_t color;
+      memcpy(&color, block + i * 4, 4);
+      if (havePrev && color == prevColor) continue;
+      prevColor = color;
+      havePrev = true;
+      if (lookup.find(color) >= 0) continue;
+      if (nColors == 256) {
+        counting = false;
+        nColors = 0;
+        break;
+      }
+      lookup.add(color, nColors);
+      memcpy(result->palette + nColors * 4, &color, 4);
+      nColors++;
+    }
+
+    done = !counting && !result->opaque && !result->gray;
+  }
+  result->nColors = counting ? nColors : 0;
+}
+
+// Whether every alpha sample of 16 bit RGBA rows is 0xffff, which reads the same in either byte order
+static bool is_opaque16(const uint8_t *data, uint32_t width, uint32_t height, size_t stride) {
+  for (uint32_t y = 0; y < height; y++) {
+    const uint8_t *row = data + y * stride;
+    uint32_t alphaAnd = 0xffff;
+    for (uint32_t x = 0; x < width; x++) {
+      uint16_t alpha;
+      memcpy(&alpha, row + (size_t)x * 8 + 6, 2);
+      alphaAnd &= alpha;
+    }
+    if (alphaAnd != 0xffff) return false;
+  }
+  return true;
+}
+
+// Picks the color type with the fewest bits per pixel that still holds every pixel exactly
+static int smallest_color_type(const ColorAnalysis &analysis) {
+  if (analysis.nColors > 0 && analysis.nColors <= 16) return PNG_COLOR_TYPE_PALETTE; // 1, 2 or 4 bits
+  if (analysis.gray && analysis.opaque) return PNG_COLOR_TYPE_GRAY;
+  if (analysis.nColors > 0) return PNG_COLOR_TYPE_PALETTE;
+  if (analysis.gray) return PNG_COLOR_TYPE_GRAY_ALPHA;
+  if (analysis.opaque) return PNG_COLOR_TYPE_RGB;
+  return PNG_COLOR_TYPE_RGB_ALPHA;
+}
+
+// Keeps the first byte (R, gray value) and optionally alpha of every pixel
+static void rgba_to_gray(const uint8_t *src, size_t nPixels, bool alpha, uint8_t *out) {
+  if (alpha) {
+    for (size_t i = 0; i < nPixels; i++) {
+      out[i * 2] = src[i * 4];
+      out[i * 2 + 1] = src[i * 4 + 3];
+    }
+  } else {
+    for (size_t i = 0; i < nPixels; i++) {
+      out[i] = src[i * 4];
+    }
+  }
+}
+
+static int palette_bit_depth(uint32_t nColors) {
+  if (nColors <= 2) return 1;
+  if (nColors <= 4) return 2;
+  if (nColors <= 16) return 4;
+  return 8;
+}
+
+// Sets up the output and writes everything up to the first IDAT: IHDR, pHYs, PLTE, tRNS and bKGD. The rows
+// passed to libpng afterwards are RGBA, gray(+alpha), palette indices or the 16 bit input, matching png_color_type.
+// Must be called under the caller's setjmp.
+static void write_png_info(png_structp png, png_infop info, PngWriteClosure *closure, int png_color_type, bool autoPalette) {
+  unsigned int width = closure->width;
+  unsigned int height = closure->height;
+
+  png_set_write_fn(png, closure, write_func, flush_func);
+  // compressionLevel 0 and -1 pick fpng where it can be used, the closest libpng equivalent is its fastest level
+  png_set_compression_level(png, closure->compressionLevel <= 0 ? 1 : closure->compressionLevel);
+  png_set_filter(png, 0, closure->filters);
+
+  if (closure->resolution != 0) {
+    uint32_t res = static_cast<uint32_t>(round(static_cast<double>(closure->resolution) * 39.3701));
+    png_set_pHYs(png, info, res, res, PNG_RESOLUTION_METER);
+  }
+
+  bool indexed = png_color_type == PNG_COLOR_TYPE_PALETTE;
+  int bpc = indexed ? palette_bit_depth(closure->nPaletteColors) : closure->input16 ? 16 : 8;
+
+  png_set_IHDR(png, info, width, height, bpc, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+
+  if (png_color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_color colors[256];
+    png_byte alphas[256];
+    int nAlphas = 0; // tRNS can stop after the last translucent entry
+    for (uint32_t i = 0; i < closure->nPaletteColors; i++) {
+      const uint8_t *entry = &closure->palette[i * 4];
+      colors[i].red = entry[0];
+      colors[i].green = entry[1];
+      colors[i].blue = entry[2];
+      alphas[i] = entry[3];
+      if (entry[3] != 255) nAlphas = i + 1;
+    }
+    png_set_PLTE(png, info, colors, closure->nPaletteColors);
+    if (nAlphas > 0) {
+      png_set_tRNS(png, info, alphas, nAlphas, NULL);
+    }
+    if (!autoPalette && closure->backgroundIndex < closure->nPaletteColors) {
+      png_color_16 background = {};
+      background.index = closure->backgroundIndex;
+      png_set_bKGD(png, info, &background);
+    }
+  } else {
+    png_color_16 white = {};
+    white.gray = (1 << bpc) - 1;
+    white.red = white.blue = white.green = white.gray;
+    png_set_bKGD(png, info, &white);
+  }
+
+  png_write_info(png, info);
+  if (bpc < 8) {
+    png_set_packing(png);
+  }
+  if (png_color_type == PNG_COLOR_TYPE_RGB && closure->inputChannels == 4) {
+    png_set_filler(png, 0, PNG_FILLER_AFTER); // drops the alpha channel while writing the RGBA rows
+  }
+  if (closure->input16 && host_is_little_endian()) {
+    png_set_swap(png); // libpng copies each row before filtering it, the bytes are swapped in that copy
+  }
+}
+
 static error_status write_png(PngWriteClosure *closure) {
   error_status status = ES_SUCCESS;
   unsigned int width = closure->width;
@@ -177,16 +649,59 @@ static error_status write_png(PngWriteClosure *closure) {
     return status;
   }
 
-  if (closure->compressionLevel <= 0) {
+  if (aborted(closure->abort)) {
+    return ES_ABORTED;
+  }
+
+  bool indexed = closure->nPaletteColors > 0;
+  size_t nPixels = (size_t)width * height;
+  size_t stride = closure->stride ? closure->stride : (size_t)width * input_pixel_size(closure);
+
+  // fpng only writes 8 bit RGB(A), indexed and 16 bit images always go through libpng
+  if (closure->compressionLevel <= 0 && !indexed && !closure->input16) {
     int flags = fpng::FPNG_ENCODE_SLOWER;
     if (closure->compressionLevel == -1) {
       flags = 0;
     }
+    // converted row by row in fpng's filter pass, opaque pixels are the same premultiplied or not
+    if (closure->inputBGRA) flags |= fpng::FPNG_INPUT_BGR;
+    if (closure->inputPremultiplied) flags |= fpng::FPNG_INPUT_PREMULTIPLIED;
+
+    EncodeArena &arena = encode_arena;
+    uint32_t channels = 4;
+    if (closure->optimizeColorType) {
+      ColorAnalysis analysis;
+      analyze_colors(data, width, height, stride, false, &analysis);
+      if (analysis.opaque) {
+        size_t capacity = arena.pixels.capacity();
+        arena.pixels.resize(nPixels * 3);
+        arena_count(arena.pixels, capacity);
+        uint8_t *rgb = arena.pixels.data();
+        for (uint32_t y = 0; y < height; y++) {
+          const uint8_t *row = data + y * stride;
+          uint8_t *out = rgb + (size_t)y * width * 3;
+          for (uint32_t x = 0; x < width; x++) {
+            memcpy(out + x * 3, row + x * 4, 3);
+          }
+        }
+        data = rgb;
+        stride = (size_t)width * 3;
+        channels = 3;
+      }
+    }
 
     closure->outputVector = std::make_unique<std::vector<uint8_t>>();
-    auto fpng_status = fpng::fpng_encode_image_to_memory(closure->data, width, height, 4, *(closure->outputVector), flags);
+    size_t capacity = arena.filtered.capacity();
+    auto fpng_status = closure->threads == 1 ?
+      fpng::fpng_encode_image_to_memory(data, width, height, channels, *(closure->outputVector), flags, &arena.filtered, closure->abort.get(), stride) :
+      fpng::fpng_encode_image_to_memory_mt(data, width, height, channels, *(closure->outputVector), flags, closure->threads, &arena.filtered, closure->abort.get(), stride);
+    arena_count(arena.filtered, capacity);
+    bytes_allocated += closure->outputVector->capacity();
+    arena_trim(arena.filtered);
+    arena_trim(arena.pixels);
     if (!fpng_status) {
-      return ES_WRITE_ERROR;
+      closure->outputVector.reset();
+      return aborted(closure->abort) ? ES_ABORTED : ES_WRITE_ERROR;
     }
     return status;
   }
@@ -197,7 +712,67 @@ static error_status write_png(PngWriteClosure *closure) {
     return status;
   }
 
-  int stride = width * 4; // cairo_image_surface_get_stride(surface);
+  EncodeArena &arena = encode_arena;
+  bool convertRows = converts_input(closure);
+  if (convertRows && (indexed || closure->optimizeColorType)) {
+    // the color analysis and palette lookups need straight RGBA
+    size_t capacity = arena.rgba.capacity();
+    arena.rgba.resize(nPixels * 4);
+    arena_count(arena.rgba, capacity);
+    for (uint32_t y = 0; y < height; y++) {
+      input_to_rgba(closure, data + y * stride, arena.rgba.data() + (size_t)y * width * 4, width);
+    }
+    data = arena.rgba.data();
+    stride = (size_t)width * 4;
+    convertRows = false;
+  }
+
+  int png_color_type = input_color_type(closure);
+  bool autoPalette = false;
+  if (closure->optimizeColorType && closure->input16) {
+    // 16 bit rows are handed to libpng as they are, dropping alpha is the one reduction that needs no copy
+    if (png_color_type == PNG_COLOR_TYPE_RGB_ALPHA && is_opaque16(data, width, height, stride)) {
+      png_color_type = PNG_COLOR_TYPE_RGB;
+    }
+  } else if (closure->optimizeColorType && !indexed) {
+    ColorAnalysis analysis;
+    analyze_colors(data, width, height, stride, true, &analysis);
+    png_color_type = smallest_color_type(analysis);
+    if (png_color_type == PNG_COLOR_TYPE_PALETTE) {
+      // translucent entries first, so tRNS is as short as possible
+      closure->palette.clear();
+      for (int translucent = 1; translucent >= 0; translucent--) {
+        for (uint32_t i = 0; i < analysis.nColors; i++) {
+          const uint8_t *entry = analysis.palette + i * 4;
+          if ((entry[3] != 255) == (translucent == 1)) closure->palette.insert(closure->palette.end(), entry, entry + 4);
+        }
+      }
+      closure->nPaletteColors = analysis.nColors;
+      indexed = autoPalette = true;
+    }
+  }
+
+  if (!closure->input16 && (indexed || png_color_type == PNG_COLOR_TYPE_GRAY || png_color_type == PNG_COLOR_TYPE_GRAY_ALPHA)) {
+    int channels = png_color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+    size_t capacity = arena.pixels.capacity();
+    arena.pixels.resize(nPixels * channels);
+    arena_count(arena.pixels, capacity);
+
+    if (indexed) {
+      status = map_to_palette(closure, data, stride, arena.pixels.data());
+      if (status != ES_SUCCESS) {
+        free(rows);
+        return status;
+      }
+    } else {
+      for (uint32_t y = 0; y < height; y++) {
+        rgba_to_gray(data + y * stride, width, channels == 2, arena.pixels.data() + (size_t)y * width * channels);
+      }
+    }
+    data = arena.pixels.data();
+    stride = (size_t)width * channels;
+  }
+
   for (unsigned int i = 0; i < height; i++) {
     rows[i] = (png_byte *) data + i * stride;
   }
@@ -229,41 +804,260 @@ static error_status write_png(PngWriteClosure *closure) {
   if (setjmp(png_jmpbuf(png))) {
     png_destroy_write_struct(&png, &info);
     free(rows);
-    return status;
+    free(closure->output);
+    closure->output = nullptr;
+    closure->outputLength = 0;
+    return closure->status != ES_SUCCESS ? closure->status : ES_WRITE_ERROR;
   }
 #endif
 
-  png_set_write_fn(png, closure, write_func, flush_func);
-  png_set_compression_level(png, closure->compressionLevel);
-  png_set_filter(png, 0, closure->filters);
-
-  if (closure->resolution != 0) {
-    uint32_t res = static_cast<uint32_t>(round(static_cast<double>(closure->resolution) * 39.3701));
-    png_set_pHYs(png, info, res, res, PNG_RESOLUTION_METER);
+  closure->outputSizeHint = output_size_hint(nPixels);
+  write_png_info(png, info, closure, png_color_type, autoPalette);
+  if (closure->abort) {
+    png_set_write_status_fn(png, write_row_func);
   }
-
-  int bpc = 8;
-  int png_color_type = PNG_COLOR_TYPE_RGB_ALPHA;
-
-  png_set_IHDR(png, info, width, height, bpc, png_color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-
-  if (png_color_type != PNG_COLOR_TYPE_PALETTE) {
-    png_color_16 white = {};
-    white.gray = (1 << bpc) - 1;
-    white.red = white.blue = white.green = white.gray;
-    png_set_bKGD(png, info, &white);
+  if (convertRows) {
+    png_set_write_user_transform_fn(png, input_transform_func);
   }
-
-  png_write_info(png, info);
   png_write_image(png, rows);
   png_write_end(png, info);
   png_destroy_write_struct(&png, &info);
   free(rows);
+
+  // give back what the size hint overshot, the Buffer keeps this allocation alive
+  if (closure->outputCapacity - closure->outputLength > closure->outputCapacity / 4) {
+    uint8_t *output = (uint8_t*)realloc(closure->output, closure->outputLength);
+    if (output) {
+      closure->output = output;
+      closure->outputCapacity = closure->outputLength;
+    }
+  }
+  arena.lastPixels = nPixels;
+  arena.lastOutputSize = closure->outputLength;
+  arena_trim(arena.pixels);
+  arena_trim(arena.rgba);
   return status;
 }
 
+// Encoder for images that are produced in bands. Rows go through png_write_rows as they come in and the
+// output written so far is taken after each call, so neither the whole frame nor the whole file is held.
+// RGBA, 16 bit or indexed only: fpng and optimizeColorType need all pixels up front.
+class PngStreamEncoder {
+ public:
+  PngWriteClosure options; // dimensions and encode options, output holds the bytes not taken yet
+
+  ~PngStreamEncoder() {
+    destroy();
+    free(options.output);
+  }
+
+  uint32_t rowsWritten() const { return nRowsWritten; }
+  bool done() const { return status == ES_SUCCESS && nRowsWritten == options.height; }
+
+  // Encodes nRows rows of the input format, the last row also writes IEND
+  error_status write(const uint8_t *data, uint32_t nRows) {
+    if (status != ES_SUCCESS) return status;
+    if (nRows > options.height - nRowsWritten) return ES_INVALID_FORMAT;
+
+    bool indexed = options.nPaletteColors > 0;
+    if (!png) {
+      if (options.width == 0 || options.height == 0) return status = ES_WRITE_ERROR;
+      png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+      if (png) info = png_create_info_struct(png);
+      if (!info) {
+        destroy();
+        return status = ES_NO_MEMORY;
+      }
+      if (indexed) lookup.reset(new PaletteLookup(options.palette.data(), options.nPaletteColors));
+    }
+
+#ifdef PNG_SETJMP_SUPPORTED
+    if (setjmp(png_jmpbuf(png))) {
+      destroy();
+      return status = options.status != ES_SUCCESS ? options.status : ES_WRITE_ERROR;
+    }
+#endif
+
+    if (!headerWritten) {
+      write_png_info(png, info, &options, input_color_type(&options), false);
+      if (!indexed && converts_input(&options)) png_set_write_user_transform_fn(png, input_transform_func);
+      headerWritten = true;
+    }
+
+    size_t stride = (size_t)options.width * input_pixel_size(&options);
+    if (indexed) {
+      if (converts_input(&options)) {
+        rgba.resize((size_t)options.width * nRows * 4);
+        input_to_rgba(&options, data, rgba.data(), (size_t)options.width * nRows);
+        data = rgba.data();
+      }
+      indices.resize((size_t)options.width * nRows);
+      if (map_to_palette(*lookup, data, indices.size(), indices.data()) != ES_SUCCESS) {
+        destroy();
+        return status = ES_COLOR_NOT_IN_PALETTE;
+      }
+      data = indices.data();
+      stride = options.width;
+    }
+
+    rows.resize(nRows);
+    for (uint32_t i = 0; i < nRows; i++) {
+      rows[i] = (png_bytep)data + i * stride;
+    }
+    png_write_rows(png, rows.data(), nRows);
+    nRowsWritten += nRows;
+
+    if (nRowsWritten == options.height) {
+      png_write_end(png, info);
+      destroy();
+    }
+    return ES_SUCCESS;
+  }
+
+  // Hands the output written so far over to the caller, who frees it. Null when there is none.
+  uint8_t *takeOutput(size_t *length) {
+    uint8_t *output = options.output;
+    *length = options.outputLength;
+    // the next chunk is likely about as large as this one
+    options.outputSizeHint = options.outputLength;
+    options.output = nullptr;
+    options.outputLength = 0;
+    options.outputCapacity = 0;
+    return output;
+  }
+
+ private:
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  bool headerWritten = false;
+  uint32_t nRowsWritten = 0;
+  error_status status = ES_SUCCESS;
+  std::unique_ptr<PaletteLookup> lookup;
+  std::vector<uint8_t> indices;
+  std::vector<uint8_t> rgba; // indexed rows in another inputFormat
+  std::vector<png_bytep> rows;
+
+  void destroy() {
+    if (png) png_destroy_write_struct(&png, &info);
+    png = nullptr;
+    info = nullptr;
+    std::vector<uint8_t>().swap(indices);
+    std::vector<uint8_t>().swap(rgba);
+  }
+};
+
 // reading
 
+// Decode-time downscaling for thumbnails: blocks of factor x factor pixels are averaged into one
+struct DecodeShrink {
+  uint32_t factor = 1; // from scale: 1/2 -> 2
+  uint32_t maxWidth = 0; // 0 = no limit, otherwise the factor grows until the image fits
+  uint32_t maxHeight = 0;
+
+  bool enabled() const {
+    return factor > 1 || maxWidth || maxHeight;
+  }
+
+  uint32_t factorFor(uint32_t width, uint32_t height) const {
+    uint32_t f = factor;
+    if (maxWidth) f = std::max(f, (width + maxWidth - 1) / maxWidth);
+    if (maxHeight) f = std::max(f, (height + maxHeight - 1) / maxHeight);
+    return f;
+  }
+};
+
+// Region decodes keep only this rectangle of the source, shrink then applies to the cropped image
+struct DecodeRegion {
+  uint32_t x = 0;
+  uint32_t y = 0;
+  uint32_t width = 0; // 0 = whole image
+  uint32_t height = 0;
+
+  bool enabled() const {
+    return width > 0;
+  }
+
+  bool fits(uint32_t imageWidth, uint32_t imageHeight) const {
+    return x < imageWidth && width <= imageWidth - x && y < imageHeight && height <= imageHeight - y;
+  }
+};
+
+// Box filter that takes RGBA_NONPREMUL rows one at a time and writes an output row every factor input rows,
+// so only one band of column sums is kept. Colors are weighted by alpha, transparent pixels don't darken the
+// edges. The last row and column of blocks average over however many pixels they have.
+class BoxShrinker {
+ public:
+  void init(uint32_t width, uint32_t height, uint32_t factor, bool premultiplied, uint8_t *output) {
+    this->width = width;
+    this->height = height;
+    this->factor = factor;
+    this->premultiplied = premultiplied;
+    this->output = output;
+    outWidth = (width + factor - 1) / factor;
+    sums.assign((size_t)outWidth * 4, 0);
+    nRows = 0;
+  }
+
+  uint32_t outputWidth() const { return outWidth; }
+  uint32_t outputHeight() const { return (height + factor - 1) / factor; }
+
+  void addRow(const uint8_t *row) {
+    if (factor == 1) {
+      copyRow(row);
+      return;
+    }
+    uint64_t *sum = sums.data();
+    for (uint32_t x = 0; x < width; x++) {
+      const uint8_t *pixel = row + (size_t)x * 4;
+      uint64_t *block = sum + (size_t)(x / factor) * 4;
+      uint32_t a = pixel[3];
+      block[0] += pixel[0] * a;
+      block[1] += pixel[1] * a;
+      block[2] += pixel[2] * a;
+      block[3] += a;
+    }
+    nRows++;
+    if (nRows % factor == 0 || nRows == height) flush();
+  }
+
+ private:
+  uint32_t width = 0, height = 0, factor = 1, outWidth = 0, nRows = 0;
+  bool premultiplied = false;
+  uint8_t *output = nullptr;
+  std::vector<uint64_t> sums; // per output column: r*a, g*a, b*a, a
+
+  // Crops without a shrink give the same pixels as a full decode, premultiplied like the wuffs swizzler.
+  // row may be the output row itself.
+  void copyRow(const uint8_t *row) {
+    uint8_t *out = output + (size_t)nRows++ * width * 4;
+    if (!premultiplied) {
+      memmove(out, row, (size_t)width * 4);
+      return;
+    }
+    for (size_t i = 0; i < (size_t)width * 4; i += 4) {
+      uint32_t pixel = wuffs_base__peek_u32le__no_bounds_check(row + i);
+      wuffs_base__poke_u32le__no_bounds_check(out + i, wuffs_base__color_u32_argb_nonpremul__as__color_u32_argb_premul(pixel));
+    }
+  }
+
+  void flush() {
+    uint32_t blockRows = (nRows - 1) % factor + 1;
+    uint8_t *out = output + (size_t)((nRows - 1) / factor) * outWidth * 4;
+    for (uint32_t x = 0; x < outWidth; x++) {
+      uint64_t *block = sums.data() + (size_t)x * 4;
+      uint64_t n = (uint64_t)std::min(factor, width - x * factor) * blockRows;
+      uint64_t alpha = block[3];
+      // premultiplied: sum(c * a / 255) / n, otherwise the alpha weighted mean sum(c * a) / sum(a)
+      uint64_t divisor = premultiplied ? 255 * n : alpha;
+      for (int c = 0; c < 3; c++) {
+        out[x * 4 + c] = divisor ? (uint8_t)((block[c] + divisor / 2) / divisor) : 0;
+      }
+      out[x * 4 + 3] = (uint8_t)((alpha + n / 2) / n);
+    }
+    std::fill(sums.begin(), sums.end(), 0);
+  }
+};
+
 struct PngReadClosure {
   // input
   uint8_t *data;
@@ -271,34 +1065,506 @@ struct PngReadClosure {
   Nan::Persistent<v8::Value> dataRef;
   Nan::Callback cb;
   error_status status = ES_SUCCESS;
+  AbortFlag abort;
   bool premultiplied;
+  DecodePixelFormat pixelFormat = PIXEL_RGBA; // only RGBA combines with dest, 16 bit formats don't with shrink
+  DecodeShrink shrink;
+  DecodeRegion region;
+  DecodeDestination dest; // decodeInto: pixels go here and buffer stays null
+  Nan::Persistent<v8::Value> destRef;
 
   // output
   uint32_t width = 0;
   uint32_t height = 0;
   uint8_t *buffer = nullptr;
+  uint32_t fourcc = 0; // WUFFS_BASE__FOURCC__*, set by read_image
+
+  size_t offset = 0; // libpng read position
 };
 
-static error_status read_png(PngReadClosure *closure) {
-  if (closure->length < 8 || !png_check_sig(closure->data, 8)) return ES_INVALID_SIGNATURE;
+// Input slice between two abort checks while decoding
+#define ABORT_CHECK_BYTES (256 * 1024)
 
-  MyDecodeCallbacks callbacks(closure->premultiplied);
-  wuffs_aux::sync_io::MemoryInput input(closure->data, closure->length);
-  wuffs_aux::DecodeImageResult res = wuffs_aux::DecodeImage(callbacks, input);
-  if (!res.error_message.empty()) {
-    return ES_FAILED;
-  } else if (closure->premultiplied && res.pixbuf.pixcfg.pixel_format().repr !=
-             WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL) {
-    return ES_FAILED;
-  }  else if (!closure->premultiplied && res.pixbuf.pixcfg.pixel_format().repr !=
-             WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL) {
-    return ES_FAILED;
+// Like wuffs_aux::sync_io::MemoryInput, but when the job can be aborted the decoder only sees ABORT_CHECK_BYTES
+// more of the file at a time. Wuffs suspends at the end of each slice and asks for more, which is where the flag
+// is checked. The data is never copied, the next slice is made visible by moving the write index.
+class AbortableInput : public wuffs_aux::sync_io::Input {
+ public:
+  AbortableInput(const uint8_t *data, size_t length, const AbortFlag &abort)
+    : io(wuffs_base__ptr_u8__reader(const_cast<uint8_t*>(data), length, true)), abort(abort) {
+    if (abort && length > ABORT_CHECK_BYTES) {
+      io.meta.wi = ABORT_CHECK_BYTES;
+      io.meta.closed = false;
+    }
   }
 
-  uint32_t w = res.pixbuf.pixcfg.width();
-  uint32_t h = res.pixbuf.pixcfg.height();
-  closure->width = w;
-  closure->height = h;
+  wuffs_aux::IOBuffer *BringsItsOwnIOBuffer() override {
+    return &io;
+  }
+
+  std::string CopyIn(wuffs_aux::IOBuffer *dst) override {
+    if (aborted(abort)) return "aborted";
+    if (dst != &io || io.meta.closed) return "unexpected end of file";
+    io.meta.wi = std::min(io.data.len, io.meta.wi + ABORT_CHECK_BYTES);
+    io.meta.closed = io.meta.wi == io.data.len;
+    return "";
+  }
+
+ private:
+  wuffs_aux::IOBuffer io;
+  const AbortFlag &abort;
+};
+
+// Number of PNGs decoded by each decoder, see getDecodeStats()
+static std::atomic<uint64_t> fpng_decode_count(0);
+static std::atomic<uint64_t> wuffs_decode_count(0);
+
+// Files written by fpng (compressionLevel <= 0) carry an fdEC chunk and can be decoded by fpng's
+// specialized inflater, which is several times faster than a general purpose one.
+static bool read_fpng(PngReadClosure *closure) {
+  uint32_t width, height, channels;
+  if (closure->length > UINT32_MAX ||
+      fpng::fpng_get_info(closure->data, (uint32_t)closure->length, width, height, channels) != fpng::FPNG_DECODE_SUCCESS) {
+    return false;
+  }
+
+  size_t size = (size_t)width * height * 4;
+  const DecodeDestination &dest = closure->dest;
+  uint8_t *buffer;
+  if (dest.data) {
+    // fpng writes whole images only, padded rows and short buffers are left to wuffs
+    if (dest.rowStride(width) != (size_t)width * 4 || !dest.fits(width, height)) return false;
+    buffer = dest.data;
+  } else {
+    buffer = (uint8_t*)malloc(size);
+    if (!buffer) return false;
+  }
+
+  if (fpng::fpng_decode_memory(closure->data, (uint32_t)closure->length, buffer, size, width, height, channels, 4) != fpng::FPNG_DECODE_SUCCESS) {
+    if (!dest.data) free(buffer);
+    return false;
+  }
+
+  if (closure->premultiplied) {
+    // same conversion as the wuffs RGBA_NONPREMUL -> RGBA_PREMUL swizzler, so both paths give identical pixels
+    for (size_t i = 0; i < size; i += 4) {
+      uint32_t pixel = wuffs_base__peek_u32le__no_bounds_check(buffer + i);
+      wuffs_base__poke_u32le__no_bounds_check(buffer + i, wuffs_base__color_u32_argb_nonpremul__as__color_u32_argb_premul(pixel));
+    }
+  }
+
+  closure->width = width;
+  closure->height = height;
+  closure->buffer = dest.data ? nullptr : buffer;
+  return true;
+}
+
+static void read_func(png_structp png, png_bytep out, png_size_t size) {
+  PngReadClosure *closure = (PngReadClosure *) png_get_io_ptr(png);
+  if (size > closure->length - closure->offset) {
+    png_longjmp(png, 1);
+  }
+  memcpy(out, closure->data + closure->offset, size);
+  closure->offset += size;
+}
+
+// Bad input is reported through the return value, keep libpng from printing it
+static void read_error_func(png_structp png, png_const_charp) {
+  png_longjmp(png, 1);
+}
+
+static void read_warning_func(png_structp, png_const_charp) {
+}
+
+// Region and shrink-on-load decodes of non-interlaced PNGs: libpng hands over one row at a time, the part inside
+// the region goes straight into the box filter and inflating stops after the region's last row. Peak memory is
+// one source row plus the output, the full size image is never allocated.
+static error_status read_png_rows(PngReadClosure *closure) {
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, read_error_func, read_warning_func);
+  if (png == NULL) return ES_NO_MEMORY;
+  png_infop info = png_create_info_struct(png);
+  if (info == NULL) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return ES_NO_MEMORY;
+  }
+
+  BoxShrinker shrinker;
+  uint8_t *volatile row = nullptr;
+  uint8_t *volatile output = nullptr;
+  closure->offset = 0;
+
+#ifdef PNG_SETJMP_SUPPORTED
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    free(row);
+    free(output);
+    return aborted(closure->abort) ? ES_ABORTED : ES_FAILED;
+  }
+#endif
+
+  png_set_read_fn(png, closure, read_func);
+  png_read_info(png, info);
+
+  // everything becomes 8 bit RGBA, like wuffs' RGBA_NONPREMUL output
+  png_set_expand(png);
+  png_set_strip_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+  png_read_update_info(png, info);
+
+  uint32_t width = png_get_image_width(png, info);
+  uint32_t height = png_get_image_height(png, info);
+  if (png_get_rowbytes(png, info) != (size_t)width * 4) png_longjmp(png, 1);
+
+  DecodeRegion region = closure->region;
+  if (!region.enabled()) {
+    region.width = width;
+    region.height = height;
+  } else if (!region.fits(width, height)) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return ES_INVALID_REGION;
+  }
+
+  uint32_t factor = closure->shrink.factorFor(region.width, region.height);
+  shrinker.init(region.width, region.height, factor, closure->premultiplied, nullptr);
+  output = (uint8_t*)malloc((size_t)shrinker.outputWidth() * shrinker.outputHeight() * 4);
+  row = (uint8_t*)malloc((size_t)width * 4);
+  if (!output || !row) png_longjmp(png, 1);
+  shrinker.init(region.width, region.height, factor, closure->premultiplied, output);
+
+  // rows above the region still have to be inflated, the ones below never are
+  for (uint32_t y = 0; y < region.y + region.height; y++) {
+    if (aborted(closure->abort)) png_longjmp(png, 1);
+    png_read_row(png, row, NULL);
+    if (y >= region.y) shrinker.addRow(row + (size_t)region.x * 4);
+  }
+
+  png_destroy_read_struct(&png, &info, NULL);
+  free(row);
+  closure->width = shrinker.outputWidth();
+  closure->height = shrinker.outputHeight();
+  closure->buffer = output;
+  return ES_SUCCESS;
+}
+
+// Crop of an image that was decoded in full, in place
+static error_status crop_decoded(PngReadClosure *closure) {
+  const DecodeRegion &region = closure->region;
+  if (!region.enabled()) return ES_SUCCESS;
+  if (!region.fits(closure->width, closure->height)) {
+    free(closure->buffer);
+    closure->buffer = nullptr;
+    return ES_INVALID_REGION;
+  }
+
+  size_t size = pixel_size(closure->pixelFormat);
+  for (uint32_t y = 0; y < region.height; y++) {
+    memmove(closure->buffer + (size_t)y * region.width * size,
+            closure->buffer + ((size_t)(region.y + y) * closure->width + region.x) * size, (size_t)region.width * size);
+  }
+  closure->width = region.width;
+  closure->height = region.height;
+  uint8_t *output = (uint8_t*)realloc(closure->buffer, (size_t)closure->width * closure->height * size);
+  if (output) closure->buffer = output;
+  return ES_SUCCESS;
+}
+
+// Shrink for images that were decoded in full (interlaced PNG, WebP), in place: output row k only
+// overwrites input rows that were already added to the filter.
+static void shrink_decoded(PngReadClosure *closure) {
+  uint32_t width = closure->width;
+  uint32_t height = closure->height;
+  uint32_t factor = closure->shrink.factorFor(width, height);
+  if (factor <= 1 && !closure->premultiplied) return;
+
+  BoxShrinker shrinker;
+  shrinker.init(width, height, factor, closure->premultiplied, closure->buffer);
+  for (uint32_t y = 0; y < height; y++) {
+    shrinker.addRow(closure->buffer + (size_t)y * width * 4);
+  }
+
+  closure->width = shrinker.outputWidth();
+  closure->height = shrinker.outputHeight();
+  uint8_t *output = (uint8_t*)realloc(closure->buffer, (size_t)closure->width * closure->height * 4);
+  if (output) closure->buffer = output;
+}
+
+static inline uint32_t read_be32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Decodes in full as RGBA_NONPREMUL, then crops, shrinks (and premultiplies) the result
+static error_status read_transformed_after(PngReadClosure *closure, error_status (*read)(PngReadClosure*)) {
+  bool premultiplied = closure->premultiplied;
+  DecodeShrink shrink = closure->shrink;
+  DecodeRegion region = closure->region;
+  closure->premultiplied = false;
+  closure->shrink = DecodeShrink();
+  closure->region = DecodeRegion();
+  error_status status = read(closure);
+  closure->premultiplied = premultiplied;
+  closure->shrink = shrink;
+  closure->region = region;
+  if (status == ES_SUCCESS) status = crop_decoded(closure);
+  if (status == ES_SUCCESS) shrink_decoded(closure);
+  return status;
+}
+
+// 8 bit pixel formats other than RGBA
+
+// What wuffs is asked for, so the swizzle happens while it writes the pixels. Gray with alpha isn't a wuffs
+// format and comes from RGBA through convert_decoded().
+static uint32_t wuffs_pixel_format(const PngReadClosure *closure) {
+  switch (closure->pixelFormat) {
+    case PIXEL_BGRA:
+      return closure->premultiplied ? WUFFS_BASE__PIXEL_FORMAT__BGRA_PREMUL : WUFFS_BASE__PIXEL_FORMAT__BGRA_NONPREMUL;
+    case PIXEL_RGB: return WUFFS_BASE__PIXEL_FORMAT__RGB;
+    case PIXEL_GRAY: return WUFFS_BASE__PIXEL_FORMAT__Y;
+    default:
+      return closure->premultiplied ? WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL : WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL;
+  }
+}
+
+static inline uint8_t gray_of(const uint8_t *rgb) {
+  return wuffs_base__color_u32_argb_premul__as__color_u8_gray((uint32_t)rgb[0] << 16 | (uint32_t)rgb[1] << 8 | rgb[2]);
+}
+
+// RGBA decodes (premultiplied when closure->premultiplied) to closure->pixelFormat, in place. RGB and gray take the
+// premultiplied colors, the same wuffs gives when it converts.
+static error_status convert_decoded(PngReadClosure *closure) {
+  static const uint8_t bgra_order[4] = { 2, 1, 0, 3 };
+  size_t nPixels = (size_t)closure->width * closure->height;
+  uint8_t *buffer = closure->buffer;
+  DecodePixelFormat format = closure->pixelFormat;
+  if (format == PIXEL_RGBA) return ES_SUCCESS;
+  if (format == PIXEL_BGRA) {
+    fpng::fpng_swizzle(buffer, buffer, nPixels, bgra_order);
+    return ES_SUCCESS;
+  }
+
+  if (!closure->premultiplied && format != PIXEL_GRAYA) fpng::fpng_premultiply(buffer, buffer, nPixels);
+  // every output pixel is smaller than its input, so going forward only overwrites pixels already read
+  for (size_t i = 0; i < nPixels; i++) {
+    const uint8_t *src = buffer + i * 4;
+    if (format == PIXEL_RGB) {
+      memmove(buffer + i * 3, src, 3);
+    } else if (format == PIXEL_GRAY) {
+      buffer[i] = gray_of(src);
+    } else {
+      uint8_t alpha = src[3];
+      buffer[i * 2] = gray_of(src);
+      buffer[i * 2 + 1] = alpha;
+    }
+  }
+  uint8_t *output = (uint8_t*)realloc(buffer, nPixels * pixel_size(format));
+  if (output) closure->buffer = output;
+  return ES_SUCCESS;
+}
+
+// Decodes RGBA through read, then converts it. For the paths that only write RGBA: libpng rows, QOI and
+// anything cropped or shrunk.
+static error_status read_converted(PngReadClosure *closure, error_status (*read)(PngReadClosure*)) {
+  DecodePixelFormat format = closure->pixelFormat;
+  closure->pixelFormat = PIXEL_RGBA;
+  error_status status = read(closure);
+  closure->pixelFormat = format;
+  return status == ES_SUCCESS ? convert_decoded(closure) : status;
+}
+
+// 16 bit pixel formats
+
+static inline bool is_big_endian(DecodePixelFormat format) {
+  return format == PIXEL_RGBA16BE || (format == PIXEL_RGBA16 && !host_is_little_endian());
+}
+
+static inline uint32_t load_u16(const uint8_t *p, bool bigEndian) {
+  return bigEndian ? (uint32_t)p[0] << 8 | p[1] : p[0] | (uint32_t)p[1] << 8;
+}
+
+static inline void store_u16(uint8_t *p, uint32_t value, bool bigEndian) {
+  p[bigEndian ? 0 : 1] = (uint8_t)(value >> 8);
+  p[bigEndian ? 1 : 0] = (uint8_t)value;
+}
+
+// In place, c * a / 65535 rounded to nearest
+static void premultiply16(uint8_t *pixels, size_t nPixels, bool bigEndian) {
+  for (size_t i = 0; i < nPixels; i++) {
+    uint8_t *p = pixels + i * 8;
+    uint32_t a = load_u16(p + 6, bigEndian);
+    if (a == 0xffff) continue;
+    for (int c = 0; c < 3; c++) {
+      store_u16(p + c * 2, (load_u16(p + c * 2, bigEndian) * a + 32767) / 65535, bigEndian);
+    }
+  }
+}
+
+// Decodes 8 bit RGBA through read, then widens it in place: x * 257 maps 0-255 onto 0-65535 and is the byte written
+// twice, so it reads the same in either byte order. Only PNG has more than 8 bits per channel to give.
+static error_status read_widened(PngReadClosure *closure, error_status (*read)(PngReadClosure*)) {
+  DecodePixelFormat format = closure->pixelFormat;
+  bool premultiplied = closure->premultiplied;
+  closure->pixelFormat = PIXEL_RGBA;
+  closure->premultiplied = false;
+  error_status status = read(closure);
+  closure->pixelFormat = format;
+  closure->premultiplied = premultiplied;
+  if (status != ES_SUCCESS) return status;
+
+  size_t nPixels = (size_t)closure->width * closure->height;
+  uint8_t *buffer = (uint8_t*)realloc(closure->buffer, nPixels * 8);
+  if (!buffer) {
+    free(closure->buffer);
+    closure->buffer = nullptr;
+    return ES_NO_MEMORY;
+  }
+  for (size_t i = nPixels * 4; i-- > 0;) {
+    buffer[i * 2] = buffer[i * 2 + 1] = buffer[i];
+  }
+  if (premultiplied) premultiply16(buffer, nPixels, is_big_endian(format));
+  closure->buffer = buffer;
+  return ES_SUCCESS;
+}
+
+// 16 bit PNG decodes: libpng expands every color type and bit depth to 16 bit RGBA, swapping the bytes on the way
+// when asked to. Non-interlaced images are read row by row like read_png_rows(): only the region is kept and rows
+// below it are never inflated. Interlaced ones are decoded in full, straight into the output, and cropped afterwards.
+static error_status read_png16(PngReadClosure *closure) {
+  png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, read_error_func, read_warning_func);
+  if (png == NULL) return ES_NO_MEMORY;
+  png_infop info = png_create_info_struct(png);
+  if (info == NULL) {
+    png_destroy_read_struct(&png, NULL, NULL);
+    return ES_NO_MEMORY;
+  }
+
+  uint8_t *volatile output = nullptr;
+  uint8_t *volatile row = nullptr;
+  png_bytep *volatile rows = nullptr;
+  closure->offset = 0;
+
+#ifdef PNG_SETJMP_SUPPORTED
+  if (setjmp(png_jmpbuf(png))) {
+    png_destroy_read_struct(&png, &info, NULL);
+    free(rows);
+    free(row);
+    free(output);
+    return aborted(closure->abort) ? ES_ABORTED : ES_FAILED;
+  }
+#endif
+
+  png_set_read_fn(png, closure, read_func);
+  png_read_info(png, info);
+
+  bool bigEndian = is_big_endian(closure->pixelFormat);
+  png_set_expand(png);
+  png_set_expand_16(png);
+  png_set_gray_to_rgb(png);
+  png_set_add_alpha(png, 0xffff, PNG_FILLER_AFTER);
+  if (!bigEndian) png_set_swap(png);
+  int passes = png_set_interlace_handling(png);
+  png_read_update_info(png, info);
+
+  uint32_t width = png_get_image_width(png, info);
+  uint32_t height = png_get_image_height(png, info);
+  if (png_get_rowbytes(png, info) != (size_t)width * 8) png_longjmp(png, 1);
+  DecodeRegion region = closure->region;
+  if (region.enabled() && !region.fits(width, height)) {
+    png_destroy_read_struct(&png, &info, NULL);
+    return ES_INVALID_REGION;
+  }
+
+  if (passes == 1) {
+    if (!region.enabled()) {
+      region.width = width;
+      region.height = height;
+    }
+    output = (uint8_t*)malloc((size_t)region.width * region.height * 8);
+    if (region.width != width) row = (uint8_t*)malloc((size_t)width * 8);
+    if (!output || (region.width != width && !row)) png_longjmp(png, 1);
+
+    // full width rows go straight into the output, the ones above the region land in the first output row
+    // (or the scratch row) until the region starts
+    for (uint32_t y = 0; y < region.y + region.height; y++) {
+      if (aborted(closure->abort)) png_longjmp(png, 1);
+      if (y < region.y) {
+        png_read_row(png, row ? row : output, NULL);
+        continue;
+      }
+      uint8_t *out = output + (size_t)(y - region.y) * region.width * 8;
+      if (row) {
+        png_read_row(png, row, NULL);
+        memcpy(out, row + (size_t)region.x * 8, (size_t)region.width * 8);
+      } else {
+        png_read_row(png, out, NULL);
+      }
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    free(row);
+    closure->width = region.width;
+    closure->height = region.height;
+  } else {
+    output = (uint8_t*)malloc((size_t)width * height * 8);
+    rows = (png_bytep*)malloc(height * sizeof(png_bytep));
+    if (!output || !rows) png_longjmp(png, 1);
+    for (uint32_t y = 0; y < height; y++) {
+      rows[y] = output + (size_t)y * width * 8;
+    }
+    for (int pass = 0; pass < passes; pass++) {
+      for (uint32_t y = 0; y < height; y++) {
+        if (aborted(closure->abort)) png_longjmp(png, 1);
+        png_read_row(png, rows[y], NULL);
+      }
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    free(rows);
+    closure->width = width;
+    closure->height = height;
+  }
+
+  closure->buffer = output;
+  error_status status = passes == 1 ? ES_SUCCESS : crop_decoded(closure);
+  if (status == ES_SUCCESS && closure->premultiplied) {
+    premultiply16(closure->buffer, (size_t)closure->width * closure->height, bigEndian);
+  }
+  return status;
+}
+
+static error_status read_png(PngReadClosure *closure) {
+  if (closure->length < 8 || !png_check_sig(closure->data, 8)) return ES_INVALID_SIGNATURE;
+  if (aborted(closure->abort)) return ES_ABORTED;
+  if (is_16bit(closure->pixelFormat)) return read_png16(closure);
+
+  // IHDR comes first: width and height at 16, the interlace method at 28. Images the shrink leaves at full size
+  // (they already fit) take the usual path.
+  bool transform = closure->region.enabled();
+  if (!transform && closure->shrink.enabled() && closure->length > 28) {
+    transform = closure->shrink.factorFor(read_be32(closure->data + 16), read_be32(closure->data + 20)) > 1;
+  }
+  if (transform || closure->pixelFormat == PIXEL_GRAYA) {
+    if (closure->pixelFormat != PIXEL_RGBA) return read_converted(closure, read_png);
+    return closure->length > 28 && closure->data[28] != 0 ? read_transformed_after(closure, read_png) : read_png_rows(closure);
+  }
+
+  if (read_fpng(closure)) {
+    fpng_decode_count++;
+    return convert_decoded(closure);
+  }
+  wuffs_decode_count++;
+
+  MyDecodeCallbacks callbacks(wuffs_pixel_format(closure), closure->dest.data ? &closure->dest : nullptr);
+  AbortableInput input(closure->data, closure->length, closure->abort);
+  wuffs_aux::DecodeImageResult res = wuffs_aux::DecodeImage(callbacks, input);
+  if (!res.error_message.empty()) {
+    if (aborted(closure->abort)) return ES_ABORTED;
+    return callbacks.destTooSmall ? ES_DEST_TOO_SMALL : ES_FAILED;
+  } else if (res.pixbuf.pixcfg.pixel_format().repr != wuffs_pixel_format(closure)) {
+    return ES_FAILED;
+  }
+
+  uint32_t w = res.pixbuf.pixcfg.width();
+  uint32_t h = res.pixbuf.pixcfg.height();
+  closure->width = w;
+  closure->height = h;
 
   // WARNING: this malloc needs to be free'd by the caller
   closure->buffer = (uint8_t*)res.pixbuf_mem_owner.release();
@@ -308,20 +1574,8 @@ static error_status read_png(PngReadClosure *closure) {
 
 // webp reading
 
-struct WebpReadClosure {
-  // input
-  uint8_t *data;
-  size_t length;
-  Nan::Persistent<v8::Value> dataRef;
-  Nan::Callback cb;
-  error_status status = ES_SUCCESS;
-  bool premultiplied;
-
-  // output
-  uint32_t width = 0;
-  uint32_t height = 0;
-  uint8_t *buffer = nullptr;
-};
+// same inputs and outputs as PNG, both go through wuffs
+typedef PngReadClosure WebpReadClosure;
 
 static bool is_webp(uint8_t* data, size_t len) {
   return len >= 12 &&
@@ -329,19 +1583,24 @@ static bool is_webp(uint8_t* data, size_t len) {
          data[8]=='W' && data[9]=='E' && data[10]=='B' && data[11]=='P';
 }
 
-static error_status read_webp(WebpReadClosure *closure) {
-  if (!is_webp(closure->data, closure->length)) return ES_INVALID_SIGNATURE;
+// Any format wuffs_aux knows (GIF takes the first frame), in closure->pixelFormat. Used for everything but PNG, which has its own fast paths.
+static error_status read_wuffs(PngReadClosure *closure) {
+  if (aborted(closure->abort)) return ES_ABORTED;
+  if (is_16bit(closure->pixelFormat)) return read_widened(closure, read_wuffs);
+  bool transform = closure->shrink.enabled() || closure->region.enabled();
+  if (closure->pixelFormat != PIXEL_RGBA && (transform || closure->pixelFormat == PIXEL_GRAYA)) {
+    return read_converted(closure, read_wuffs);
+  }
+  if (transform) return read_transformed_after(closure, read_wuffs);
 
-  MyDecodeCallbacks callbacks(closure->premultiplied);
-  wuffs_aux::sync_io::MemoryInput input(closure->data, closure->length);
+  MyDecodeCallbacks callbacks(wuffs_pixel_format(closure), closure->dest.data ? &closure->dest : nullptr);
+  AbortableInput input(closure->data, closure->length, closure->abort);
   wuffs_aux::DecodeImageResult res = wuffs_aux::DecodeImage(callbacks, input);
   if (!res.error_message.empty()) {
-    return ES_FAILED;
-  } else if (closure->premultiplied && res.pixbuf.pixcfg.pixel_format().repr !=
-             WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL) {
-    return ES_FAILED;
-  } else if (!closure->premultiplied && res.pixbuf.pixcfg.pixel_format().repr !=
-             WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL) {
+    if (aborted(closure->abort)) return ES_ABORTED;
+    if (res.error_message == wuffs_aux::DecodeImage_UnsupportedImageFormat) return ES_INVALID_SIGNATURE;
+    return callbacks.destTooSmall ? ES_DEST_TOO_SMALL : ES_FAILED;
+  } else if (res.pixbuf.pixcfg.pixel_format().repr != wuffs_pixel_format(closure)) {
     return ES_FAILED;
   }
 
@@ -355,3 +1614,618 @@ static error_status read_webp(WebpReadClosure *closure) {
 
   return ES_SUCCESS;
 }
+
+static error_status read_webp(WebpReadClosure *closure) {
+  if (!is_webp(closure->data, closure->length)) return ES_INVALID_SIGNATURE;
+  return read_wuffs(closure);
+}
+
+// qoi reading
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_HEADER_SIZE 14
+// the spec's limit, which keeps the worst case encoded size (5 bytes per pixel) well away from overflows
+#define QOI_PIXELS_MAX 400000000u
+
+static const uint8_t qoi_padding[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+// Pixels are handled as little endian uint32: R in the low byte. The hash is (r * 3 + g * 5 + b * 7 + a * 11) % 64,
+// computed with one multiply: the channels are spread to 16 bit lanes (r, b, g, a) and the products summed in the top one.
+static inline uint32_t qoi_hash(uint32_t rgba) {
+  uint64_t lanes = (rgba & 0x00ff00ffu) | ((uint64_t)(rgba & 0xff00ff00u) << 24);
+  return (uint32_t)((lanes * 0x000300070005000bull) >> 48) & 63;
+}
+
+static inline uint32_t qoi_add(uint32_t rgba, int dr, int dg, int db) {
+  return (rgba & 0xff000000u) | ((rgba + dr) & 0xff) | ((((rgba >> 8) + dg) & 0xff) << 8) | ((((rgba >> 16) + db) & 0xff) << 16);
+}
+
+static inline ptrdiff_t qoi_op_length(uint8_t op) {
+  if (op == QOI_OP_RGBA) return 5;
+  if (op == QOI_OP_RGB) return 4;
+  return (op & 0xc0) == QOI_OP_LUMA ? 2 : 1;
+}
+
+static bool is_qoi(const uint8_t *data, size_t length) {
+  return length >= QOI_HEADER_SIZE && memcmp(data, "qoif", 4) == 0;
+}
+
+// Wuffs has a QOI decoder too, this one writes RGBA rows directly and fills runs in one go, which is several
+// times faster. The channels and colorspace header fields are informational and ignored.
+static error_status read_qoi(PngReadClosure *closure) {
+  if (!is_qoi(closure->data, closure->length)) return ES_INVALID_SIGNATURE;
+  if (aborted(closure->abort)) return ES_ABORTED;
+  if (is_16bit(closure->pixelFormat)) return read_widened(closure, read_qoi);
+  if (closure->pixelFormat != PIXEL_RGBA) return read_converted(closure, read_qoi);
+  if (closure->shrink.enabled() || closure->region.enabled()) return read_transformed_after(closure, read_qoi);
+
+  uint32_t width = read_be32(closure->data + 4);
+  uint32_t height = read_be32(closure->data + 8);
+  if (width == 0 || height == 0 || (uint64_t)width * height > QOI_PIXELS_MAX) return ES_FAILED;
+
+  const DecodeDestination &dest = closure->dest;
+  size_t stride = (size_t)width * 4;
+  uint8_t *buffer;
+  if (dest.data) {
+    if (!dest.fits(width, height)) return ES_DEST_TOO_SMALL;
+    stride = dest.rowStride(width);
+    buffer = dest.data;
+  } else {
+    buffer = (uint8_t*)malloc((size_t)width * height * 4);
+    if (!buffer) return ES_NO_MEMORY;
+  }
+
+  const uint8_t *p = closure->data + QOI_HEADER_SIZE;
+  const uint8_t *end = closure->data + closure->length;
+  uint32_t index[64] = { 0 };
+  uint32_t px = 0xff000000u;
+  uint32_t run = 0;
+  error_status status = ES_SUCCESS;
+  for (uint32_t y = 0; y < height && status == ES_SUCCESS; y++) {
+    if (aborted(closure->abort)) {
+      status = ES_ABORTED;
+      break;
+    }
+    uint8_t *row = buffer + y * stride;
+    for (uint32_t x = 0; x < width;) {
+      if (run) {
+        uint32_t n = std::min(run, width - x);
+        for (uint32_t i = 0; i < n; i++) memcpy(row + (size_t)(x + i) * 4, &px, 4);
+        x += n;
+        run -= n;
+        continue;
+      }
+      // the longest op is 5 bytes, only the last few need a closer look
+      if (end - p < 5 && (p == end || end - p < qoi_op_length(*p))) {
+        status = ES_READING_PAST_END;
+        break;
+      }
+      uint8_t op = *p++;
+      if (op == QOI_OP_RGB) {
+        px = (px & 0xff000000u) | p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16;
+        p += 3;
+      } else if (op == QOI_OP_RGBA) {
+        px = wuffs_base__peek_u32le__no_bounds_check(p);
+        p += 4;
+      } else if ((op & 0xc0) == QOI_OP_INDEX) {
+        px = index[op];
+      } else if ((op & 0xc0) == QOI_OP_DIFF) {
+        px = qoi_add(px, ((op >> 4) & 3) - 2, ((op >> 2) & 3) - 2, (op & 3) - 2);
+      } else if ((op & 0xc0) == QOI_OP_LUMA) {
+        int dg = (op & 0x3f) - 32;
+        uint8_t next = *p++;
+        px = qoi_add(px, dg - 8 + (next >> 4), dg, dg - 8 + (next & 15));
+      } else {
+        run = op & 0x3f; // plus the pixel written below
+      }
+      index[qoi_hash(px)] = px;
+      memcpy(row + (size_t)x * 4, &px, 4);
+      x++;
+    }
+  }
+  if (status != ES_SUCCESS) {
+    if (!dest.data) free(buffer);
+    return status;
+  }
+
+  if (closure->premultiplied) {
+    for (uint32_t y = 0; y < height; y++) fpng::fpng_premultiply(buffer + y * stride, buffer + y * stride, width);
+  }
+
+  closure->width = width;
+  closure->height = height;
+  closure->buffer = dest.data ? nullptr : buffer;
+  return ES_SUCCESS;
+}
+
+// Sniffs the format from the magic bytes, then decodes like read_png or read_wuffs. closure->fourcc says what it was.
+static error_status read_image(PngReadClosure *closure) {
+  wuffs_base__slice_u8 prefix = wuffs_base__make_slice_u8(closure->data, closure->length);
+  int32_t fourcc = wuffs_base__magic_number_guess_fourcc(prefix, true);
+  if (fourcc <= 0) return ES_INVALID_SIGNATURE;
+  closure->fourcc = (uint32_t)fourcc;
+  if (fourcc == WUFFS_BASE__FOURCC__PNG) return read_png(closure);
+  if (fourcc == WUFFS_BASE__FOURCC__QOI) return read_qoi(closure);
+  return read_wuffs(closure);
+}
+
+// streaming
+
+// A run of consecutive decoded rows, malloc'd
+struct PngStreamBand {
+  uint32_t y;
+  uint32_t height;
+  uint8_t *pixels;
+};
+
+// PNG decoder for input that arrives in chunks. Rows are handed out in bands as soon as they are decoded, so
+// decoding overlaps the transfer and the full size image is never held here.
+// Non-interlaced images go through libpng's progressive reader: each chunk is inflated as it arrives and every
+// finished row is copied into the current band, which is handed out once it has bandHeight rows.
+// Interlaced images only complete their rows in the last pass. They go through the wuffs decoder, a coroutine that
+// suspends on a short read and resumes where it left off once more bytes are appended to the io_buffer, so only the
+// not yet consumed bytes are buffered. The whole image is one band at the end.
+class PngStreamDecoder {
+ public:
+  PngStreamDecoder(bool _premultiplied, uint32_t _bandHeight) : premultiplied(_premultiplied), bandHeight(std::max(_bandHeight, 1u)) {}
+
+  ~PngStreamDecoder() {
+    release();
+  }
+
+  PngStreamDecoder(const PngStreamDecoder&) = delete;
+  PngStreamDecoder &operator=(const PngStreamDecoder&) = delete;
+
+  // Appends data and decodes as far as it goes, closed means nothing follows
+  error_status write(const uint8_t *data, size_t length, bool closed) {
+    if (state == FAILED) return ES_FAILED;
+    if (state == DONE) return ES_SUCCESS;
+
+    error_status status;
+    if (png) {
+      status = process(data, length);
+    } else {
+      append(data, length);
+      src.meta.closed = closed;
+      status = state == SIGNATURE ? start() : decode();
+    }
+
+    if (status != ES_SUCCESS) {
+      state = FAILED;
+      release();
+    } else if (closed && state != DONE) {
+      state = FAILED;
+      release();
+      return ES_READING_PAST_END;
+    }
+    return status;
+  }
+
+  bool hasHeader() const { return imageWidth != 0; }
+  bool done() const { return state == DONE; }
+  uint32_t width() const { return imageWidth; }
+  uint32_t height() const { return imageHeight; }
+
+  // Hands the bands finished since the last call over to the caller, who frees their pixels
+  std::vector<PngStreamBand> takeBands() {
+    std::vector<PngStreamBand> result;
+    result.swap(bands);
+    return result;
+  }
+
+ private:
+  enum State { SIGNATURE, HEADER, FRAME, DONE, FAILED };
+
+  State state = SIGNATURE;
+  bool premultiplied;
+  uint32_t bandHeight;
+  uint32_t imageWidth = 0;
+  uint32_t imageHeight = 0;
+  std::vector<PngStreamBand> bands;
+
+  // libpng, non-interlaced
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  uint8_t *band = nullptr; // the band being filled
+  uint32_t rowsDone = 0; // rows in finished bands
+
+  // wuffs, interlaced
+  wuffs_base__image_decoder::unique_ptr decoder = wuffs_base__image_decoder::unique_ptr(nullptr);
+  std::vector<uint8_t> input;
+  wuffs_base__io_buffer src = wuffs_base__empty_io_buffer();
+  wuffs_base__image_config config = wuffs_base__null_image_config();
+  wuffs_base__pixel_buffer pixbuf = wuffs_base__null_pixel_buffer();
+  std::vector<uint8_t> workbuf;
+  uint8_t *pixels = nullptr;
+
+  void append(const uint8_t *data, size_t length) {
+    src.compact();
+    if (src.data.len - src.meta.wi < length) {
+      input.resize(std::max(src.meta.wi + length, input.size() * 2));
+      src.data = wuffs_base__make_slice_u8(input.data(), input.size());
+    }
+    memcpy(src.data.ptr + src.meta.wi, data, length);
+    src.meta.wi += length;
+  }
+
+  // The IHDR's interlace method (byte 28) picks the decoder, the bytes up to it are held back until then
+  error_status start() {
+    const uint8_t *header = src.data.ptr;
+    if (src.meta.wi <= 28) return ES_SUCCESS;
+    if (!png_check_sig(header, 8)) return ES_FAILED;
+    state = HEADER;
+
+    if (header[28] != 0) {
+      decoder = wuffs_png__decoder::alloc_as__wuffs_base__image_decoder();
+      return decode();
+    }
+
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, read_error_func, read_warning_func);
+    if (png) info = png_create_info_struct(png);
+    if (!info) return ES_NO_MEMORY;
+    png_set_progressive_read_fn(png, this, info_callback, row_callback, end_callback);
+    error_status status = process(header, src.meta.wi);
+    std::vector<uint8_t>().swap(input);
+    src = wuffs_base__empty_io_buffer();
+    return status;
+  }
+
+  error_status process(const uint8_t *data, size_t length) {
+#ifdef PNG_SETJMP_SUPPORTED
+    if (setjmp(png_jmpbuf(png))) return ES_FAILED;
+#endif
+    png_process_data(png, info, (png_bytep)data, length);
+    if (state == DONE) {
+      png_destroy_read_struct(&png, &info, NULL);
+    }
+    return ES_SUCCESS;
+  }
+
+  // everything becomes 8 bit RGBA, like wuffs' RGBA_NONPREMUL output
+  static void info_callback(png_structp png, png_infop info) {
+    PngStreamDecoder *self = (PngStreamDecoder*)png_get_progressive_ptr(png);
+    png_set_expand(png);
+    png_set_strip_16(png);
+    png_set_gray_to_rgb(png);
+    png_set_add_alpha(png, 0xff, PNG_FILLER_AFTER);
+    png_read_update_info(png, info);
+
+    uint32_t width = png_get_image_width(png, info);
+    if (png_get_rowbytes(png, info) != (size_t)width * 4) png_error(png, "unexpected row size");
+    self->imageWidth = width;
+    self->imageHeight = png_get_image_height(png, info);
+    self->state = FRAME;
+  }
+
+  static void row_callback(png_structp png, png_bytep row, png_uint_32 y, int) {
+    PngStreamDecoder *self = (PngStreamDecoder*)png_get_progressive_ptr(png);
+    if (!row || y >= self->imageHeight) return;
+    size_t rowBytes = (size_t)self->imageWidth * 4;
+    uint32_t bandY = y - y % self->bandHeight;
+    uint32_t bandRows = std::min(self->bandHeight, self->imageHeight - bandY);
+    if (!self->band) {
+      self->band = (uint8_t*)malloc(bandRows * rowBytes);
+      if (!self->band) png_error(png, "out of memory");
+    }
+
+    uint8_t *out = self->band + (size_t)(y - bandY) * rowBytes;
+    memcpy(out, row, rowBytes);
+    if (self->premultiplied) fpng::fpng_premultiply(out, out, self->imageWidth);
+    if (y + 1 == bandY + bandRows) {
+      self->bands.push_back({ bandY, bandRows, self->band });
+      self->band = nullptr;
+      self->rowsDone = bandY + bandRows;
+    }
+  }
+
+  static void end_callback(png_structp png, png_infop) {
+    PngStreamDecoder *self = (PngStreamDecoder*)png_get_progressive_ptr(png);
+    // IEND before the last row: the image data ended early
+    if (self->rowsDone != self->imageHeight) png_error(png, "missing rows");
+    self->state = DONE;
+  }
+
+  error_status decode() {
+    if (!decoder) return ES_NO_MEMORY;
+
+    if (state == HEADER) {
+      wuffs_base__status status = decoder->decode_image_config(&config, &src);
+      if (status.repr == wuffs_base__suspension__short_read) return ES_SUCCESS;
+      if (!status.is_ok()) return ES_FAILED;
+
+      uint32_t w = config.pixcfg.width();
+      uint32_t h = config.pixcfg.height();
+      if ((uint64_t)w * h > SIZE_MAX / 4) return ES_NO_MEMORY;
+      auto format = premultiplied ? WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL : WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL;
+      config.pixcfg.set(format, WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, w, h);
+
+      pixels = (uint8_t*)malloc(std::max((size_t)w * h * 4, (size_t)1));
+      if (!pixels) return ES_NO_MEMORY;
+      if (!pixbuf.set_interleaved(&config.pixcfg, wuffs_base__make_table_u8(pixels, (size_t)w * 4, h, (size_t)w * 4),
+                                  wuffs_base__empty_slice_u8()).is_ok()) {
+        return ES_FAILED;
+      }
+
+      uint64_t workbufLength = decoder->workbuf_len().max_incl;
+      if (workbufLength > SIZE_MAX) return ES_NO_MEMORY;
+      workbuf.resize((size_t)workbufLength);
+      imageWidth = w;
+      imageHeight = h;
+      state = FRAME;
+    }
+
+    wuffs_base__status status = decoder->decode_frame(&pixbuf, &src, WUFFS_BASE__PIXEL_BLEND__SRC,
+                                                      wuffs_base__make_slice_u8(workbuf.data(), workbuf.size()), nullptr);
+    if (status.repr == wuffs_base__suspension__short_read) return ES_SUCCESS;
+    if (!status.is_ok()) return ES_FAILED;
+
+    state = DONE;
+    wuffs_decode_count++;
+    bands.push_back({ 0, imageHeight, pixels });
+    pixels = nullptr;
+    // the remaining chunks (IEND) are not needed, drop the scratch memory now
+    std::vector<uint8_t>().swap(workbuf);
+    std::vector<uint8_t>().swap(input);
+    src = wuffs_base__empty_io_buffer();
+    return ES_SUCCESS;
+  }
+
+  void release() {
+    if (png) png_destroy_read_struct(&png, info ? &info : NULL, NULL);
+    free(band);
+    band = nullptr;
+    for (auto &b : bands) free(b.pixels);
+    bands.clear();
+    free(pixels);
+    pixels = nullptr;
+    std::vector<uint8_t>().swap(workbuf);
+    std::vector<uint8_t>().swap(input);
+    src = wuffs_base__empty_io_buffer();
+  }
+};
+
+// animation
+
+struct AnimationFrame {
+  uint32_t index = 0;
+  wuffs_base__rect_ie_u32 dirty = wuffs_base__empty_rect_ie_u32(); // canvas pixels that changed since the previous frame
+  double duration = 0; // ms
+};
+
+// Composites the frames of an animated image (GIF, APNG) onto one RGBA canvas, one frame per next() call. Disposal
+// and blending happen here, so after each call the canvas is the picture as it is shown during that frame. Memory is
+// the canvas, the decoder's work buffer and, for frames that restore the previous picture, a copy of their rectangle.
+// The input has to stay alive and unchanged until the decoder is destroyed.
+class AnimationDecoder {
+ public:
+  explicit AnimationDecoder(bool _premultiplied) : premultiplied(_premultiplied) {}
+
+  ~AnimationDecoder() {
+    free(pixels);
+  }
+
+  AnimationDecoder(const AnimationDecoder&) = delete;
+  AnimationDecoder &operator=(const AnimationDecoder&) = delete;
+
+  // Reads the header, picking the decoder by the magic bytes
+  error_status open(const uint8_t *data, size_t length) {
+    wuffs_base__slice_u8 prefix = wuffs_base__make_slice_u8(const_cast<uint8_t*>(data), length);
+    int32_t guess = wuffs_base__magic_number_guess_fourcc(prefix, true);
+    if (guess <= 0) return ES_INVALID_SIGNATURE;
+    fourcc = (uint32_t)guess;
+
+    wuffs_aux::DecodeImageCallbacks callbacks;
+    decoder = callbacks.SelectDecoder(fourcc, prefix, true);
+    if (!decoder) return ES_INVALID_SIGNATURE;
+
+    src = wuffs_base__ptr_u8__reader(const_cast<uint8_t*>(data), length, true);
+    wuffs_base__image_config config = wuffs_base__null_image_config();
+    if (!decoder->decode_image_config(&config, &src).is_ok()) return ES_INVALID_FORMAT;
+
+    uint32_t w = config.pixcfg.width();
+    uint32_t h = config.pixcfg.height();
+    if ((uint64_t)w * h > SIZE_MAX / 4) return ES_NO_MEMORY;
+    auto format = premultiplied ? WUFFS_BASE__PIXEL_FORMAT__RGBA_PREMUL : WUFFS_BASE__PIXEL_FORMAT__RGBA_NONPREMUL;
+    config.pixcfg.set(format, WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, w, h);
+
+    pixels = (uint8_t*)calloc(std::max((size_t)w * h * 4, (size_t)1), 1);
+    if (!pixels) return ES_NO_MEMORY;
+    if (!pixbuf.set_interleaved(&config.pixcfg, wuffs_base__make_table_u8(pixels, (size_t)w * 4, h, (size_t)w * 4),
+                                wuffs_base__empty_slice_u8()).is_ok()) {
+      return ES_FAILED;
+    }
+
+    uint64_t workbufLength = decoder->workbuf_len().max_incl;
+    if (workbufLength > SIZE_MAX) return ES_NO_MEMORY;
+    workbuf.resize((size_t)workbufLength);
+    return ES_SUCCESS;
+  }
+
+  // Decodes the next frame onto the canvas, done is set instead once there are no more frames
+  error_status next(AnimationFrame *frame, bool *done) {
+    *done = false;
+    if (finished) {
+      *done = true;
+      return ES_SUCCESS;
+    }
+
+    wuffs_base__frame_config config = wuffs_base__null_frame_config();
+    wuffs_base__status status = decoder->decode_frame_config(&config, &src);
+    if (status.repr == wuffs_base__note__end_of_data) {
+      finish();
+      *done = true;
+      return ES_SUCCESS;
+    }
+    if (!status.is_ok()) return ES_FAILED;
+
+    // the previous frame's disposal applies before this one is drawn
+    wuffs_base__rect_ie_u32 canvas = wuffs_base__make_rect_ie_u32(0, 0, width(), height());
+    wuffs_base__rect_ie_u32 bounds = config.bounds().intersect(canvas);
+    wuffs_base__rect_ie_u32 dirty = bounds;
+    if (disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_BACKGROUND) {
+      fill(previous, background);
+      dirty = dirty.unite(previous);
+    } else if (disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_PREVIOUS) {
+      copyRect(previous, saved.data(), false);
+      dirty = dirty.unite(previous);
+    }
+
+    background = config.background_color();
+    if (config.index() == 0) {
+      fill(canvas, background);
+      dirty = canvas;
+    }
+
+    disposal = config.disposal();
+    if (disposal == WUFFS_BASE__ANIMATION_DISPOSAL__RESTORE_PREVIOUS) {
+      saved.resize((size_t)bounds.width() * bounds.height() * 4);
+      copyRect(bounds, saved.data(), true);
+    }
+    previous = bounds;
+
+    auto blend = config.overwrite_instead_of_blend() ? WUFFS_BASE__PIXEL_BLEND__SRC : WUFFS_BASE__PIXEL_BLEND__SRC_OVER;
+    status = decoder->decode_frame(&pixbuf, &src, blend, wuffs_base__make_slice_u8(workbuf.data(), workbuf.size()), nullptr);
+    if (!status.is_ok()) return ES_FAILED;
+    wuffs_decode_count++;
+
+    frame->index = (uint32_t)config.index();
+    frame->dirty = dirty;
+    frame->duration = (double)config.duration() / WUFFS_BASE__FLICKS_PER_MILLISECOND;
+    return ES_SUCCESS;
+  }
+
+  uint32_t width() const { return pixbuf.pixcfg.width(); }
+  uint32_t height() const { return pixbuf.pixcfg.height(); }
+  const uint8_t *canvas() const { return pixels; }
+  uint32_t format() const { return fourcc; }
+  // 0 = forever, only final after the header of the first frame was read
+  uint32_t loopCount() const { return decoder ? decoder->num_animation_loops() : 1; }
+
+ private:
+  bool premultiplied;
+  bool finished = false;
+  uint32_t fourcc = 0;
+  wuffs_base__image_decoder::unique_ptr decoder;
+  wuffs_base__io_buffer src = wuffs_base__empty_io_buffer();
+  wuffs_base__pixel_buffer pixbuf = wuffs_base__null_pixel_buffer();
+  std::vector<uint8_t> workbuf;
+  uint8_t *pixels = nullptr;
+
+  wuffs_base__animation_disposal disposal = WUFFS_BASE__ANIMATION_DISPOSAL__NONE;
+  wuffs_base__rect_ie_u32 previous = wuffs_base__empty_rect_ie_u32();
+  wuffs_base__color_u32_argb_premul background = 0;
+  std::vector<uint8_t> saved; // RESTORE_PREVIOUS: the canvas under the current frame
+
+  void fill(wuffs_base__rect_ie_u32 rect, wuffs_base__color_u32_argb_premul color) {
+    if (!premultiplied) color = wuffs_base__color_u32_argb_premul__as__color_u32_argb_nonpremul(color);
+    uint8_t rgba[4] = { (uint8_t)(color >> 16), (uint8_t)(color >> 8), (uint8_t)color, (uint8_t)(color >> 24) };
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++) {
+      uint8_t *row = pixels + ((size_t)y * width() + rect.min_incl_x) * 4;
+      for (uint32_t x = 0; x < rect.width(); x++) memcpy(row + x * 4, rgba, 4);
+    }
+  }
+
+  void copyRect(wuffs_base__rect_ie_u32 rect, uint8_t *buffer, bool save) {
+    size_t rowBytes = (size_t)rect.width() * 4;
+    for (uint32_t y = rect.min_incl_y; y < rect.max_excl_y; y++) {
+      uint8_t *row = pixels + ((size_t)y * width() + rect.min_incl_x) * 4;
+      uint8_t *copy = buffer + (y - rect.min_incl_y) * rowBytes;
+      if (save) memcpy(copy, row, rowBytes); else memcpy(row, copy, rowBytes);
+    }
+  }
+
+  // keeps the canvas (the last frame stays readable), drops the rest
+  void finish() {
+    finished = true;
+    std::vector<uint8_t>().swap(workbuf);
+    std::vector<uint8_t>().swap(saved);
+  }
+};
+
+// probing
+
+struct ImageInfo {
+  uint32_t fourcc = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  uint32_t bitDepth = 0; // per channel, palette index size for indexed PNGs
+  uint32_t frames = 1;
+  bool hasAlpha = false;
+  bool interlaced = false;
+  bool fpng = false; // written by fpng_encode_image_to_memory (has the fdEC chunk)
+};
+
+// Reads IHDR and walks the chunk headers up to the first IDAT, tRNS and acTL have to come before it.
+static error_status probe_png(const uint8_t *data, size_t length, ImageInfo *info) {
+  if (length < 33 || read_be32(data + 8) != 13 || memcmp(data + 12, "IHDR", 4) != 0) return ES_INVALID_FORMAT;
+
+  info->width = read_be32(data + 16);
+  info->height = read_be32(data + 20);
+  info->bitDepth = data[24];
+  info->hasAlpha = (data[25] & PNG_COLOR_MASK_ALPHA) != 0;
+  info->interlaced = data[28] == PNG_INTERLACE_ADAM7;
+  if (info->width == 0 || info->height == 0) return ES_INVALID_FORMAT;
+
+  size_t pos = 33;
+  while (length - pos >= 12) {
+    uint32_t chunk_len = read_be32(data + pos);
+    const uint8_t *type = data + pos + 4;
+    if (chunk_len > length - pos - 12 || memcmp(type, "IDAT", 4) == 0) break;
+
+    if (memcmp(type, "tRNS", 4) == 0) {
+      info->hasAlpha = true;
+    } else if (memcmp(type, "acTL", 4) == 0 && chunk_len >= 8) {
+      info->frames = read_be32(data + pos + 8);
+    }
+    pos += 12 + chunk_len;
+  }
+
+  uint32_t w, h, channels;
+  info->fpng = length <= UINT32_MAX &&
+    fpng::fpng_get_info(data, (uint32_t)length, w, h, channels) == fpng::FPNG_DECODE_SUCCESS;
+  return ES_SUCCESS;
+}
+
+// Fills in info from the image header, without allocating or decoding any pixels.
+static error_status probe_image(const uint8_t *data, size_t length, ImageInfo *info) {
+  wuffs_base__slice_u8 prefix = wuffs_base__make_slice_u8(const_cast<uint8_t*>(data), length);
+  int32_t fourcc = wuffs_base__magic_number_guess_fourcc(prefix, true);
+  if (fourcc <= 0) return ES_INVALID_SIGNATURE;
+  info->fourcc = (uint32_t)fourcc;
+
+  if (fourcc == WUFFS_BASE__FOURCC__PNG) {
+    return probe_png(data, length, info);
+  }
+
+  wuffs_aux::DecodeImageCallbacks callbacks;
+  wuffs_base__image_decoder::unique_ptr decoder = callbacks.SelectDecoder(info->fourcc, prefix, true);
+  if (!decoder) return ES_INVALID_SIGNATURE;
+
+  wuffs_base__io_buffer src = wuffs_base__ptr_u8__reader(const_cast<uint8_t*>(data), length, true);
+  wuffs_base__image_config image_config = wuffs_base__null_image_config();
+  if (!decoder->decode_image_config(&image_config, &src).is_ok()) return ES_INVALID_FORMAT;
+
+  wuffs_base__pixel_format format = image_config.pixcfg.pixel_format();
+  info->width = image_config.pixcfg.width();
+  info->height = image_config.pixcfg.height();
+  info->hasAlpha = format.transparency() != WUFFS_BASE__PIXEL_ALPHA_TRANSPARENCY__OPAQUE &&
+    !image_config.first_frame_is_opaque();
+  for (int shift = 0; shift < 16; shift += 4) {
+    uint32_t bits = wuffs_private_impl__pixel_format__bits_per_channel[(format.repr >> shift) & 0x0F];
+    if (bits > info->bitDepth) info->bitDepth = bits;
+  }
+
+  // Walking the frame configs skips over the compressed frame data without decoding it
+  if (fourcc == WUFFS_BASE__FOURCC__GIF) {
+    info->frames = 0;
+    while (decoder->decode_frame_config(nullptr, &src).is_ok()) {
+      info->frames++;
+    }
+  }
+  return ES_SUCCESS;
+}
@@ -0,0 +1,144 @@
+// Worker threads for codec jobs, separate from libuv's threadpool which fs, dns and crypto share.
+// The threads live as long as the process, so their thread_local arenas and decoder scratch stay warm.
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum CodecPriority {
+  PRIORITY_INTERACTIVE = 0,
+  PRIORITY_BACKGROUND,
+  PRIORITY_COUNT
+};
+
+struct CodecPoolStats {
+  uint32_t queued = 0;
+  uint32_t active = 0;
+  uint64_t completed = 0;
+  double waitTime = 0; // ms, summed over completed jobs
+  double runTime = 0; // ms, summed over completed jobs
+  double maxWaitTime = 0; // ms
+};
+
+// Interactive jobs always go first. Background jobs never take the last free thread (unless there is only one),
+// so a burst of large background encodes can't hold up a thumbnail. All jobs are submitted from the JS thread,
+// so one shared queue per priority is all the scheduling there is.
+class CodecPool {
+ public:
+  explicit CodecPool(unsigned nThreads) {
+    setConcurrency(nThreads);
+  }
+
+  // Waits for the running jobs, queued ones are dropped
+  ~CodecPool() {
+    std::unique_lock<std::mutex> lock(mutex);
+    target = 0;
+    wakeup.notify_all();
+    wakeup.wait(lock, [this] { return nThreads == 0; });
+  }
+
+  CodecPool(const CodecPool&) = delete;
+  CodecPool &operator=(const CodecPool&) = delete;
+
+  void submit(CodecPriority priority, std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      queues[priority].push_back({ std::move(task), Clock::now() });
+      stats[priority].queued++;
+    }
+    wakeup.notify_all();
+  }
+
+  // Extra threads exit once they finish their current job
+  void setConcurrency(unsigned n) {
+    std::lock_guard<std::mutex> lock(mutex);
+    target = std::max(1u, n);
+    while (nThreads < target) {
+      nThreads++;
+      std::thread([this] { run(); }).detach();
+    }
+    wakeup.notify_all();
+  }
+
+  unsigned concurrency() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return target;
+  }
+
+  CodecPoolStats getStats(CodecPriority priority) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats[priority];
+  }
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Job {
+    std::function<void()> task;
+    Clock::time_point queuedAt;
+  };
+
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::deque<Job> queues[PRIORITY_COUNT];
+  CodecPoolStats stats[PRIORITY_COUNT];
+  unsigned nThreads = 0;
+  unsigned target = 0;
+
+  // Called with the mutex held, PRIORITY_COUNT when there's nothing this thread may take
+  int nextPriority() const {
+    if (!queues[PRIORITY_INTERACTIVE].empty()) return PRIORITY_INTERACTIVE;
+    unsigned backgroundLimit = std::max(1u, target - 1);
+    if (!queues[PRIORITY_BACKGROUND].empty() && stats[PRIORITY_BACKGROUND].active < backgroundLimit) return PRIORITY_BACKGROUND;
+    return PRIORITY_COUNT;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      int priority;
+      wakeup.wait(lock, [this, &priority] {
+        priority = nextPriority();
+        return priority != PRIORITY_COUNT || nThreads > target;
+      });
+      if (nThreads > target) {
+        nThreads--;
+        wakeup.notify_all();
+        return;
+      }
+
+      Job job = std::move(queues[priority].front());
+      queues[priority].pop_front();
+      CodecPoolStats &s = stats[priority];
+      s.queued--;
+      s.active++;
+      lock.unlock();
+
+      Clock::time_point start = Clock::now();
+      job.task();
+      Clock::time_point end = Clock::now();
+
+      lock.lock();
+      double wait = std::chrono::duration<double, std::milli>(start - job.queuedAt).count();
+      s.active--;
+      s.completed++;
+      s.waitTime += wait;
+      s.runTime += std::chrono::duration<double, std::milli>(end - start).count();
+      s.maxWaitTime = std::max(s.maxWaitTime, wait);
+      // a finished background job may unblock another one
+      if (priority == PRIORITY_BACKGROUND) wakeup.notify_all();
+    }
+  }
+};
+
+// One thread per core by default, created on first use. Never destroyed, jobs may still be running at exit.
+static CodecPool &codec_pool() {
+  static CodecPool *pool = new CodecPool(std::thread::hardware_concurrency());
+  return *pool;
+}
@@ -0,0 +1,121 @@
+// QOI ("Quite OK Image") encoder, see https://qoiformat.org/qoi-specification.pdf
+// For scratch storage between pipeline stages: a single pass over the pixels, no entropy coding, no checksums.
+// The decoder, read_qoi(), is in png.h with the other readers.
+#pragma once
+
+#include <cstring>
+#include "./png.h"
+
+#define QOI_RUN_MAX 62
+
+struct QoiWriteClosure {
+  uint32_t width;
+  uint32_t height;
+  uint8_t *data; // RGBA
+  size_t stride = 0; // bytes from one row of data to the next, 0 = width * 4
+  Nan::Persistent<v8::Value> dataRef;
+  AbortFlag abort;
+  error_status status = ES_SUCCESS;
+
+  // output, malloc'd
+  uint8_t *output = nullptr;
+  size_t outputLength = 0;
+};
+
+static inline void qoi_put_be32(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+static error_status write_qoi(QoiWriteClosure *closure) {
+  uint32_t width = closure->width;
+  uint32_t height = closure->height;
+  if (width == 0 || height == 0 || (uint64_t)width * height > QOI_PIXELS_MAX) return ES_INVALID_FORMAT;
+  if (aborted(closure->abort)) return ES_ABORTED;
+  size_t stride = closure->stride ? closure->stride : (size_t)width * 4;
+
+  // Worst case: every pixel an RGBA op. Only the pages that get written are ever touched.
+  size_t capacity = QOI_HEADER_SIZE + (size_t)width * height * 5 + sizeof(qoi_padding);
+  uint8_t *output = (uint8_t*)malloc(capacity);
+  if (!output) return ES_NO_MEMORY;
+
+  uint8_t *out = output + QOI_HEADER_SIZE;
+  uint32_t index[64] = { 0 };
+  uint32_t prev = 0xff000000u; // opaque black, pixels are loaded little endian: R in the low byte
+  uint32_t run = 0;
+  uint32_t alphaAnd = 0xffffffffu;
+
+  for (uint32_t y = 0; y < height; y++) {
+    if (aborted(closure->abort)) {
+      free(output);
+      return ES_ABORTED;
+    }
+    const uint8_t *row = closure->data + y * stride;
+    for (uint32_t x = 0; x < width; x++) {
+      uint32_t px;
+      memcpy(&px, row + (size_t)x * 4, 4);
+      if (px == prev) {
+        // scan the rest of the run in one go
+        uint32_t end = x + 1;
+        while (end < width && memcmp(row + (size_t)end * 4, &prev, 4) == 0) end++;
+        run += end - x;
+        x = end - 1;
+        while (run >= QOI_RUN_MAX) {
+          *out++ = QOI_OP_RUN | (QOI_RUN_MAX - 1);
+          run -= QOI_RUN_MAX;
+        }
+        continue;
+      }
+      if (run) {
+        *out++ = QOI_OP_RUN | (run - 1);
+        run = 0;
+      }
+      alphaAnd &= px;
+
+      uint32_t hash = qoi_hash(px);
+      if (index[hash] == px) {
+        *out++ = QOI_OP_INDEX | hash;
+      } else if ((px ^ prev) >> 24) {
+        index[hash] = px;
+        *out++ = QOI_OP_RGBA;
+        memcpy(out, &px, 4);
+        out += 4;
+      } else {
+        index[hash] = px;
+        int8_t dr = (int8_t)(px - prev);
+        int8_t dg = (int8_t)((px >> 8) - (prev >> 8));
+        int8_t db = (int8_t)((px >> 16) - (prev >> 16));
+        int8_t drg = (int8_t)(dr - dg), dbg = (int8_t)(db - dg);
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+          *out++ = (uint8_t)(QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+          *out++ = (uint8_t)(QOI_OP_LUMA | (dg + 32));
+          *out++ = (uint8_t)((drg + 8) << 4 | (dbg + 8));
+        } else {
+          *out++ = QOI_OP_RGB;
+          memcpy(out, &px, 3);
+          out += 3;
+        }
+      }
+      prev = px;
+    }
+  }
+  if (run) *out++ = QOI_OP_RUN | (run - 1);
+  memcpy(out, qoi_padding, sizeof(qoi_padding));
+  out += sizeof(qoi_padding);
+
+  // the channel count is informational, 3 tells readers the image is opaque
+  bool opaque = (alphaAnd >> 24) == 0xff;
+  memcpy(output, "qoif", 4);
+  qoi_put_be32(output + 4, width);
+  qoi_put_be32(output + 8, height);
+  output[12] = opaque ? 3 : 4;
+  output[13] = 0; // sRGB with linear alpha
+
+  closure->outputLength = out - output;
+  uint8_t *shrunk = (uint8_t*)realloc(output, closure->outputLength);
+  closure->output = shrunk ? shrunk : output;
+  return ES_SUCCESS;
+}
@@ -0,0 +1,850 @@
+// Lossless WebP (VP8L) encoder, see
+// https://developers.google.com/speed/webp/docs/webp_lossless_bitstream_specification
+// Transforms: subtract green + spatial prediction for photos, a color table (with pixel bundling) for images with
+// up to 256 colors. The pixels are then LZ77 coded with an optional color cache and one set of prefix codes.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "./png.h"
+
+#define VP8L_MAX_DIMENSION 16384
+#define VP8L_MAX_LENGTH 4096
+#define VP8L_WINDOW ((1 << 20) - 120)
+#define VP8L_NUM_LENGTH_CODES 24
+#define VP8L_NUM_DISTANCE_CODES 40
+#define VP8L_MAX_CODE_LENGTH 15
+
+struct WebpWriteClosure {
+  uint32_t width;
+  uint32_t height;
+  uint8_t *data; // RGBA
+  Nan::Persistent<v8::Value> dataRef;
+  Nan::Callback cb;
+  uint32_t effort = 4; // 0 (fastest) - 9 (smallest)
+  AbortFlag abort;
+  error_status status = ES_SUCCESS;
+
+  std::unique_ptr<std::vector<uint8_t>> output;
+};
+
+// How hard each effort level tries
+struct Vp8lParams {
+  int predictorBits; // log2 of the predictor tile size, 0 = no predictor
+  int numModes; // predictor modes tried per tile, from vp8l_mode_order
+  int chainLength; // hash chain candidates per position, 0 = only the left and upper pixels
+  bool lazy; // lazy matching: take a literal when the next position has a longer match
+  int maxCacheBits; // color cache sizes tried: none, then 6 bits and every other size up to this one
+};
+
+static Vp8lParams vp8l_params(uint32_t effort) {
+  static const Vp8lParams params[10] = {
+    { 9, 1, 0, false, 0 },
+    { 5, 4, 4, false, 6 },
+    { 5, 6, 8, false, 8 },
+    { 4, 8, 12, false, 10 },
+    { 4, 14, 16, false, 10 },
+    { 4, 14, 32, false, 10 },
+    { 4, 14, 64, true, 10 },
+    { 3, 14, 128, true, 10 },
+    { 3, 14, 256, true, 10 },
+    { 3, 14, 1024, true, 10 },
+  };
+  return params[std::min(effort, 9u)];
+}
+
+// Most useful modes first, effort levels that don't try them all take the front of the list
+static const uint8_t vp8l_mode_order[14] = { 2, 1, 11, 12, 7, 13, 5, 10, 0, 3, 4, 6, 8, 9 };
+
+// LSB first, like the decoder reads. Appends to out, which is only resized to its final size by flush().
+class Vp8lBitWriter {
+ public:
+  explicit Vp8lBitWriter(std::vector<uint8_t> &out) : out(out), pos(out.size()) {}
+
+  // n <= 32
+  void put(uint32_t value, int n) {
+    bits |= (uint64_t)value << used;
+    used += n;
+    if (used >= 32) {
+      if (pos + 4 > out.size()) out.resize(std::max(out.size() * 2, (size_t)256));
+      uint8_t *p = out.data() + pos;
+      p[0] = (uint8_t)bits;
+      p[1] = (uint8_t)(bits >> 8);
+      p[2] = (uint8_t)(bits >> 16);
+      p[3] = (uint8_t)(bits >> 24);
+      pos += 4;
+      bits >>= 32;
+      used -= 32;
+    }
+  }
+
+  void flush() {
+    out.resize(pos + (used + 7) / 8);
+    for (; used > 0; used -= 8) {
+      out[pos++] = (uint8_t)bits;
+      bits >>= 8;
+    }
+    bits = 0;
+    used = 0;
+  }
+
+ private:
+  std::vector<uint8_t> &out;
+  size_t pos;
+  uint64_t bits = 0;
+  int used = 0;
+};
+
+static inline int vp8l_log2_floor(uint32_t n) {
+  int log = 0;
+  while (n >>= 1) log++;
+  return log;
+}
+
+// Lengths and distances are coded as a prefix symbol plus extra bits, value >= 1
+static inline void vp8l_prefix(uint32_t value, int *symbol, int *extraBits, uint32_t *extra) {
+  uint32_t n = value - 1;
+  if (n < 4) {
+    *symbol = (int)n;
+    *extraBits = 0;
+    *extra = 0;
+    return;
+  }
+  int high = vp8l_log2_floor(n);
+  int second = (n >> (high - 1)) & 1;
+  *symbol = 2 * high + second;
+  *extraBits = high - 1;
+  *extra = n & ((1u << (high - 1)) - 1);
+}
+
+// Distances to the 120 nearest pixels above and to the left have short codes. The table is the spec's,
+// as (dy << 4) | (8 - dx), dx being the distance to the left (negative: to the right).
+static const uint8_t vp8l_distance_map[120] = {
+  24, 7, 23, 25, 40, 6, 39, 41, 22, 26, 38, 42, 56, 5, 55, 57, 21, 27, 54, 58,
+  37, 43, 72, 4, 71, 73, 20, 28, 53, 59, 70, 74, 36, 44, 88, 69, 75, 52, 60, 3,
+  87, 89, 19, 29, 86, 90, 35, 45, 68, 76, 85, 91, 51, 61, 104, 2, 103, 105, 18, 30,
+  102, 106, 34, 46, 84, 92, 67, 77, 101, 107, 50, 62, 120, 1, 119, 121, 83, 93, 17, 31,
+  100, 108, 66, 78, 118, 122, 33, 47, 117, 123, 49, 63, 99, 109, 82, 94, 0, 116, 124, 65,
+  79, 16, 32, 98, 110, 48, 115, 125, 81, 95, 64, 114, 126, 97, 111, 80, 113, 127, 96, 112,
+};
+
+class Vp8lDistanceCodes {
+ public:
+  explicit Vp8lDistanceCodes(uint32_t width) : width(width) {
+    memset(plane, 0, sizeof(plane));
+    for (int i = 0; i < 120; i++) {
+      int dy = vp8l_distance_map[i] >> 4;
+      int dx = 8 - (vp8l_distance_map[i] & 15);
+      plane[dy][dx + 7] = (uint8_t)(i + 1);
+    }
+  }
+
+  // Pixel distance -> distance code, 1-120 for the neighborhood, distance + 120 otherwise
+  uint32_t code(uint32_t dist) const {
+    uint32_t dy = dist / width;
+    uint32_t dx = dist % width;
+    if (dy <= 7 && dx <= 8 && plane[dy][dx + 7]) return plane[dy][dx + 7];
+    if (dy < 7 && width - dx <= 7 && plane[dy + 1][7 - (width - dx)]) return plane[dy + 1][7 - (width - dx)];
+    return dist + 120;
+  }
+
+ private:
+  uint32_t width;
+  uint8_t plane[8][16]; // [dy][dx + 7]
+};
+
+// prefix codes
+
+struct Vp8lCode {
+  std::vector<uint8_t> lengths;
+  std::vector<uint16_t> codes; // bit reversed, ready for the LSB first writer
+};
+
+// Huffman code lengths of at most limit bits. Unused symbols get 0, a single used symbol gets 1.
+// Too deep trees are rebuilt with the small counts raised, which flattens them.
+static void vp8l_huffman_lengths(const uint32_t *counts, int n, int limit, uint8_t *lengths) {
+  memset(lengths, 0, n);
+  std::vector<int> symbols;
+  for (int i = 0; i < n; i++) {
+    if (counts[i]) symbols.push_back(i);
+  }
+  if (symbols.size() <= 1) {
+    if (symbols.size() == 1) lengths[symbols[0]] = 1;
+    return;
+  }
+
+  size_t m = symbols.size();
+  std::vector<uint64_t> weight(2 * m - 1);
+  std::vector<int> parent(2 * m - 1);
+  std::vector<int> depth(2 * m - 1);
+  for (uint32_t minCount = 1;; minCount *= 2) {
+    std::sort(symbols.begin(), symbols.end(), [&](int a, int b) {
+      uint32_t ca = std::max(counts[a], minCount), cb = std::max(counts[b], minCount);
+      return ca != cb ? ca < cb : a < b;
+    });
+    for (size_t i = 0; i < m; i++) weight[i] = std::max(counts[symbols[i]], minCount);
+
+    // two queues: sorted leaves and internal nodes, which are created in increasing weight order
+    size_t leaf = 0, node = m, next = m;
+    auto take = [&]() {
+      if (leaf < m && (node >= next || weight[leaf] <= weight[node])) return leaf++;
+      return node++;
+    };
+    for (; next < 2 * m - 1; next++) {
+      size_t a = take(), b = take();
+      weight[next] = weight[a] + weight[b];
+      parent[a] = parent[b] = (int)next;
+    }
+
+    int maxDepth = 0;
+    depth[2 * m - 2] = 0;
+    for (size_t i = 2 * m - 2; i-- > 0;) {
+      depth[i] = depth[parent[i]] + 1;
+      if (i < m) maxDepth = std::max(maxDepth, depth[i]);
+    }
+    if (maxDepth <= limit) {
+      for (size_t i = 0; i < m; i++) lengths[symbols[i]] = (uint8_t)depth[i];
+      return;
+    }
+  }
+}
+
+// Two symbols of length 1 instead of one, decoders want complete codes
+static void vp8l_pad_single(uint8_t *lengths, int n) {
+  int used = -1;
+  for (int i = 0; i < n; i++) {
+    if (lengths[i]) {
+      if (used >= 0) return;
+      used = i;
+    }
+  }
+  if (used < 0) return;
+  lengths[used] = 1;
+  lengths[used == 0 ? 1 : 0] = 1;
+}
+
+static void vp8l_canonical_codes(const uint8_t *lengths, int n, uint16_t *codes) {
+  int count[VP8L_MAX_CODE_LENGTH + 1] = { 0 };
+  for (int i = 0; i < n; i++) count[lengths[i]]++;
+  count[0] = 0;
+  int next[VP8L_MAX_CODE_LENGTH + 1];
+  int code = 0;
+  for (int bits = 1; bits <= VP8L_MAX_CODE_LENGTH; bits++) {
+    code = (code + count[bits - 1]) << 1;
+    next[bits] = code;
+  }
+  for (int i = 0; i < n; i++) {
+    int len = lengths[i];
+    if (!len) continue;
+    int c = next[len]++;
+    int reversed = 0;
+    for (int b = 0; b < len; b++) reversed |= ((c >> b) & 1) << (len - 1 - b);
+    codes[i] = (uint16_t)reversed;
+  }
+}
+
+static const uint8_t vp8l_code_length_order[19] = { 17, 18, 0, 1, 2, 3, 4, 5, 16, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+
+// Builds the code for counts and writes it, as a simple code (one or two symbols below 256) when possible.
+static void vp8l_store_code(Vp8lBitWriter &bw, const uint32_t *counts, int n, Vp8lCode *code) {
+  code->lengths.assign(n, 0);
+  code->codes.assign(n, 0);
+  int used[3], nUsed = 0;
+  for (int i = 0; i < n && nUsed < 3; i++) {
+    if (counts[i]) used[nUsed++] = i;
+  }
+
+  if (nUsed == 0 || (nUsed <= 2 && used[nUsed - 1] < 256)) {
+    int s0 = nUsed ? used[0] : 0;
+    bw.put(1, 1);
+    bw.put(nUsed == 2, 1);
+    if (s0 < 2) {
+      bw.put(0, 1);
+      bw.put(s0, 1);
+    } else {
+      bw.put(1, 1);
+      bw.put(s0, 8);
+    }
+    if (nUsed == 2) {
+      // canonical order: the smaller symbol gets code 0
+      bw.put(used[1], 8);
+      code->lengths[used[0]] = code->lengths[used[1]] = 1;
+      code->codes[used[1]] = 1;
+    }
+    return;
+  }
+
+  vp8l_huffman_lengths(counts, n, VP8L_MAX_CODE_LENGTH, code->lengths.data());
+  vp8l_pad_single(code->lengths.data(), n);
+  vp8l_canonical_codes(code->lengths.data(), n, code->codes.data());
+
+  // code lengths, run length coded: 16 repeats the previous length 3-6 times, 17 and 18 are 3-10 and 11-138 zeros
+  std::vector<std::pair<uint8_t, uint8_t>> tokens;
+  const uint8_t *lengths = code->lengths.data();
+  for (int i = 0; i < n;) {
+    int value = lengths[i];
+    int run = 1;
+    while (i + run < n && lengths[i + run] == value) run++;
+    i += run;
+    if (value == 0) {
+      while (run >= 11) {
+        int r = std::min(run, 138);
+        tokens.push_back({ 18, (uint8_t)(r - 11) });
+        run -= r;
+      }
+      if (run >= 3) {
+        tokens.push_back({ 17, (uint8_t)(run - 3) });
+        run = 0;
+      }
+    } else {
+      tokens.push_back({ (uint8_t)value, 0 });
+      run--;
+      while (run >= 3) {
+        int r = std::min(run, 6);
+        tokens.push_back({ 16, (uint8_t)(r - 3) });
+        run -= r;
+      }
+    }
+    for (; run > 0; run--) tokens.push_back({ (uint8_t)value, 0 });
+  }
+
+  uint32_t clCounts[19] = { 0 };
+  for (auto &token : tokens) clCounts[token.first]++;
+  uint8_t clLengths[19];
+  uint16_t clCodes[19] = { 0 };
+  vp8l_huffman_lengths(clCounts, 19, 7, clLengths);
+  vp8l_pad_single(clLengths, 19);
+  vp8l_canonical_codes(clLengths, 19, clCodes);
+
+  int numCodeLengths = 4;
+  for (int i = 0; i < 19; i++) {
+    if (clLengths[vp8l_code_length_order[i]]) numCodeLengths = std::max(numCodeLengths, i + 1);
+  }
+  bw.put(0, 1);
+  bw.put(numCodeLengths - 4, 4);
+  for (int i = 0; i < numCodeLengths; i++) bw.put(clLengths[vp8l_code_length_order[i]], 3);
+  bw.put(0, 1); // max_symbol: all of them
+
+  static const int extraBits[3] = { 2, 3, 7 };
+  for (auto &token : tokens) {
+    bw.put(clCodes[token.first], clLengths[token.first]);
+    if (token.first >= 16) bw.put(token.second, extraBits[token.first - 16]);
+  }
+}
+
+// LZ77
+
+struct Vp8lToken {
+  uint32_t length; // 0 = one literal pixel
+  uint32_t value; // copy: distance code, literal: color cache index + 1 once the cache is applied, else 0
+};
+
+static inline uint32_t vp8l_match_length(const uint32_t *argb, size_t pos, size_t ref, size_t maxLength) {
+  size_t len = 0;
+  while (len < maxLength && argb[pos + len] == argb[ref + len]) len++;
+  return (uint32_t)len;
+}
+
+static void vp8l_lz77(const uint32_t *argb, uint32_t width, size_t n, const Vp8lParams &params, std::vector<Vp8lToken> &tokens) {
+  const uint32_t MIN_LENGTH = 3;
+  const int HASH_BITS = 16;
+  Vp8lDistanceCodes distances(width);
+  std::vector<int32_t> head, chain;
+  if (params.chainLength) {
+    head.assign(1 << HASH_BITS, -1);
+    chain.resize(n);
+  }
+  auto hash = [&](size_t i) {
+    return (uint32_t)((argb[i] * 0x1e35a7bdu + argb[i + 1] * 0x9e3779b1u) >> (32 - HASH_BITS));
+  };
+  auto insert = [&](size_t i) {
+    if (i + 1 >= n) return;
+    uint32_t h = hash(i);
+    chain[i] = head[h];
+    head[h] = (int32_t)i;
+  };
+
+  // longest match at pos, the left and upper pixels first: their distance codes are the shortest
+  auto find = [&](size_t pos, uint32_t *bestDist) {
+    size_t maxLength = std::min((size_t)VP8L_MAX_LENGTH, n - pos);
+    uint32_t best = 0;
+    if (pos >= 1 && argb[pos] == argb[pos - 1]) {
+      best = vp8l_match_length(argb, pos, pos - 1, maxLength);
+      *bestDist = 1;
+    }
+    if (pos >= width && best < maxLength && argb[pos + best] == argb[pos + best - width]) {
+      uint32_t len = vp8l_match_length(argb, pos, pos - width, maxLength);
+      if (len > best) {
+        best = len;
+        *bestDist = width;
+      }
+    }
+    if (params.chainLength && pos + 1 < n && best < maxLength) {
+      int steps = params.chainLength;
+      for (int32_t ref = head[hash(pos)]; ref >= 0 && steps-- > 0; ref = chain[ref]) {
+        if (pos - ref > VP8L_WINDOW) break;
+        if (argb[ref + best] != argb[pos + best]) continue;
+        uint32_t len = vp8l_match_length(argb, pos, ref, maxLength);
+        if (len > best) {
+          best = len;
+          *bestDist = (uint32_t)(pos - ref);
+          if (len == maxLength) break;
+        }
+      }
+    }
+    return best;
+  };
+
+  tokens.clear();
+  tokens.reserve(n);
+  for (size_t pos = 0; pos < n;) {
+    uint32_t dist = 0;
+    uint32_t len = find(pos, &dist);
+    if (len >= MIN_LENGTH && params.lazy && pos + 1 < n) {
+      if (params.chainLength) insert(pos);
+      uint32_t nextDist = 0;
+      if (find(pos + 1, &nextDist) > len + 1) len = 0;
+    } else if (params.chainLength) {
+      insert(pos);
+    }
+
+    if (len < MIN_LENGTH) {
+      tokens.push_back({ 0, 0 });
+      pos++;
+      continue;
+    }
+    tokens.push_back({ len, distances.code(dist) });
+    if (params.chainLength) {
+      for (size_t i = pos + 1; i < pos + len; i++) insert(i);
+    }
+    pos += len;
+  }
+}
+
+// entropy coding
+
+static inline uint32_t vp8l_cache_index(uint32_t argb, int bits) {
+  return (argb * 0x1e35a7bdu) >> (32 - bits);
+}
+
+struct Vp8lHistograms {
+  std::vector<uint32_t> green; // 256 literals, 24 length codes, the cache
+  uint32_t red[256], blue[256], alpha[256], distance[VP8L_NUM_DISTANCE_CODES];
+
+  explicit Vp8lHistograms(int cacheBits) : green(256 + VP8L_NUM_LENGTH_CODES + (cacheBits ? 1 << cacheBits : 0), 0) {
+    memset(red, 0, sizeof(red));
+    memset(blue, 0, sizeof(blue));
+    memset(alpha, 0, sizeof(alpha));
+    memset(distance, 0, sizeof(distance));
+  }
+};
+
+// Walks the tokens like the decoder would, with a color cache of cacheBits. apply stores the cache hits in the tokens.
+static void vp8l_histograms(const uint32_t *argb, std::vector<Vp8lToken> &tokens, int cacheBits, bool apply, Vp8lHistograms *h) {
+  std::vector<uint32_t> cache(cacheBits ? 1 << cacheBits : 0, 0);
+  size_t pos = 0;
+  for (auto &token : tokens) {
+    if (token.length == 0) {
+      uint32_t color = argb[pos++];
+      if (cacheBits) {
+        uint32_t index = vp8l_cache_index(color, cacheBits);
+        if (cache[index] == color) {
+          h->green[256 + VP8L_NUM_LENGTH_CODES + index]++;
+          if (apply) token.value = index + 1;
+          continue;
+        }
+        cache[index] = color;
+        if (apply) token.value = 0;
+      }
+      h->green[(color >> 8) & 0xff]++;
+      h->red[(color >> 16) & 0xff]++;
+      h->blue[color & 0xff]++;
+      h->alpha[color >> 24]++;
+      continue;
+    }
+
+    int symbol, extraBits;
+    uint32_t extra;
+    vp8l_prefix(token.length, &symbol, &extraBits, &extra);
+    h->green[256 + symbol]++;
+    vp8l_prefix(token.value, &symbol, &extraBits, &extra);
+    h->distance[symbol]++;
+    if (cacheBits) {
+      for (uint32_t i = 0; i < token.length; i++) cache[vp8l_cache_index(argb[pos + i], cacheBits)] = argb[pos + i];
+    }
+    pos += token.length;
+  }
+}
+
+// Shannon estimate of the coded size in bits, plus a rough cost per symbol in the code header
+static double vp8l_entropy(const uint32_t *counts, size_t n) {
+  double bits = 0;
+  uint64_t total = 0;
+  int used = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!counts[i]) continue;
+    bits -= counts[i] * std::log2((double)counts[i]);
+    total += counts[i];
+    used++;
+  }
+  if (total) bits += total * std::log2((double)total);
+  return bits + used * 4;
+}
+
+static double vp8l_cost(const Vp8lHistograms &h) {
+  return vp8l_entropy(h.green.data(), h.green.size()) + vp8l_entropy(h.red, 256) + vp8l_entropy(h.blue, 256) +
+    vp8l_entropy(h.alpha, 256) + vp8l_entropy(h.distance, VP8L_NUM_DISTANCE_CODES);
+}
+
+// Writes an image: color cache info, [meta prefix codes flag,] the five prefix codes and the pixels.
+// Sub-images (transform data) have no meta prefix codes flag.
+static void vp8l_encode_image(Vp8lBitWriter &bw, const uint32_t *argb, uint32_t width, uint32_t height,
+                              const Vp8lParams &params, bool main) {
+  size_t n = (size_t)width * height;
+  std::vector<Vp8lToken> tokens;
+  vp8l_lz77(argb, width, n, params, tokens);
+
+  int cacheBits = 0;
+  double bestCost = 0;
+  for (int bits = 0; params.maxCacheBits && bits <= params.maxCacheBits; bits += bits ? 2 : std::min(params.maxCacheBits, 6)) {
+    Vp8lHistograms h(bits);
+    vp8l_histograms(argb, tokens, bits, false, &h);
+    double cost = vp8l_cost(h);
+    if (bits == 0 || cost < bestCost) {
+      bestCost = cost;
+      cacheBits = bits;
+    }
+  }
+
+  Vp8lHistograms h(cacheBits);
+  vp8l_histograms(argb, tokens, cacheBits, true, &h);
+
+  bw.put(cacheBits > 0, 1);
+  if (cacheBits) bw.put(cacheBits, 4);
+  if (main) bw.put(0, 1);
+
+  Vp8lCode green, red, blue, alpha, distance;
+  vp8l_store_code(bw, h.green.data(), (int)h.green.size(), &green);
+  vp8l_store_code(bw, h.red, 256, &red);
+  vp8l_store_code(bw, h.blue, 256, &blue);
+  vp8l_store_code(bw, h.alpha, 256, &alpha);
+  vp8l_store_code(bw, h.distance, VP8L_NUM_DISTANCE_CODES, &distance);
+
+  size_t pos = 0;
+  for (auto &token : tokens) {
+    if (token.length == 0) {
+      uint32_t color = argb[pos++];
+      if (token.value) {
+        int symbol = 256 + VP8L_NUM_LENGTH_CODES + token.value - 1;
+        bw.put(green.codes[symbol], green.lengths[symbol]);
+        continue;
+      }
+      // two codes of at most 15 bits per put
+      uint32_t g = (color >> 8) & 0xff, r = (color >> 16) & 0xff, b = color & 0xff, a = color >> 24;
+      bw.put(green.codes[g] | (uint32_t)red.codes[r] << green.lengths[g], green.lengths[g] + red.lengths[r]);
+      bw.put(blue.codes[b] | (uint32_t)alpha.codes[a] << blue.lengths[b], blue.lengths[b] + alpha.lengths[a]);
+      continue;
+    }
+
+    int symbol, extraBits;
+    uint32_t extra;
+    vp8l_prefix(token.length, &symbol, &extraBits, &extra);
+    bw.put(green.codes[256 + symbol], green.lengths[256 + symbol]);
+    bw.put(extra, extraBits);
+    vp8l_prefix(token.value, &symbol, &extraBits, &extra);
+    bw.put(distance.codes[symbol], distance.lengths[symbol]);
+    bw.put(extra, extraBits);
+    pos += token.length;
+  }
+}
+
+// transforms
+
+static inline uint32_t vp8l_sub_pixels(uint32_t a, uint32_t b) {
+  uint32_t alphaAndGreen = 0x00ff00ffu + (a & 0xff00ff00u) - (b & 0xff00ff00u);
+  uint32_t redAndBlue = 0xff00ff00u + (a & 0x00ff00ffu) - (b & 0x00ff00ffu);
+  return (alphaAndGreen & 0xff00ff00u) | (redAndBlue & 0x00ff00ffu);
+}
+
+static inline uint32_t vp8l_average2(uint32_t a, uint32_t b) {
+  return (((a ^ b) & 0xfefefefeu) >> 1) + (a & b);
+}
+
+static inline int vp8l_channel(uint32_t argb, int shift) {
+  return (argb >> shift) & 0xff;
+}
+
+static inline uint32_t vp8l_select(uint32_t left, uint32_t top, uint32_t topLeft) {
+  int pLeft = 0, pTop = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int estimate = vp8l_channel(left, shift) + vp8l_channel(top, shift) - vp8l_channel(topLeft, shift);
+    pLeft += std::abs(estimate - vp8l_channel(left, shift));
+    pTop += std::abs(estimate - vp8l_channel(top, shift));
+  }
+  return pLeft < pTop ? left : top;
+}
+
+static inline uint32_t vp8l_clamp_add_subtract_full(uint32_t a, uint32_t b, uint32_t c) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int value = vp8l_channel(a, shift) + vp8l_channel(b, shift) - vp8l_channel(c, shift);
+    result |= (uint32_t)std::min(255, std::max(0, value)) << shift;
+  }
+  return result;
+}
+
+static inline uint32_t vp8l_clamp_add_subtract_half(uint32_t a, uint32_t b) {
+  uint32_t result = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int value = vp8l_channel(a, shift) + (vp8l_channel(a, shift) - vp8l_channel(b, shift)) / 2;
+    result |= (uint32_t)std::min(255, std::max(0, value)) << shift;
+  }
+  return result;
+}
+
+// Prediction for a pixel that is neither on the first row nor in the first column
+static inline uint32_t vp8l_predict(int mode, uint32_t left, uint32_t top, uint32_t topRight, uint32_t topLeft) {
+  switch (mode) {
+    case 0: return 0xff000000u;
+    case 1: return left;
+    case 2: return top;
+    case 3: return topRight;
+    case 4: return topLeft;
+    case 5: return vp8l_average2(vp8l_average2(left, topRight), top);
+    case 6: return vp8l_average2(left, topLeft);
+    case 7: return vp8l_average2(left, top);
+    case 8: return vp8l_average2(topLeft, top);
+    case 9: return vp8l_average2(top, topRight);
+    case 10: return vp8l_average2(vp8l_average2(left, topLeft), vp8l_average2(top, topRight));
+    case 11: return vp8l_select(left, top, topLeft);
+    case 12: return vp8l_clamp_add_subtract_full(left, top, topLeft);
+    default: return vp8l_clamp_add_subtract_half(vp8l_average2(left, top), topLeft);
+  }
+}
+
+// Small residuals are cheap, whatever their sign
+static inline uint32_t vp8l_residual_cost(uint32_t residual) {
+  uint32_t cost = 0;
+  for (int shift = 0; shift < 32; shift += 8) {
+    int value = (int8_t)(residual >> shift);
+    cost += std::abs(value);
+  }
+  return cost;
+}
+
+// Replaces argb with the prediction residuals, picking a mode per tile. modes gets the tile image (mode in green).
+static void vp8l_predictor_transform(std::vector<uint32_t> &argb, uint32_t width, uint32_t height, const Vp8lParams &params,
+                                     std::vector<uint32_t> &modes, uint32_t *tilesX) {
+  int bits = params.predictorBits;
+  uint32_t tileSize = 1u << bits;
+  *tilesX = (width + tileSize - 1) >> bits;
+  uint32_t tilesY = (height + tileSize - 1) >> bits;
+  modes.assign((size_t)*tilesX * tilesY, 0);
+  const uint32_t *src = argb.data();
+  std::vector<uint32_t> residual(argb.size());
+
+  for (uint32_t ty = 0; ty < tilesY; ty++) {
+    for (uint32_t tx = 0; tx < *tilesX; tx++) {
+      uint32_t x0 = tx << bits, y0 = ty << bits;
+      uint32_t x1 = std::min(x0 + tileSize, width), y1 = std::min(y0 + tileSize, height);
+
+      int bestMode = vp8l_mode_order[0];
+      if (params.numModes > 1) {
+        uint64_t bestCost = UINT64_MAX;
+        for (int m = 0; m < params.numModes; m++) {
+          int mode = vp8l_mode_order[m];
+          uint64_t cost = 0;
+          for (uint32_t y = std::max(y0, 1u); y < y1 && cost < bestCost; y++) {
+            const uint32_t *row = src + (size_t)y * width;
+            const uint32_t *top = row - width;
+            for (uint32_t x = std::max(x0, 1u); x < x1; x++) {
+              cost += vp8l_residual_cost(vp8l_sub_pixels(row[x], vp8l_predict(mode, row[x - 1], top[x], top[x + 1], top[x - 1])));
+            }
+          }
+          if (cost < bestCost) {
+            bestCost = cost;
+            bestMode = mode;
+          }
+        }
+      }
+      modes[(size_t)ty * *tilesX + tx] = 0xff000000u | ((uint32_t)bestMode << 8);
+
+      for (uint32_t y = y0; y < y1; y++) {
+        const uint32_t *row = src + (size_t)y * width;
+        const uint32_t *top = row - width;
+        uint32_t *out = residual.data() + (size_t)y * width;
+        for (uint32_t x = x0; x < x1; x++) {
+          uint32_t prediction;
+          if (y == 0) {
+            prediction = x == 0 ? 0xff000000u : row[x - 1];
+          } else if (x == 0) {
+            prediction = top[0];
+          } else {
+            // top[x + 1] is the first pixel of this row for the last column, as the spec says
+            prediction = vp8l_predict(bestMode, row[x - 1], top[x], top[x + 1], top[x - 1]);
+          }
+          out[x] = vp8l_sub_pixels(row[x], prediction);
+        }
+      }
+    }
+  }
+  argb.swap(residual);
+}
+
+// Up to 256 colors: returns false when there are more. The palette is sorted, which keeps its deltas small.
+static bool vp8l_palette(const std::vector<uint32_t> &argb, std::vector<uint32_t> &palette) {
+  const int TABLE_BITS = 11;
+  std::vector<uint32_t> table(1 << TABLE_BITS);
+  std::vector<bool> filled(1 << TABLE_BITS, false);
+  palette.clear();
+  uint32_t last = 0;
+  bool any = false;
+  for (uint32_t color : argb) {
+    if (any && color == last) continue;
+    any = true;
+    last = color;
+    uint32_t slot = vp8l_cache_index(color, TABLE_BITS);
+    while (filled[slot] && table[slot] != color) slot = (slot + 1) & ((1 << TABLE_BITS) - 1);
+    if (filled[slot]) continue;
+    if (palette.size() == 256) return false;
+    filled[slot] = true;
+    table[slot] = color;
+    palette.push_back(color);
+  }
+  std::sort(palette.begin(), palette.end());
+  return true;
+}
+
+// Replaces the pixels with palette indices, 2, 4 or 8 of them bundled in one pixel when the palette is small enough
+static void vp8l_color_indexing_transform(std::vector<uint32_t> &argb, uint32_t width, uint32_t height,
+                                          const std::vector<uint32_t> &palette, int bundleBits, uint32_t *packedWidth) {
+  uint32_t perPixel = 1u << bundleBits;
+  uint32_t bitsPerIndex = 8 >> bundleBits;
+  *packedWidth = (width + perPixel - 1) >> bundleBits;
+  std::vector<uint32_t> packed((size_t)*packedWidth * height);
+
+  uint32_t lastColor = palette[0], lastIndex = 0;
+  for (uint32_t y = 0; y < height; y++) {
+    const uint32_t *row = argb.data() + (size_t)y * width;
+    uint32_t *out = packed.data() + (size_t)y * *packedWidth;
+    for (uint32_t x = 0; x < *packedWidth; x++) {
+      uint32_t value = 0;
+      for (uint32_t i = 0; i < perPixel && x * perPixel + i < width; i++) {
+        uint32_t color = row[x * perPixel + i];
+        if (color != lastColor) {
+          lastIndex = (uint32_t)(std::lower_bound(palette.begin(), palette.end(), color) - palette.begin());
+          lastColor = color;
+        }
+        value |= lastIndex << (i * bitsPerIndex);
+      }
+      out[x] = 0xff000000u | (value << 8);
+    }
+  }
+  argb.swap(packed);
+}
+
+static void vp8l_put_le32(std::vector<uint8_t> &out, size_t pos, uint32_t value) {
+  out[pos] = (uint8_t)value;
+  out[pos + 1] = (uint8_t)(value >> 8);
+  out[pos + 2] = (uint8_t)(value >> 16);
+  out[pos + 3] = (uint8_t)(value >> 24);
+}
+
+// Appends the VP8L bitstream for argb (consumed) to out, with the color table when palette isn't null
+static error_status vp8l_encode(std::vector<uint32_t> &argb, uint32_t width, uint32_t height, bool hasAlpha,
+                                const std::vector<uint32_t> *palette, const Vp8lParams &params, const AbortFlag &abort,
+                                std::vector<uint8_t> &out) {
+  Vp8lBitWriter bw(out);
+  bw.put(0x2f, 8);
+  bw.put(width - 1, 14);
+  bw.put(height - 1, 14);
+  bw.put(hasAlpha, 1);
+  bw.put(0, 3);
+
+  // Sub-images are small, a quick LZ77 pass is all they need
+  Vp8lParams subParams = vp8l_params(0);
+
+  uint32_t codedWidth = width;
+  if (palette) {
+    size_t size = palette->size();
+    int bundleBits = size <= 2 ? 3 : size <= 4 ? 2 : size <= 16 ? 1 : 0;
+    std::vector<uint32_t> deltas(size);
+    for (size_t i = 0; i < size; i++) deltas[i] = i ? vp8l_sub_pixels((*palette)[i], (*palette)[i - 1]) : (*palette)[0];
+
+    bw.put(1, 1);
+    bw.put(3, 2); // COLOR_INDEXING_TRANSFORM
+    bw.put((uint32_t)size - 1, 8);
+    vp8l_encode_image(bw, deltas.data(), (uint32_t)size, 1, subParams, false);
+    vp8l_color_indexing_transform(argb, width, height, *palette, bundleBits, &codedWidth);
+  } else {
+    for (auto &color : argb) {
+      uint32_t green = (color >> 8) & 0xff;
+      color = (color & 0xff00ff00u) | ((((color >> 16) - green) & 0xff) << 16) | (((color & 0xff) - green) & 0xff);
+    }
+    bw.put(1, 1);
+    bw.put(2, 2); // SUBTRACT_GREEN
+
+    if (aborted(abort)) return ES_ABORTED;
+    std::vector<uint32_t> modes;
+    uint32_t tilesX;
+    vp8l_predictor_transform(argb, width, height, params, modes, &tilesX);
+    bw.put(1, 1);
+    bw.put(0, 2); // PREDICTOR_TRANSFORM
+    bw.put(params.predictorBits - 2, 3);
+    vp8l_encode_image(bw, modes.data(), tilesX, (uint32_t)(modes.size() / tilesX), subParams, false);
+  }
+  bw.put(0, 1); // no more transforms
+
+  if (aborted(abort)) return ES_ABORTED;
+  vp8l_encode_image(bw, argb.data(), codedWidth, height, params, true);
+  bw.flush();
+  return ES_SUCCESS;
+}
+
+static error_status write_webp_lossless(WebpWriteClosure *closure) {
+  uint32_t width = closure->width;
+  uint32_t height = closure->height;
+  if (width == 0 || height == 0 || width > VP8L_MAX_DIMENSION || height > VP8L_MAX_DIMENSION) return ES_INVALID_FORMAT;
+  if (aborted(closure->abort)) return ES_ABORTED;
+  Vp8lParams params = vp8l_params(closure->effort);
+
+  size_t n = (size_t)width * height;
+  std::vector<uint32_t> argb(n);
+  bool hasAlpha = false;
+  for (size_t i = 0; i < n; i++) {
+    const uint8_t *p = closure->data + i * 4;
+    argb[i] = ((uint32_t)p[3] << 24) | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+    hasAlpha |= p[3] != 0xff;
+  }
+
+  auto output = std::unique_ptr<std::vector<uint8_t>>(new std::vector<uint8_t>(20));
+  std::vector<uint32_t> palette;
+  error_status status;
+  if (!vp8l_palette(argb, palette)) {
+    status = vp8l_encode(argb, width, height, hasAlpha, nullptr, params, closure->abort, *output);
+  } else if (palette.size() <= 16 || (closure->effort < 5 && n > 65536)) {
+    status = vp8l_encode(argb, width, height, hasAlpha, &palette, params, closure->abort, *output);
+  } else {
+    // unbundled indices don't always beat prediction, try both when there's time or the image is small
+    std::vector<uint32_t> copy(argb);
+    std::vector<uint8_t> predicted(output->begin(), output->end());
+    status = vp8l_encode(argb, width, height, hasAlpha, &palette, params, closure->abort, *output);
+    if (!status) status = vp8l_encode(copy, width, height, hasAlpha, nullptr, params, closure->abort, predicted);
+    if (!status && predicted.size() < output->size()) output->swap(predicted);
+  }
+  if (status) return status;
+
+  // RIFF header, the chunk is padded to an even size
+  size_t payload = output->size() - 20;
+  if (payload & 1) output->push_back(0);
+  if (output->size() - 8 > UINT32_MAX) return ES_FAILED;
+  memcpy(output->data(), "RIFF\0\0\0\0WEBPVP8L", 16);
+  vp8l_put_le32(*output, 4, (uint32_t)(output->size() - 8));
+  vp8l_put_le32(*output, 16, (uint32_t)payload);
+
+  closure->output = std::move(output);
+  return ES_SUCCESS;
+}
@@ -0,0 +1,66 @@
+const { decodeAnimation, decode } = require('../');
+const fs = require('fs');
+const path = require('path');
+const assert = require('assert');
+
+async function collect(frames) {
+  const result = [];
+  for await (const frame of frames) result.push(frame);
+  return result;
+}
+
+function pixel(frame, x, y) {
+  const i = (y * frame.width + x) * 4;
+  return [...frame.data.subarray(i, i + 4)];
+}
+
+describe('decodeAnimation', () => {
+  const gif = fs.readFileSync(path.join(__dirname, 'anim.gif'));
+
+  it('composites frames with disposal and blending', async () => {
+    const frames = await collect(decodeAnimation(gif));
+    assert.deepStrictEqual(frames.map(frame => frame.index), [0, 1, 2, 3]);
+    assert.deepStrictEqual(frames.map(frame => frame.duration), [100, 200, 300, 40]);
+    assert.deepStrictEqual(frames.map(frame => frame.dirty), [
+      { x: 0, y: 0, w: 16, h: 16 },
+      { x: 4, y: 4, w: 8, h: 8 },
+      // the second frame restores what was under it
+      { x: 0, y: 0, w: 12, h: 12 },
+      // the third one restores the background
+      { x: 0, y: 0, w: 12, h: 12 },
+    ]);
+    assert(frames.every(frame => frame.width === 16 && frame.height === 16 && frame.loopCount === 0));
+
+    const red = [255, 0, 0, 255], green = [0, 255, 0, 255], blue = [0, 0, 255, 255], yellow = [255, 255, 0, 255];
+    assert.deepStrictEqual(pixel(frames[0], 5, 5), red);
+    assert.deepStrictEqual(pixel(frames[1], 5, 5), green);
+    assert.deepStrictEqual(pixel(frames[2], 5, 5), red);
+    assert.deepStrictEqual(pixel(frames[2], 0, 0), blue);
+    assert.deepStrictEqual(pixel(frames[3], 0, 0), [0, 0, 0, 0]);
+    assert.deepStrictEqual(pixel(frames[3], 8, 8), yellow);
+    // transparent pixels of a frame keep what is below
+    assert.deepStrictEqual(pixel(frames[3], 9, 8), red);
+  });
+
+  it('yields one frame for still images', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    const frames = await collect(decodeAnimation(png, { premultiplied: true }));
+    assert.strictEqual(frames.length, 1);
+    assert.strictEqual(frames[0].premultiplied, true);
+    assert.strictEqual(Buffer.compare(frames[0].data, (await decode(png, { premultiplied: true })).data), 0);
+  });
+
+  it('rejects invalid input', async () => {
+    await assert.rejects(() => collect(decodeAnimation(Buffer.from([1, 2, 3]))), /Unsupported image format/);
+    await assert.rejects(() => collect(decodeAnimation('x')), /Invalid arguments/);
+    await assert.rejects(() => collect(decodeAnimation(gif.subarray(0, 120))), /Image decoding failed/);
+  });
+
+  it('stops when aborted', async () => {
+    const controller = new AbortController();
+    const frames = decodeAnimation(gif, { signal: controller.signal });
+    assert.strictEqual((await frames.next()).value.index, 0);
+    controller.abort();
+    await assert.rejects(() => frames.next(), { name: 'AbortError' });
+  });
+});
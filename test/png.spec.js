@@ -1,4 +1,4 @@
-const { encodePNG, decodePNG, PNG_FILTER_NONE } = require('../');
+const { encodePNG, decodePNG, encodePNGSync, decodePNGSync, decodeSync, decode, decodeInto, createPNGDecoder, createPNGEncoder, decodeBatch, encodeBatch, probe, getDecodeStats, getBufferStats, setConcurrency, getPoolStats, premultiply, unpremultiply, swizzle, PNG_FILTER_NONE } = require('../');
 const fs = require('fs');
 const path = require('path');
 const assert = require('assert');
@@ -22,6 +22,88 @@ describe('encode / decode', () => {
     assert.strictEqual(buffer.toString('base64'), 'iVBORw0KGgoAAAANSUhEUgAAAAEAAAABCAYAAAAfFcSJAAAABWZkRUNSJJPjAOWrYpkAAAAQSURBVHgBAQUA+v8AAAAAAAAFAAFkeJU4AAAAAElFTkSuQmCC');
   });
 
+  it('encodes image with fastest encoder on multiple threads', async () => {
+    const width = 512, height = 512;
+    const data = Buffer.alloc(width * height * 4);
+    for (let i = 0; i < data.length; i++) data[i] = (i * 7 + (i >> 11)) & 0xff;
+    const buffer = await encodePNG(width, height, data, { compressionLevel: -1, threads: 4 });
+    const image = await decodePNG(buffer);
+    assert.strictEqual(image.width, width);
+    assert.strictEqual(image.height, height);
+    assert.strictEqual(Buffer.compare(image.data, data), 0);
+    for (const threads of [-1, 1.5, 257, '4']) {
+      await assert.rejects(() => encodePNG(width, height, data, { compressionLevel: -1, threads }), /threads must be/);
+    }
+  });
+
+  it('decodes fastest encoder output with fpng', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'semitransparent.nonpremul.data'));
+    for (const compressionLevel of [-1, 0]) {
+      const png = await encodePNG(128, 128, data, { compressionLevel });
+      const before = getDecodeStats();
+      const image = await decodePNG(png);
+      const premul = await decodePNG(png, { premultiplied: true });
+      assert.strictEqual(getDecodeStats().fpng, before.fpng + 2);
+      assert.strictEqual(getDecodeStats().wuffs, before.wuffs);
+      assert.strictEqual(Buffer.compare(image.data, data), 0);
+      const expected = fs.readFileSync(path.join(__dirname, 'semitransparent.premul.data'));
+      assert.strictEqual(Buffer.compare(premul.data, expected), 0);
+    }
+  });
+
+  it('encodes indexed image', async () => {
+    const palette = new Uint8ClampedArray([255, 0, 0, 255, 0, 255, 0, 255, 0, 0, 255, 128, 0, 0, 0, 0]);
+    const width = 64, height = 48;
+    const data = Buffer.alloc(width * height * 4);
+    for (let i = 0; i < width * height; i++) {
+      const color = ((i >> 3) + (i % width)) % 4;
+      palette.slice(color * 4, color * 4 + 4).forEach((c, j) => data[i * 4 + j] = c);
+    }
+    for (const compressionLevel of [-1, 6]) {
+      const buffer = await encodePNG(width, height, data, { palette, compressionLevel });
+      assert.strictEqual(probe(buffer).bitDepth, 2);
+      assert(buffer.length < (await encodePNG(width, height, data, { compressionLevel })).length);
+      const image = await decodePNG(buffer);
+      assert.strictEqual(Buffer.compare(image.data, data), 0);
+    }
+
+    data[0] = 1;
+    await assert.rejects(() => encodePNG(width, height, data, { palette }), /not in palette/);
+    assert.throws(() => encodePNGSync(1, 1, data.subarray(0, 4), { palette: new Uint8ClampedArray(257 * 4) }), /between 1 and 256/);
+  });
+
+  it('reduces the color type with optimizeColorType', async () => {
+    // IHDR color type: 0 gray, 2 RGB, 3 palette, 4 gray + alpha, 6 RGBA
+    const expected = { rgb: 2, gray: 0, gray_alpha: 4, pal: 3, rgba: 3 };
+    for (const [name, colorType] of Object.entries(expected)) {
+      const data = fs.readFileSync(path.join(__dirname, `${name}.data`));
+      const buffer = await encodePNG(32, 32, data, { optimizeColorType: true });
+      assert.strictEqual(buffer[25], colorType, name);
+      const image = await decodePNG(buffer);
+      assert.strictEqual(Buffer.compare(image.data, data), 0, name);
+    }
+  });
+
+  it('encodes opaque images with 3 channels in the fastest encoder', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'shino.data'));
+    const buffer = await encodePNG(200, 200, data, { compressionLevel: -1, optimizeColorType: true });
+    assert.strictEqual(buffer[25], 2);
+    assert(buffer.length < (await encodePNG(200, 200, data, { compressionLevel: -1 })).length);
+    const image = await decodePNG(buffer);
+    assert.strictEqual(Buffer.compare(image.data, data), 0);
+  });
+
+  it('reuses encoder scratch buffers', () => {
+    const data = fs.readFileSync(path.join(__dirname, 'shino.data'));
+    const expected = encodePNGSync(200, 200, data, { compressionLevel: -1 });
+    const before = getBufferStats();
+    for (let i = 0; i < 3; i++) {
+      assert.strictEqual(Buffer.compare(encodePNGSync(200, 200, data, { compressionLevel: -1 }), expected), 0);
+    }
+    const after = getBufferStats();
+    assert(after.reused - before.reused >= 3 * 200 * 200 * 4);
+  });
+
   it(`doesn't crash on bad file`, async () => {
     // this prints "libpng error: undefined" in console
     const png = fs.readFileSync(path.join(__dirname, `fail.png`));
@@ -100,3 +182,644 @@ describe('encode / decode', () => {
     })
   }
 });
+
+describe('sync encode / decode', () => {
+  it('throws on invalid arguments', () => {
+    assert.throws(() => encodePNGSync());
+    assert.throws(() => encodePNGSync(1, 1, Buffer.alloc(3)), /Invalid buffer size/);
+    assert.throws(() => decodePNGSync('x'));
+  });
+
+  it('throws on bad file', () => {
+    const png = fs.readFileSync(path.join(__dirname, `fail.png`));
+    assert.throws(() => decodePNGSync(png));
+    assert.throws(() => decodeSync(Buffer.from([0, 1, 2, 3])), /Unsupported image format/);
+  });
+
+  it('encodes the same output as encodePNG', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    for (const compressionLevel of [-1, 0, 6]) {
+      const expected = await encodePNG(32, 32, data, { compressionLevel });
+      assert.strictEqual(Buffer.compare(encodePNGSync(32, 32, data, { compressionLevel }), expected), 0);
+    }
+  });
+
+  it('decodes the same output as decodePNG', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'semitransparent.png'));
+    for (const premultiplied of [false, true]) {
+      const expected = await decodePNG(png, { premultiplied });
+      const image = decodeSync(png, { premultiplied });
+      assert.strictEqual(image.width, 128);
+      assert.strictEqual(image.height, 128);
+      assert.strictEqual(image.premultiplied, premultiplied);
+      assert.strictEqual(Buffer.compare(image.data, expected.data), 0);
+    }
+  });
+
+  it('loads in several worker threads at once', async () => {
+    const { Worker } = require('worker_threads');
+    const script = `
+      const { parentPort, workerData } = require('worker_threads');
+      const { encodePNGSync, decodeSync, decode } = require(workerData.addon);
+      const png = encodePNGSync(32, 32, workerData.data);
+      decode(png).then(image => {
+        const again = decodeSync(png);
+        parentPort.postMessage(Buffer.compare(image.data, again.data) === 0 && Buffer.compare(again.data, workerData.data) === 0);
+      });
+    `;
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    const run = () => new Promise((resolve, reject) => {
+      const worker = new Worker(script, { eval: true, workerData: { addon: path.join(__dirname, '..'), data } });
+      worker.once('message', resolve);
+      worker.once('error', reject);
+    });
+    assert.deepStrictEqual(await Promise.all([run(), run(), run()]), [true, true, true]);
+  });
+});
+
+describe('decodeInto', () => {
+  it('decodes into a SharedArrayBuffer with offset and stride', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'semitransparent.png'));
+    const offset = 16, stride = 128 * 4 + 8;
+    for (const premultiplied of [false, true]) {
+      const expected = await decodePNG(png, { premultiplied });
+      const dest = new SharedArrayBuffer(offset + stride * 128);
+      const result = await decodeInto(png, dest, { offset, stride, premultiplied });
+      assert.deepStrictEqual(result, { width: 128, height: 128, premultiplied });
+      const bytes = Buffer.from(dest);
+      for (let y = 0; y < 128; y++) {
+        const row = bytes.subarray(offset + y * stride, offset + y * stride + 128 * 4);
+        assert.strictEqual(Buffer.compare(row, expected.data.subarray(y * 128 * 4, (y + 1) * 128 * 4)), 0);
+      }
+      assert.strictEqual(bytes.readUInt32LE(0), 0);
+      assert.strictEqual(bytes.readUInt32LE(offset + 128 * 4), 0);
+    }
+  });
+
+  it('decodes fastest encoder output and WebP', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    const dest = Buffer.alloc(data.length);
+    const before = getDecodeStats();
+    await decodeInto(encodePNGSync(32, 32, data, { compressionLevel: -1 }), dest);
+    assert.strictEqual(getDecodeStats().fpng, before.fpng + 1);
+    assert.strictEqual(Buffer.compare(dest, data), 0);
+
+    const webp = fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp'));
+    const image = await decode(webp);
+    const pixels = new Uint8Array(image.data.length);
+    await decodeInto(webp, pixels);
+    assert.strictEqual(Buffer.compare(Buffer.from(pixels.buffer), image.data), 0);
+  });
+
+  it('rejects a destination that is too small', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    const dest = Buffer.alloc(32 * 32 * 4);
+    await assert.rejects(() => decodeInto(png, dest, { offset: 4 }), /Destination buffer too small/);
+    await assert.rejects(() => decodeInto(png, dest.subarray(1)), /Destination buffer too small/);
+    await assert.rejects(() => decodeInto(png, dest, { offset: dest.length + 1 }), /Invalid offset/);
+    assert(dest.every(b => b === 0));
+    await decodeInto(png, dest);
+    assert(!dest.every(b => b === 0));
+  });
+});
+
+describe('batches', () => {
+  it('decodes a batch and reports errors per item', async () => {
+    const names = ['rgba', 'pal', 'interlace', 'shino'];
+    const buffers = names.map(name => fs.readFileSync(path.join(__dirname, `${name}.png`)));
+    buffers.push(fs.readFileSync(path.join(__dirname, 'fail.png')), 'x', fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp')));
+
+    const results = await decodeBatch(buffers, { premultiplied: true });
+    assert.strictEqual(results.length, buffers.length);
+    for (let i = 0; i < names.length; i++) {
+      const expected = await decodePNG(buffers[i], { premultiplied: true });
+      assert.strictEqual(results[i].status, 'fulfilled');
+      assert.strictEqual(results[i].value.width, expected.width);
+      assert.strictEqual(results[i].value.premultiplied, true);
+      assert.strictEqual(Buffer.compare(results[i].value.data, expected.data), 0);
+    }
+    assert.strictEqual(results[4].status, 'rejected');
+    assert.match(results[5].reason.message, /Invalid arguments/);
+    assert.strictEqual(results[6].status, 'fulfilled');
+    assert.deepStrictEqual(await decodeBatch([]), []);
+  });
+
+  it('encodes a batch', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    const items = [-1, 1, 6].map(compressionLevel => ({ width: 32, height: 32, data, options: { compressionLevel } }));
+    items.push({ width: 32, height: 31, data });
+    const results = await encodeBatch(items);
+    for (let i = 0; i < 3; i++) {
+      assert.strictEqual(Buffer.compare(results[i].value, await encodePNG(32, 32, data, items[i].options)), 0);
+    }
+    assert.strictEqual(results[3].status, 'rejected');
+    assert.match(results[3].reason.message, /Invalid buffer size/);
+  });
+});
+
+describe('createPNGDecoder', () => {
+  function decodeStream(png, chunkSize, options) {
+    return new Promise((resolve, reject) => {
+      const decoder = createPNGDecoder(options);
+      const bands = [];
+      let header;
+      decoder.on('header', h => header = h);
+      decoder.on('data', band => bands.push(band));
+      decoder.on('error', reject);
+      decoder.on('end', () => resolve({ header, bands }));
+      for (let i = 0; i < png.length; i += chunkSize) {
+        decoder.write(png.subarray(i, i + chunkSize));
+      }
+      decoder.end();
+    });
+  }
+
+  ['rgba', 'pal', 'interlace', 'semitransparent'].forEach(name => it(`decodes chunked input (${name})`, async () => {
+    const png = fs.readFileSync(path.join(__dirname, `${name}.png`));
+    for (const premultiplied of [false, true]) {
+      const expected = await decodePNG(png, { premultiplied });
+      for (const chunkSize of [1, 1000, png.length]) {
+        if (chunkSize === 1 && png.length > 10000) continue;
+        const { header, bands } = await decodeStream(png, chunkSize, { premultiplied, bandHeight: 16 });
+        assert.deepStrictEqual(header, { width: expected.width, height: expected.height });
+        assert.strictEqual(bands[0].y, 0);
+        assert(bands.every(band => band.width === expected.width && band.height <= 16));
+        assert.strictEqual(Buffer.compare(Buffer.concat(bands.map(band => band.data)), expected.data), 0);
+      }
+    }
+  }));
+
+  it('pushes bands before the input ends', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'shino.png'));
+    const expected = await decodePNG(png);
+    const decoder = createPNGDecoder({ bandHeight: 8 });
+    const bands = [];
+    decoder.on('data', band => bands.push(band));
+    const firstBand = new Promise(resolve => decoder.once('data', resolve));
+    decoder.write(png.subarray(0, png.length >> 1));
+    const band = await firstBand;
+    assert.deepStrictEqual([band.y, band.width, band.height], [0, 200, 8]);
+    const end = new Promise((resolve, reject) => decoder.on('end', resolve).on('error', reject));
+    decoder.end(png.subarray(png.length >> 1));
+    await end;
+    assert.deepStrictEqual(bands.map(band => band.y), Array.from({ length: 25 }, (_, i) => i * 8));
+    assert.strictEqual(Buffer.compare(Buffer.concat(bands.map(band => band.data)), expected.data), 0);
+  });
+
+  it('fails on truncated or bad input', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    await assert.rejects(() => decodeStream(png.subarray(0, png.length - 20), 100), /unexpected end of stream/);
+    await assert.rejects(() => decodeStream(fs.readFileSync(path.join(__dirname, 'fail.png')), 100), /PNG decoding failed/);
+  });
+
+  it('decodes a piped file stream', async () => {
+    const file = path.join(__dirname, 'shino.png');
+    const expected = await decodePNG(fs.readFileSync(file));
+    const bands = [];
+    await new Promise((resolve, reject) => {
+      fs.createReadStream(file, { highWaterMark: 4096 }).pipe(createPNGDecoder())
+        .on('data', band => bands.push(band.data)).on('end', resolve).on('error', reject);
+    });
+    assert.strictEqual(Buffer.compare(Buffer.concat(bands), expected.data), 0);
+  });
+});
+
+describe('createPNGEncoder', () => {
+  function collect(stream) {
+    const chunks = [];
+    return new Promise((resolve, reject) => {
+      stream.on('data', chunk => chunks.push(chunk));
+      stream.on('end', () => resolve(Buffer.concat(chunks)));
+      stream.on('error', reject);
+    });
+  }
+
+  it('encodes rows written in bands', async () => {
+    const data = fs.readFileSync(path.join(__dirname, 'shino.data'));
+    const rowBytes = 200 * 4;
+    for (const compressionLevel of [1, 6]) {
+      const encoder = createPNGEncoder({ width: 200, height: 200, compressionLevel });
+      const output = collect(encoder);
+      for (let y = 0; y < 200; y += 48) {
+        await encoder.writeRows(data.subarray(y * rowBytes, Math.min(y + 48, 200) * rowBytes));
+      }
+      encoder.end();
+      const png = await output;
+      assert.strictEqual(Buffer.compare(png, await encodePNG(200, 200, data, { compressionLevel })), 0);
+      assert.strictEqual(Buffer.compare((await decodePNG(png)).data, data), 0);
+    }
+  });
+
+  it('encodes indexed images', async () => {
+    const palette = new Uint8ClampedArray([255, 0, 0, 255, 0, 0, 255, 128]);
+    const data = Buffer.alloc(16 * 16 * 4);
+    for (let i = 0; i < 16 * 16; i++) palette.slice((i & 1) * 4, (i & 1) * 4 + 4).forEach((c, j) => data[i * 4 + j] = c);
+    const encoder = createPNGEncoder({ width: 16, height: 16, palette });
+    const output = collect(encoder);
+    encoder.write(data.subarray(0, 16 * 4 * 5));
+    encoder.end(data.subarray(16 * 4 * 5));
+    const png = await output;
+    assert.strictEqual(Buffer.compare(png, await encodePNG(16, 16, data, { palette })), 0);
+  });
+
+  it('fails on partial rows and missing rows', async () => {
+    const encoder = createPNGEncoder({ width: 4, height: 4 });
+    encoder.on('error', () => {});
+    await assert.rejects(() => encoder.writeRows(Buffer.alloc(4 * 4 + 1)), /Invalid buffer size/);
+
+    const short = createPNGEncoder({ width: 4, height: 4 });
+    const output = collect(short);
+    await short.writeRows(Buffer.alloc(4 * 4 * 3));
+    short.end();
+    await assert.rejects(() => output, /3 of 4 rows written/);
+    assert.throws(() => createPNGEncoder({ width: 0, height: 4 }), /Invalid arguments/);
+  });
+});
+
+describe('probe', () => {
+  it('throws on invalid input', () => {
+    assert.throws(() => probe('x'), /Invalid arguments/);
+    assert.throws(() => probe(Buffer.from([0, 1, 2, 3])), /Unsupported image format/);
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    assert.throws(() => probe(png.subarray(0, 20)), /Invalid image header/);
+  });
+
+  const images = [
+    { name: 'rgba', width: 32, height: 32, bitDepth: 8, hasAlpha: true, interlaced: false },
+    { name: 'rgb', width: 32, height: 32, bitDepth: 8, hasAlpha: false, interlaced: false },
+    { name: 'gray_alpha', width: 32, height: 32, bitDepth: 8, hasAlpha: true, interlaced: false },
+    { name: '1bit', width: 300, height: 225, bitDepth: 1, hasAlpha: false, interlaced: false },
+    { name: 'interlace', width: 1024, height: 768, bitDepth: 8, hasAlpha: false, interlaced: true },
+  ];
+
+  images.forEach(({ name, ...expected }) => it(`reads the header (${name})`, () => {
+    const png = fs.readFileSync(path.join(__dirname, `${name}.png`));
+    assert.deepStrictEqual(probe(png), { format: 'png', ...expected, frames: 1, fpng: false });
+  }));
+
+  it('detects fpng-encoded files', () => {
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    assert.strictEqual(probe(encodePNGSync(32, 32, data, { compressionLevel: -1 })).fpng, true);
+    assert.strictEqual(probe(encodePNGSync(32, 32, data, { compressionLevel: 6 })).fpng, false);
+  });
+});
+
+describe('codec pool', () => {
+  const concurrency = getPoolStats().concurrency;
+  after(() => setConcurrency(concurrency));
+
+  it('throws on invalid concurrency', () => {
+    assert.throws(() => setConcurrency(0), /Invalid arguments/);
+    assert.throws(() => setConcurrency('4'), /Invalid arguments/);
+  });
+
+  it('runs interactive and background jobs', async () => {
+    setConcurrency(2);
+    const before = getPoolStats();
+    assert.strictEqual(before.concurrency, 2);
+
+    const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    const background = Array.from({ length: 4 }, () => encodePNG(32, 32, data, { priority: 'background' }));
+    const image = await decodePNG(png, { priority: 'interactive' });
+    assert.strictEqual(image.width, 32);
+    await Promise.all(background);
+
+    const after = getPoolStats();
+    assert.strictEqual(after.interactive.completed - before.interactive.completed, 1);
+    assert.strictEqual(after.background.completed - before.background.completed, 4);
+    for (const stats of [after.interactive, after.background]) {
+      assert.strictEqual(stats.queued, 0);
+      assert.strictEqual(stats.active, 0);
+      assert.ok(stats.waitTime >= 0 && stats.runTime > 0 && stats.maxWaitTime >= 0);
+    }
+  });
+});
+
+describe('abort', () => {
+  const data = fs.readFileSync(path.join(__dirname, 'rgba.data'));
+  const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+
+  it('rejects right away when the signal is already aborted', async () => {
+    const controller = new AbortController();
+    controller.abort();
+    const { signal } = controller;
+    await assert.rejects(() => encodePNG(32, 32, data, { signal }), { name: 'AbortError' });
+    await assert.rejects(() => decodePNG(png, { signal }), { name: 'AbortError' });
+    await assert.rejects(() => decodeInto(png, Buffer.alloc(32 * 32 * 4), { signal }), { name: 'AbortError' });
+    await assert.rejects(() => decodeBatch([png], { signal }), { name: 'AbortError' });
+    await assert.rejects(() => encodeBatch([{ width: 32, height: 32, data }], { signal }), { name: 'AbortError' });
+  });
+
+  it('stops a running encode', async () => {
+    const width = 4096, height = 4096;
+    const pixels = Buffer.alloc(width * height * 4);
+    for (let i = 0; i < pixels.length; i++) pixels[i] = (i * 2654435761) >>> 27;
+    const controller = new AbortController();
+    const encoded = encodePNG(width, height, pixels, { compressionLevel: 9, signal: controller.signal });
+    setTimeout(() => controller.abort(), 20);
+    await assert.rejects(() => encoded, { name: 'AbortError', code: 'ABORT_ERR' });
+  });
+
+  it('drops queued jobs', async () => {
+    const concurrency = getPoolStats().concurrency;
+    setConcurrency(1);
+    try {
+      const controller = new AbortController();
+      const jobs = Array.from({ length: 8 }, () => decodePNG(png, { signal: controller.signal }));
+      controller.abort();
+      const results = await Promise.allSettled(jobs);
+      assert.ok(results.every(result => result.status === 'rejected' && result.reason.name === 'AbortError'));
+    } finally {
+      setConcurrency(concurrency);
+    }
+  });
+
+  it('does not affect jobs that are not aborted', async () => {
+    const controller = new AbortController();
+    const image = await decodePNG(png, { signal: controller.signal });
+    assert.deepStrictEqual(image.data, data);
+    const buffer = await encodePNG(32, 32, data, { signal: controller.signal });
+    assert.deepStrictEqual((await decodePNG(buffer)).data, data);
+  });
+});
+
+describe('shrink-on-load', () => {
+  // average of each factor x factor block, for opaque images
+  function boxFilter({ data, width, height }, factor) {
+    const outWidth = Math.ceil(width / factor), outHeight = Math.ceil(height / factor);
+    const out = Buffer.alloc(outWidth * outHeight * 4);
+    for (let oy = 0; oy < outHeight; oy++) {
+      for (let ox = 0; ox < outWidth; ox++) {
+        const sums = [0, 0, 0];
+        let n = 0;
+        for (let y = oy * factor; y < Math.min(height, oy * factor + factor); y++) {
+          for (let x = ox * factor; x < Math.min(width, ox * factor + factor); x++, n++) {
+            for (let c = 0; c < 3; c++) sums[c] += data[(y * width + x) * 4 + c];
+          }
+        }
+        for (let c = 0; c < 3; c++) out[(oy * outWidth + ox) * 4 + c] = Math.floor((sums[c] + n / 2) / n);
+        out[(oy * outWidth + ox) * 4 + 3] = 255;
+      }
+    }
+    return { data: out, width: outWidth, height: outHeight };
+  }
+
+  for (const [name, scale] of [['rgb', 0.5], ['interlace', 0.125], ['1bit', 0.25]]) {
+    it(`averages blocks while decoding (${name}, ${scale})`, async () => {
+      const png = fs.readFileSync(path.join(__dirname, `${name}.png`));
+      const expected = boxFilter(decodeSync(png), 1 / scale);
+      const image = await decode(png, { scale });
+      assert.strictEqual(image.width, expected.width);
+      assert.strictEqual(image.height, expected.height);
+      assert.strictEqual(Buffer.compare(image.data, expected.data), 0);
+      assert.strictEqual(Buffer.compare(decodeSync(png, { scale }).data, expected.data), 0);
+    });
+  }
+
+  it('fits the image into maxWidth and maxHeight', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'shino.png'));
+    const image = await decodePNG(png, { maxWidth: 64, maxHeight: 100 });
+    assert.strictEqual(image.width, 50);
+    assert.strictEqual(image.height, 50);
+    assert.strictEqual((await decodePNG(png, { maxWidth: 500, maxHeight: 500 })).width, 200);
+    const webp = fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp'));
+    assert.strictEqual((await decode(webp, { maxWidth: 10, premultiplied: true })).width, 8);
+  });
+
+  it('decodes a batch of thumbnails', async () => {
+    const buffers = ['rgba', 'shino'].map(name => fs.readFileSync(path.join(__dirname, `${name}.png`)));
+    const results = await decodeBatch(buffers, { scale: 0.25 });
+    assert.deepStrictEqual(results.map(result => result.value.width), [8, 50]);
+  });
+
+  it('throws on invalid options', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    await assert.rejects(() => decodePNG(png, { scale: 0.3 }), /scale must be/);
+    await assert.rejects(() => decodePNG(png, { maxWidth: 0 }), /maxWidth and maxHeight/);
+    assert.throws(() => decodeSync(png, { scale: 2 }), /scale must be/);
+  });
+});
+
+describe('region decode', () => {
+  function crop({ data, width }, { x, y, w, h }) {
+    const out = Buffer.alloc(w * h * 4);
+    for (let row = 0; row < h; row++) {
+      data.copy(out, row * w * 4, ((y + row) * width + x) * 4, ((y + row) * width + x + w) * 4);
+    }
+    return out;
+  }
+
+  for (const file of ['rgb.png', 'interlace.png', 'semitransparent.png', 'rgba.lossless.webp']) {
+    it(`keeps only the rectangle (${file})`, async () => {
+      const buffer = fs.readFileSync(path.join(__dirname, file));
+      for (const premultiplied of [false, true]) {
+        const full = decodeSync(buffer, { premultiplied });
+        const region = { x: 3, y: 5, w: full.width - 7, h: 4 };
+        const image = await decode(buffer, { premultiplied, region });
+        assert.strictEqual(image.width, region.w);
+        assert.strictEqual(image.height, region.h);
+        assert.strictEqual(Buffer.compare(image.data, crop(full, region)), 0);
+        assert.strictEqual(Buffer.compare(decodeSync(buffer, { premultiplied, region }).data, image.data), 0);
+      }
+    });
+  }
+
+  it('shrinks the region', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'shino.png'));
+    const image = await decodePNG(png, { region: { x: 10, y: 20, w: 101, h: 50 }, scale: 0.5 });
+    assert.strictEqual(image.width, 51);
+    assert.strictEqual(image.height, 25);
+  });
+
+  it('rejects regions outside the image', async () => {
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    await assert.rejects(() => decodePNG(png, { region: { x: 30, y: 0, w: 3, h: 1 } }), /Region is outside the image/);
+    assert.throws(() => decodeSync(png, { region: { x: 0, y: 32, w: 1, h: 1 } }), /Region is outside the image/);
+    const [result] = await decodeBatch([png], { region: { x: 0, y: 0, w: 33, h: 1 } });
+    assert.match(result.reason.message, /Region is outside the image/);
+    await assert.rejects(() => decodePNG(png, { region: { x: 0, y: 0, w: 0, h: 1 } }), TypeError);
+  });
+});
+
+describe('pixel formats', () => {
+  const { data, width, height } = decodeSync(fs.readFileSync(path.join(__dirname, 'alpha_gradient.png')));
+
+  it('premultiplies like premultiplied decodes', () => {
+    const png = fs.readFileSync(path.join(__dirname, 'alpha_gradient.png'));
+    assert.strictEqual(Buffer.compare(premultiply(Buffer.from(data)), decodeSync(png, { premultiplied: true }).data), 0);
+    const pixels = Buffer.from([40, 80, 120, 128, 10, 20, 30, 0, 1, 2, 3, 255]);
+    assert.deepStrictEqual([...unpremultiply(pixels)], [79, 159, 239, 128, 0, 0, 0, 0, 1, 2, 3, 255]);
+  });
+
+  it('swizzles channels in place', () => {
+    const pixels = new Uint8Array([1, 2, 3, 4, 5, 6, 7, 8]);
+    assert.strictEqual(swizzle(pixels, 'rgba', 'bgra'), pixels);
+    assert.deepStrictEqual([...pixels], [3, 2, 1, 4, 7, 6, 5, 8]);
+    assert.deepStrictEqual([...new Uint8Array(swizzle(pixels.buffer, 'bgra', 'argb'))], [4, 1, 2, 3, 8, 5, 6, 7]);
+    assert.throws(() => swizzle(pixels, 'rgba', 'rgbb'), TypeError);
+    assert.throws(() => premultiply(Buffer.alloc(6)), TypeError);
+  });
+
+  for (const compressionLevel of [-1, 6]) {
+    for (const optimizeColorType of [false, true]) {
+      it(`encodes BGRA and premultiplied input (level ${compressionLevel}, optimizeColorType ${optimizeColorType})`, async () => {
+        const straight = unpremultiply(premultiply(Buffer.from(data)));
+        const inputs = {
+          'bgra': [swizzle(Buffer.from(data), 'rgba', 'bgra'), data],
+          'rgba-premul': [premultiply(Buffer.from(data)), straight],
+          'bgra-premul': [swizzle(premultiply(Buffer.from(data)), 'rgba', 'bgra'), straight],
+        };
+        for (const [inputFormat, [input, expected]] of Object.entries(inputs)) {
+          const copy = Buffer.from(input);
+          const png = await encodePNG(width, height, input, { compressionLevel, optimizeColorType, inputFormat });
+          assert.strictEqual(Buffer.compare(decodeSync(png).data, expected), 0, inputFormat);
+          assert.strictEqual(Buffer.compare(input, copy), 0);
+        }
+      });
+    }
+  }
+
+  it('encodes a sub-view with stride and offset', async () => {
+    const x = 3, y = 5, w = width - 7, h = height - 9;
+    const crop = Buffer.alloc(w * h * 4);
+    for (let row = 0; row < h; row++) {
+      data.copy(crop, row * w * 4, ((y + row) * width + x) * 4, ((y + row) * width + x + w) * 4);
+    }
+    const stride = width * 4, offset = (y * width + x) * 4;
+    for (const options of [{ compressionLevel: -1 }, { compressionLevel: 6 }, { compressionLevel: 6, optimizeColorType: true }, { inputFormat: 'rgba-premul' }]) {
+      const png = await encodePNG(w, h, data, { ...options, stride, offset });
+      assert.strictEqual(Buffer.compare(png, encodePNGSync(w, h, crop, options)), 0, JSON.stringify(options));
+    }
+    // the buffer only has to reach the end of the last row
+    const view = data.subarray(0, offset + (h - 1) * stride + w * 4);
+    assert.strictEqual(Buffer.compare(encodePNGSync(w, h, view, { stride, offset }), encodePNGSync(w, h, crop)), 0);
+    assert.throws(() => encodePNGSync(w, h, view.subarray(1), { stride, offset }), /Invalid buffer size/);
+    assert.throws(() => encodePNGSync(w, h, data, { stride: w * 4 - 1 }), /stride must be/);
+    assert.throws(() => encodePNGSync(w, h, data, { stride, offset: -4 }), /stride must be/);
+  });
+
+  it('rejects unknown input formats', () => {
+    assert.throws(() => encodePNGSync(width, height, data, { inputFormat: 'argb' }), /inputFormat must be/);
+    // only strings count, nothing else gets converted
+    const bgra = { toString: () => assert.fail('toString called') };
+    assert.throws(() => encodePNGSync(width, height, data, { inputFormat: bgra }), /inputFormat must be/);
+    assert.throws(() => encodePNGSync(width, height, data, { inputFormat: Symbol('rgba') }), /inputFormat must be/);
+  });
+});
+
+describe('16 bit', () => {
+  const png16 = fs.readFileSync(path.join(__dirname, '16bit.png'));
+
+  it('decodes 16 bit PNGs at full precision', async () => {
+    const { data, width, height } = await decode(png16, { pixelFormat: 'rgba16' });
+    assert(data instanceof Uint16Array);
+    assert.strictEqual(data.length, width * height * 4);
+    // the high bytes are what an 8 bit decode gives
+    const rgba = decodeSync(png16).data;
+    for (let i = 0; i < data.length; i++) {
+      assert.strictEqual(data[i] >> 8, rgba[i]);
+    }
+    assert(data.some((sample, i) => i % 4 !== 3 && (sample & 0xff) !== sample >> 8));
+
+    const be = decodePNGSync(png16, { pixelFormat: 'rgba16be' }).data;
+    assert(Buffer.isBuffer(be));
+    for (let i = 0; i < data.length; i++) {
+      assert.strictEqual(be.readUInt16BE(i * 2), data[i]);
+    }
+  });
+
+  it('widens 8 bit images', async () => {
+    for (const name of ['rgba.png', 'pal.gif', 'rgb.jpg']) {
+      const file = fs.readFileSync(path.join(__dirname, name));
+      const rgba = (await decode(file)).data;
+      const rgba16 = (await decode(file, { pixelFormat: 'rgba16' })).data;
+      assert.deepStrictEqual(rgba16, Uint16Array.from(rgba, x => x * 257), name);
+    }
+  });
+
+  it('round-trips through the encoder', async () => {
+    const { data, width, height } = decodeSync(png16, { pixelFormat: 'rgba16' });
+    const png = await encodePNG(width, height, Buffer.from(data.buffer, data.byteOffset, data.byteLength), { inputFormat: 'rgba16' });
+    assert.strictEqual(probe(png).bitDepth, 16);
+    assert.deepStrictEqual(decodeSync(png, { pixelFormat: 'rgba16' }).data, data);
+
+    // opaque, so optimizeColorType writes RGB
+    const rgb = encodePNGSync(width, height, data, { inputFormat: 'rgba16', optimizeColorType: true });
+    assert.strictEqual(probe(rgb).hasAlpha, false);
+    assert.deepStrictEqual(decodeSync(rgb, { pixelFormat: 'rgba16' }).data, data);
+
+    const gray = new Uint16Array(width * height).map((_, i) => i * 61);
+    const grayPng = encodePNGSync(width, height, gray, { inputFormat: 'gray16' });
+    const decoded = decodeSync(grayPng, { pixelFormat: 'rgba16' }).data;
+    assert.deepStrictEqual(decoded.filter((_, i) => i % 4 === 1), gray);
+  });
+
+  it('premultiplies and crops', async () => {
+    const samples = new Uint16Array([65535, 32768, 1000, 32768, 4000, 5000, 6000, 65535]);
+    const png = encodePNGSync(2, 1, samples, { inputFormat: 'rgba16' });
+    const { data } = await decodePNG(png, { pixelFormat: 'rgba16', premultiplied: true });
+    assert.deepStrictEqual(data, new Uint16Array([32768, 16384, 500, 32768, 4000, 5000, 6000, 65535]));
+    const region = decodeSync(png, { pixelFormat: 'rgba16', region: { x: 1, y: 0, w: 1, h: 1 } });
+    assert.deepStrictEqual(region.data, samples.subarray(4));
+  });
+
+  it('throws on invalid options', async () => {
+    assert.throws(() => decodeSync(png16, { pixelFormat: 'rgb48' }), /pixelFormat must be/);
+    assert.throws(() => decodeSync(png16, { pixelFormat: Symbol('rgba16') }), /pixelFormat must be/);
+    assert.throws(() => decodeSync(png16, { pixelFormat: 'rgba16', scale: 0.5 }), /8 bit pixel formats/);
+    assert.throws(() => encodePNGSync(2, 2, Buffer.alloc(16), { inputFormat: 'rgba16' }), /Invalid buffer size/);
+    assert.throws(() => encodePNGSync(1, 1, Buffer.alloc(8), { inputFormat: 'rgba16', palette: new Uint8ClampedArray(4) }), /8 bit RGBA/);
+  });
+});
+
+describe('decode pixel formats', () => {
+  const semi = fs.readFileSync(path.join(__dirname, 'semitransparent.png'));
+  // JFIF weights, rounded like wuffs
+  const luma = (r, g, b) => Math.floor(((19595 * r + 38470 * g + 7471 * b) * 257 + 32768) / 2 ** 24);
+
+  it('decodes to BGRA', async () => {
+    const rgba = decodeSync(semi).data;
+    assert.deepStrictEqual((await decode(semi, { pixelFormat: 'bgra' })).data, swizzle(Buffer.from(rgba), 'rgba', 'bgra'));
+    const premul = await decodePNG(semi, { pixelFormat: 'bgra-premul' });
+    assert.strictEqual(premul.premultiplied, true);
+    assert.deepStrictEqual(premul.data, swizzle(premultiply(Buffer.from(rgba)), 'rgba', 'bgra'));
+  });
+
+  it('decodes to RGB and gray, composited over black', async () => {
+    const premul = decodeSync(semi, { premultiplied: true }).data;
+    const { data, width, height } = await decode(semi, { pixelFormat: 'rgb' });
+    assert.strictEqual(data.length, width * height * 3);
+    assert.deepStrictEqual(data, Buffer.from(premul.filter((_, i) => i % 4 !== 3)));
+
+    const gray = decodeSync(semi, { pixelFormat: 'gray' }).data;
+    assert.strictEqual(gray.length, width * height);
+    for (let i = 0; i < gray.length; i++) {
+      assert.strictEqual(gray[i], luma(premul[i * 4], premul[i * 4 + 1], premul[i * 4 + 2]));
+    }
+  });
+
+  it('decodes to gray with alpha', async () => {
+    const rgba = decodeSync(semi).data;
+    const { data } = await decode(semi, { pixelFormat: 'graya' });
+    for (let i = 0; i < data.length / 2; i++) {
+      assert.strictEqual(data[i * 2], luma(rgba[i * 4], rgba[i * 4 + 1], rgba[i * 4 + 2]));
+      assert.strictEqual(data[i * 2 + 1], rgba[i * 4 + 3]);
+    }
+  });
+
+  it('converts cropped, shrunk and batch decodes too', async () => {
+    const shino = fs.readFileSync(path.join(__dirname, 'shino.png'));
+    const region = { x: 10, y: 20, w: 30, h: 40 };
+    const rgb = (await decode(shino, { pixelFormat: 'rgb', region })).data;
+    const rgba = (await decode(shino, { region })).data;
+    assert.deepStrictEqual(rgb, Buffer.from(rgba.filter((_, i) => i % 4 !== 3)));
+
+    const small = await decode(shino, { pixelFormat: 'gray', scale: 0.5 });
+    assert.strictEqual(small.data.length, small.width * small.height);
+    assert.strictEqual(small.width, 100);
+
+    const [result] = await decodeBatch([shino], { pixelFormat: 'bgra' });
+    assert.deepStrictEqual(result.value.data, swizzle(decodeSync(shino).data, 'rgba', 'bgra'));
+  });
+});
@@ -0,0 +1,59 @@
+const { encodeQOI, encodeQOISync, decodeQOI, decodeQOISync, decodePNG, decode, probe } = require('../');
+const fs = require('fs');
+const path = require('path');
+const assert = require('assert');
+
+describe('QOI', () => {
+  const images = ['rgba.png', 'pal.png', 'gray_alpha.png', 'alpha_gradient.png', 'semitransparent.png', 'shino.png'];
+
+  it('round-trips pixels exactly', async () => {
+    for (const name of images) {
+      const image = await decodePNG(fs.readFileSync(path.join(__dirname, name)));
+      const qoi = await encodeQOI(image.width, image.height, image.data);
+      assert.strictEqual(qoi.subarray(0, 4).toString(), 'qoif');
+      const decoded = await decodeQOI(qoi);
+      assert.strictEqual(decoded.width, image.width);
+      assert.strictEqual(decoded.height, image.height);
+      assert.strictEqual(Buffer.compare(decoded.data, image.data), 0, name);
+    }
+  });
+
+  it('marks opaque images as RGB', async () => {
+    const image = await decodePNG(fs.readFileSync(path.join(__dirname, 'shino.png')));
+    assert.strictEqual(encodeQOISync(image.width, image.height, image.data)[12], 3);
+    const alpha = await decodePNG(fs.readFileSync(path.join(__dirname, 'alpha_gradient.png')));
+    assert.strictEqual(encodeQOISync(alpha.width, alpha.height, alpha.data)[12], 4);
+  });
+
+  it('is auto-detected by decode and probe', async () => {
+    const image = await decodePNG(fs.readFileSync(path.join(__dirname, 'semitransparent.png')));
+    const qoi = encodeQOISync(image.width, image.height, image.data);
+    const info = probe(qoi);
+    assert.strictEqual(info.format, 'qoi');
+    assert.strictEqual(info.width, image.width);
+    assert.strictEqual(info.height, image.height);
+    const decoded = await decode(qoi, { premultiplied: true });
+    assert.strictEqual(decoded.format, 'qoi');
+    const premul = fs.readFileSync(path.join(__dirname, 'semitransparent.premul.data'));
+    assert.strictEqual(Buffer.compare(decoded.data, premul), 0);
+    assert.strictEqual(Buffer.compare(decodeQOISync(qoi, { premultiplied: true }).data, premul), 0);
+  });
+
+  it('rejects invalid input', async () => {
+    await assert.rejects(() => encodeQOI(2, 2, 'x'), /Invalid arguments/);
+    await assert.rejects(() => encodeQOI(3, 2, Buffer.alloc(16)), /Invalid buffer size/);
+    assert.throws(() => encodeQOISync(0, 0, Buffer.alloc(0)), /between 1 and 400 million/);
+    await assert.rejects(() => decodeQOI('x'));
+    const png = fs.readFileSync(path.join(__dirname, 'rgba.png'));
+    await assert.rejects(() => decodeQOI(png));
+    const image = await decodePNG(png);
+    const qoi = encodeQOISync(image.width, image.height, image.data);
+    await assert.rejects(() => decodeQOI(qoi.subarray(0, qoi.length >> 1)));
+  });
+
+  it('stops when aborted', async () => {
+    const controller = new AbortController();
+    controller.abort();
+    await assert.rejects(() => encodeQOI(2, 2, Buffer.alloc(16), { signal: controller.signal }), { name: 'AbortError' });
+  });
+});
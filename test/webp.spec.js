@@ -1,4 +1,4 @@
-const { decodeWebP, decodePNG, decode, encodePNG } = require('../');
+const { decodeWebP, decodePNG, decode, decodeSync, decodeWebPSync, decodeBatch, decodeInto, encodePNG, encodeWebPLossless, encodeWebPLosslessSync, probe } = require('../');
 const fs = require('fs');
 const path = require('path');
 const assert = require('assert');
@@ -62,6 +62,14 @@ describe('decodeWebP', () => {
     assert.strictEqual(image.data.length, 128 * 128 * 4);
   });
 
+  it('probes webp headers', () => {
+    const lossy = probe(fs.readFileSync(path.join(__dirname, 'rgb.lossy.webp')));
+    assert.deepStrictEqual(lossy, { format: 'webp', width: 32, height: 32, hasAlpha: false, bitDepth: 8, interlaced: false, frames: 1, fpng: false });
+    const lossless = probe(fs.readFileSync(path.join(__dirname, 'alpha.lossless.webp')));
+    assert.strictEqual(lossless.width, 128);
+    assert.strictEqual(lossless.hasAlpha, true);
+  });
+
   it('lossless round-trips PNG pixel values exactly (where alpha > 0)', async () => {
     // Decode the gradient PNG to get reference pixels, then decode
     // the same image as lossless WebP and compare.
@@ -208,6 +216,43 @@ describe('decode (auto-detect)', () => {
     assert.strictEqual(image.height, 32);
   });
 
+  it('decodes the other formats Wuffs supports', async () => {
+    const rgb = fs.readFileSync(path.join(__dirname, 'rgb.data'));
+    const bmp = await decode(fs.readFileSync(path.join(__dirname, 'rgb.bmp')));
+    assert.strictEqual(bmp.format, 'bmp');
+    assert.strictEqual(Buffer.compare(bmp.data, rgb), 0);
+
+    const gif = await decode(fs.readFileSync(path.join(__dirname, 'pal.gif')));
+    assert.strictEqual(gif.format, 'gif');
+    assert.strictEqual(Buffer.compare(gif.data, fs.readFileSync(path.join(__dirname, 'pal.data'))), 0);
+
+    const jpeg = await decode(fs.readFileSync(path.join(__dirname, 'rgb.jpg')), { premultiplied: true });
+    assert.strictEqual(jpeg.format, 'jpeg');
+    assert.strictEqual(jpeg.width, 32);
+    assert.strictEqual(jpeg.height, 32);
+    const error = jpeg.data.reduce((sum, value, i) => sum + Math.abs(value - rgb[i]), 0) / rgb.length;
+    assert(error < 4, `mean error ${error}`);
+
+    const ppm = Buffer.concat([Buffer.from('P6\n2 1\n255\n'), Buffer.from([1, 2, 3, 255, 128, 0])]);
+    assert.deepStrictEqual({ ...decodeSync(ppm), data: [...decodeSync(ppm).data] },
+      { data: [1, 2, 3, 255, 255, 128, 0, 255], width: 2, height: 1, premultiplied: false, format: 'npbm' });
+  });
+
+  it('reports the format of PNG and WebP', async () => {
+    assert.strictEqual((await decode(fs.readFileSync(path.join(__dirname, 'rgba.png')))).format, 'png');
+    assert.strictEqual(decodeSync(fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp'))).format, 'webp');
+  });
+
+  it('takes any format in decodeBatch and decodeInto', async () => {
+    const names = ['rgb.bmp', 'pal.gif', 'rgb.jpg', 'rgba.png'];
+    const results = await decodeBatch(names.map(name => fs.readFileSync(path.join(__dirname, name))));
+    assert.deepStrictEqual(results.map(result => result.value.format), ['bmp', 'gif', 'jpeg', 'png']);
+    const dest = Buffer.alloc(32 * 32 * 4);
+    await decodeInto(fs.readFileSync(path.join(__dirname, 'rgb.bmp')), dest);
+    assert.strictEqual(Buffer.compare(dest, fs.readFileSync(path.join(__dirname, 'rgb.data'))), 0);
+    await assert.rejects(() => decodeInto(Buffer.from([0, 1, 2, 3]), dest), /Unsupported image format/);
+  });
+
   it('passes decode options through', async () => {
     const webp = fs.readFileSync(path.join(__dirname, 'alpha.lossless.webp'));
     const image = await decode(webp, { premultiplied: true });
@@ -221,6 +266,14 @@ describe('decode (auto-detect)', () => {
     assert.strictEqual(Buffer.compare(fromDecode.data, fromDecodePNG.data), 0);
   });
 
+  it('decodes WebP synchronously', async () => {
+    const webp = fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp'));
+    const image = decodeSync(webp);
+    const expected = await decodeWebP(webp);
+    assert.strictEqual(Buffer.compare(image.data, expected.data), 0);
+    assert.throws(() => decodeWebPSync(fs.readFileSync(path.join(__dirname, 'vp8x.webp'))), /VP8X/);
+  });
+
   it('produces same result as calling decodeWebP directly', async () => {
     const webp = fs.readFileSync(path.join(__dirname, 'rgba.lossless.webp'));
     const fromDecode = await decode(webp);
@@ -228,3 +281,64 @@ describe('decode (auto-detect)', () => {
     assert.strictEqual(Buffer.compare(fromDecode.data, fromDecodeWebP.data), 0);
   });
 });
+
+describe('encodeWebPLossless', () => {
+  const images = ['rgba.png', 'pal.png', 'gray_alpha.png', 'alpha_gradient.png', 'shino.png', '1bit.png'];
+
+  it('round-trips pixels exactly at every effort', async () => {
+    for (const name of images) {
+      const image = await decodePNG(fs.readFileSync(path.join(__dirname, name)));
+      for (const effort of [0, 4, 9]) {
+        const webp = await encodeWebPLossless(image.width, image.height, image.data, { effort });
+        assert.strictEqual(probe(webp).format, 'webp');
+        const decoded = await decodeWebP(webp);
+        assert.strictEqual(decoded.width, image.width);
+        assert.strictEqual(decoded.height, image.height);
+        assert.strictEqual(Buffer.compare(decoded.data, image.data), 0, `${name} at effort ${effort}`);
+      }
+    }
+  });
+
+  it('is smaller than the PNG for UI-like images', async () => {
+    const width = 320, height = 200;
+    const data = Buffer.alloc(width * height * 4);
+    for (let y = 0; y < height; y++) {
+      for (let x = 0; x < width; x++) {
+        const i = (y * width + x) * 4;
+        const button = x > 40 && x < 280 && y > 60 && y < 140;
+        data[i] = button ? 30 : 240;
+        data[i + 1] = button ? 120 + (y & 31) : 240;
+        data[i + 2] = button ? 220 : 245;
+        data[i + 3] = 255;
+      }
+    }
+    const png = await encodePNG(width, height, data);
+    for (const effort of [0, 4]) {
+      const webp = await encodeWebPLossless(width, height, data, { effort });
+      assert(webp.length < png.length, `effort ${effort}: ${webp.length} >= ${png.length}`);
+    }
+    const shino = await decodePNG(fs.readFileSync(path.join(__dirname, 'shino.png')));
+    const shinoPng = await encodePNG(shino.width, shino.height, shino.data);
+    assert(encodeWebPLosslessSync(shino.width, shino.height, shino.data).length < shinoPng.length);
+  });
+
+  it('encodes synchronously', async () => {
+    const image = await decodePNG(fs.readFileSync(path.join(__dirname, 'rgba.png')));
+    const webp = encodeWebPLosslessSync(image.width, image.height, image.data, { effort: 2 });
+    assert.strictEqual(Buffer.compare(decodeWebPSync(webp).data, image.data), 0);
+  });
+
+  it('rejects invalid arguments', async () => {
+    const data = Buffer.alloc(16);
+    await assert.rejects(() => encodeWebPLossless(2, 2, 'x'), /Invalid arguments/);
+    await assert.rejects(() => encodeWebPLossless(3, 2, data), /Invalid buffer size/);
+    await assert.rejects(() => encodeWebPLossless(2, 2, data, { effort: 10 }), /effort/);
+    assert.throws(() => encodeWebPLosslessSync(16385, 1, Buffer.alloc(16385 * 4)), /16384/);
+  });
+
+  it('stops when aborted', async () => {
+    const controller = new AbortController();
+    controller.abort();
+    await assert.rejects(() => encodeWebPLossless(2, 2, Buffer.alloc(16), { signal: controller.signal }), { name: 'AbortError' });
+  });
+});